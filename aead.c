@@ -0,0 +1,405 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aead.h"
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void store32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void store64(uint8_t *p, uint64_t v) {
+    store32(p, (uint32_t) v);
+    store32(&p[4], (uint32_t) (v >> 32));
+}
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                        \
+    do {                                                                                           \
+        a += b;                                                                                    \
+        d = ROTL(d ^ a, 16);                                                                       \
+        c += d;                                                                                    \
+        b = ROTL(b ^ c, 12);                                                                       \
+        a += b;                                                                                    \
+        d = ROTL(d ^ a, 8);                                                                        \
+        c += d;                                                                                    \
+        b = ROTL(b ^ c, 7);                                                                        \
+    } while (0)
+
+// one 64-byte block of keystream for the state
+static void chacha20_block(uint8_t out[64], const uint32_t state[16]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        store32(&out[4 * i], x[i] + state[i]);
+    }
+}
+
+// Wide keystream runs many blocks at once, one block per vector lane, as in montvec.c.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AEAD_X86 1
+#include <immintrin.h>
+#else
+#define AEAD_X86 0
+#endif
+
+#if AEAD_X86
+
+// the double round on vectors of the sixteen state words, with add, xor and rotate supplied
+#define DOUBLE_ROUND(v, ADD, XOR, ROT)                                                             \
+    do {                                                                                           \
+        static const int order[8][4] = { { 0, 4, 8, 12 }, { 1, 5, 9, 13 }, { 2, 6, 10, 14 },       \
+            { 3, 7, 11, 15 }, { 0, 5, 10, 15 }, { 1, 6, 11, 12 }, { 2, 7, 8, 13 },                 \
+            { 3, 4, 9, 14 } };                                                                     \
+        for (int q = 0; q < 8; q++) {                                                              \
+            int a = order[q][0], b = order[q][1], c = order[q][2], d = order[q][3];                \
+            v[a] = ADD(v[a], v[b]);                                                                \
+            v[d] = ROT(XOR(v[d], v[a]), 16);                                                       \
+            v[c] = ADD(v[c], v[d]);                                                                \
+            v[b] = ROT(XOR(v[b], v[c]), 12);                                                       \
+            v[a] = ADD(v[a], v[b]);                                                                \
+            v[d] = ROT(XOR(v[d], v[a]), 8);                                                        \
+            v[c] = ADD(v[c], v[d]);                                                                \
+            v[b] = ROT(XOR(v[b], v[c]), 7);                                                        \
+        }                                                                                          \
+    } while (0)
+
+#define ROTL512(x, n) _mm512_rol_epi32(x, n)
+
+// XORs 16 blocks (1024 bytes) of keystream into in
+__attribute__((target("avx512f"))) static void chacha20_xor16(
+    uint8_t *out, const uint8_t *in, const uint32_t state[16]) {
+    __m512i s[16], v[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = _mm512_set1_epi32((int) state[i]);
+    }
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    s[12] = _mm512_add_epi32(s[12], lanes);
+    memcpy(v, s, sizeof(v));
+    for (int i = 0; i < 10; i++) {
+        DOUBLE_ROUND(v, _mm512_add_epi32, _mm512_xor_si512, ROTL512);
+    }
+
+    // Transpose so each block's words are contiguous. Within every 128-bit lane k, u[g][j]
+    // ends up holding words 4g..4g+3 of block 4k + j.
+    __m512i u[4][4];
+    for (int g = 0; g < 4; g++) {
+        __m512i a = _mm512_add_epi32(v[4 * g], s[4 * g]);
+        __m512i b = _mm512_add_epi32(v[4 * g + 1], s[4 * g + 1]);
+        __m512i c = _mm512_add_epi32(v[4 * g + 2], s[4 * g + 2]);
+        __m512i d = _mm512_add_epi32(v[4 * g + 3], s[4 * g + 3]);
+        __m512i t0 = _mm512_unpacklo_epi32(a, b), t1 = _mm512_unpackhi_epi32(a, b);
+        __m512i t2 = _mm512_unpacklo_epi32(c, d), t3 = _mm512_unpackhi_epi32(c, d);
+        u[g][0] = _mm512_unpacklo_epi64(t0, t2);
+        u[g][1] = _mm512_unpackhi_epi64(t0, t2);
+        u[g][2] = _mm512_unpacklo_epi64(t1, t3);
+        u[g][3] = _mm512_unpackhi_epi64(t1, t3);
+    }
+    // Then gather lane k of u[0..3][j] into block 4k + j.
+    for (int j = 0; j < 4; j++) {
+        __m512i p0 = _mm512_shuffle_i32x4(u[0][j], u[1][j], 0x44);
+        __m512i p1 = _mm512_shuffle_i32x4(u[0][j], u[1][j], 0xee);
+        __m512i p2 = _mm512_shuffle_i32x4(u[2][j], u[3][j], 0x44);
+        __m512i p3 = _mm512_shuffle_i32x4(u[2][j], u[3][j], 0xee);
+        __m512i blocks[4] = { _mm512_shuffle_i32x4(p0, p2, 0x88),
+            _mm512_shuffle_i32x4(p0, p2, 0xdd), _mm512_shuffle_i32x4(p1, p3, 0x88),
+            _mm512_shuffle_i32x4(p1, p3, 0xdd) };
+        for (int k = 0; k < 4; k++) {
+            uint64_t offset = 64 * (4 * k + j);
+            __m512i x = _mm512_loadu_si512((const void *) &in[offset]);
+            _mm512_storeu_si512((void *) &out[offset], _mm512_xor_si512(x, blocks[k]));
+        }
+    }
+}
+
+#define ROTL256(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// XORs 8 blocks (512 bytes) of keystream into in
+__attribute__((target("avx2"))) static void chacha20_xor8(
+    uint8_t *out, const uint8_t *in, const uint32_t state[16]) {
+    __m256i s[16], v[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = _mm256_set1_epi32((int) state[i]);
+    }
+    s[12] = _mm256_add_epi32(s[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    memcpy(v, s, sizeof(v));
+    for (int i = 0; i < 10; i++) {
+        DOUBLE_ROUND(v, _mm256_add_epi32, _mm256_xor_si256, ROTL256);
+    }
+
+    // Same transpose as chacha20_xor16(), with two 128-bit lanes per register.
+    __m256i u[4][4];
+    for (int g = 0; g < 4; g++) {
+        __m256i a = _mm256_add_epi32(v[4 * g], s[4 * g]);
+        __m256i b = _mm256_add_epi32(v[4 * g + 1], s[4 * g + 1]);
+        __m256i c = _mm256_add_epi32(v[4 * g + 2], s[4 * g + 2]);
+        __m256i d = _mm256_add_epi32(v[4 * g + 3], s[4 * g + 3]);
+        __m256i t0 = _mm256_unpacklo_epi32(a, b), t1 = _mm256_unpackhi_epi32(a, b);
+        __m256i t2 = _mm256_unpacklo_epi32(c, d), t3 = _mm256_unpackhi_epi32(c, d);
+        u[g][0] = _mm256_unpacklo_epi64(t0, t2);
+        u[g][1] = _mm256_unpackhi_epi64(t0, t2);
+        u[g][2] = _mm256_unpacklo_epi64(t1, t3);
+        u[g][3] = _mm256_unpackhi_epi64(t1, t3);
+    }
+    for (int j = 0; j < 4; j++) {
+        // halves of block j, then of block 4 + j
+        __m256i halves[4] = { _mm256_permute2x128_si256(u[0][j], u[1][j], 0x20),
+            _mm256_permute2x128_si256(u[2][j], u[3][j], 0x20),
+            _mm256_permute2x128_si256(u[0][j], u[1][j], 0x31),
+            _mm256_permute2x128_si256(u[2][j], u[3][j], 0x31) };
+        for (int k = 0; k < 2; k++) {
+            uint64_t offset = 64 * (4 * k + j);
+            __m256i x = _mm256_loadu_si256((const __m256i *) &in[offset]);
+            __m256i y = _mm256_loadu_si256((const __m256i *) &in[offset + 32]);
+            _mm256_storeu_si256((__m256i *) &out[offset], _mm256_xor_si256(x, halves[2 * k]));
+            _mm256_storeu_si256(
+                (__m256i *) &out[offset + 32], _mm256_xor_si256(y, halves[2 * k + 1]));
+        }
+    }
+}
+
+#endif
+
+//
+// XORs length bytes of ChaCha20 keystream into in, starting at block counter.
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t length,
+    const uint8_t key[AEAD_KEY_BYTES], uint32_t counter, const uint8_t nonce[AEAD_NONCE_BYTES]) {
+    // "expand 32-byte k", the key, the block counter and the nonce
+    uint32_t state[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+    for (int i = 0; i < 8; i++) {
+        state[4 + i] = load32(&key[4 * i]);
+    }
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) {
+        state[13 + i] = load32(&nonce[4 * i]);
+    }
+
+#if AEAD_X86
+    // Whole runs of blocks go through the widest kernel the CPU has, the rest one at a time.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        for (; length >= 1024; out += 1024, in += 1024, length -= 1024) {
+            chacha20_xor16(out, in, state);
+            state[12] += 16;
+        }
+    } else if (__builtin_cpu_supports("avx2")) {
+        for (; length >= 512; out += 512, in += 512, length -= 512) {
+            chacha20_xor8(out, in, state);
+            state[12] += 8;
+        }
+    }
+#endif
+
+    uint8_t block[64];
+    while (length > 0) {
+        chacha20_block(block, state);
+        size_t n = length < sizeof(block) ? length : sizeof(block);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] ^ block[i];
+        }
+        state[12] += 1;
+        out += n;
+        in += n;
+        length -= n;
+    }
+}
+
+//
+// Poly1305 over three 44/44/42-bit limbs with 128-bit products.
+// The AEAD construction pads everything to 16 bytes, so only whole blocks are ever absorbed.
+//
+__extension__ typedef unsigned __int128 uint128_t;
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+typedef struct {
+    uint64_t r[3]; // clamped key
+    uint64_t s[3]; // 20 * r, folds the reduction mod 2^130 - 5 into the multiply
+    uint64_t h[3]; // accumulator
+    uint8_t pad[16]; // added at the end
+} poly1305_t;
+
+static uint64_t load64(const uint8_t *p) {
+    return (uint64_t) load32(p) | (uint64_t) load32(&p[4]) << 32;
+}
+
+static void poly1305_init(poly1305_t *st, const uint8_t key[32]) {
+    uint64_t t0 = load64(&key[0]), t1 = load64(&key[8]);
+    st->r[0] = t0 & 0xffc0fffffffULL;
+    st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    st->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    for (int i = 0; i < 3; i++) {
+        st->s[i] = st->r[i] * (5 << 2);
+        st->h[i] = 0;
+    }
+    memcpy(st->pad, &key[16], 16);
+}
+
+// absorbs length bytes, a multiple of 16
+static void poly1305_blocks(poly1305_t *st, const uint8_t *m, size_t length) {
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t s1 = st->s[1], s2 = st->s[2];
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    for (; length >= 16; m += 16, length -= 16) {
+        // h += m, with the 2^128 bit of a whole block
+        uint64_t t0 = load64(&m[0]), t1 = load64(&m[8]);
+        h0 += t0 & MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+        h2 += ((t1 >> 24) & MASK42) | ((uint64_t) 1 << 40);
+
+        // h *= r mod 2^130 - 5
+        uint128_t d0 = (uint128_t) h0 * r0 + (uint128_t) h1 * s2 + (uint128_t) h2 * s1;
+        uint128_t d1 = (uint128_t) h0 * r1 + (uint128_t) h1 * r0 + (uint128_t) h2 * s2;
+        uint128_t d2 = (uint128_t) h0 * r2 + (uint128_t) h1 * r1 + (uint128_t) h2 * r0;
+
+        // partial carry propagation, enough to keep the limbs in range for the next block
+        uint64_t c = (uint64_t) (d0 >> 44);
+        h0 = (uint64_t) d0 & MASK44;
+        d1 += c;
+        c = (uint64_t) (d1 >> 44);
+        h1 = (uint64_t) d1 & MASK44;
+        d2 += c;
+        c = (uint64_t) (d2 >> 42);
+        h2 = (uint64_t) d2 & MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= MASK44;
+        h1 += c;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+// absorbs data followed by zeros up to a multiple of 16 bytes
+static void poly1305_padded(poly1305_t *st, const uint8_t *data, size_t length) {
+    size_t whole = length & ~(size_t) 15;
+    poly1305_blocks(st, data, whole);
+    if (whole < length) {
+        uint8_t block[16] = { 0 };
+        memcpy(block, &data[whole], length - whole);
+        poly1305_blocks(st, block, sizeof(block));
+    }
+}
+
+static void poly1305_finish(poly1305_t *st, uint8_t tag[16]) {
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    // full carry propagation
+    uint64_t c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+
+    // g = h + 5 - 2^130; take g instead of h if it did not go negative, without branching
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= MASK44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= MASK44;
+    uint64_t g2 = h2 + c - ((uint64_t) 1 << 42);
+    uint64_t select = (g2 >> 63) - 1;
+    h0 = (h0 & ~select) | (g0 & select);
+    h1 = (h1 & ~select) | (g1 & select);
+    h2 = (h2 & ~select) | (g2 & select);
+
+    // h mod 2^128, plus the pad
+    uint64_t t0 = load64(&st->pad[0]), t1 = load64(&st->pad[8]);
+    h0 += t0 & MASK44;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += ((t1 >> 24) & MASK42) + c;
+    h2 &= MASK42;
+    store64(&tag[0], h0 | (h1 << 44));
+    store64(&tag[8], (h1 >> 20) | (h2 << 24));
+}
+
+// the tag over aad and ciphertext, keyed by the first keystream block
+static void aead_tag(uint8_t tag[AEAD_TAG_BYTES], const uint8_t *aad, size_t aad_length,
+    const uint8_t *cipher, size_t length, const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES]) {
+    uint8_t block[64] = { 0 };
+    chacha20_xor(block, block, sizeof(block), key, 0, nonce);
+
+    poly1305_t st;
+    poly1305_init(&st, block);
+    poly1305_padded(&st, aad, aad_length);
+    poly1305_padded(&st, cipher, length);
+    uint8_t lengths[16];
+    store64(&lengths[0], aad_length);
+    store64(&lengths[8], length);
+    poly1305_blocks(&st, lengths, sizeof(lengths));
+    poly1305_finish(&st, tag);
+}
+
+//
+// Encrypts and authenticates a message.
+//
+void aead_seal(uint8_t *out, uint8_t tag[AEAD_TAG_BYTES], const uint8_t *in, size_t length,
+    const uint8_t *aad, size_t aad_length, const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES]) {
+    chacha20_xor(out, in, length, key, 1, nonce);
+    aead_tag(tag, aad, aad_length, out, length, key, nonce);
+}
+
+//
+// Checks the tag of a message and decrypts it. Nothing is written to out if the check fails.
+//
+bool aead_open(uint8_t *out, const uint8_t *in, size_t length, const uint8_t tag[AEAD_TAG_BYTES],
+    const uint8_t *aad, size_t aad_length, const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES]) {
+    uint8_t expected[AEAD_TAG_BYTES];
+    aead_tag(expected, aad, aad_length, in, length, key, nonce);
+
+    // compare every byte, so the time taken does not say where a forged tag went wrong
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_BYTES; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+    chacha20_xor(out, in, length, key, 1, nonce);
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// ChaCha20-Poly1305 authenticated encryption (RFC 8439), self-contained.
+// Used by the hybrid file format to stream bulk data under an SS-wrapped session key.
+//
+#define AEAD_KEY_BYTES   32
+#define AEAD_NONCE_BYTES 12
+#define AEAD_TAG_BYTES   16
+
+//
+// XORs length bytes of ChaCha20 keystream into in, starting at block counter.
+//
+// out: output, may be the same buffer as in
+// in: input bytes
+// length: number of bytes
+// key: 256-bit key
+// counter: first 64-byte block number
+// nonce: 96-bit nonce
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t length,
+    const uint8_t key[AEAD_KEY_BYTES], uint32_t counter, const uint8_t nonce[AEAD_NONCE_BYTES]);
+
+//
+// Encrypts and authenticates a message.
+//
+// out: length bytes of ciphertext, may be the same buffer as in
+// tag: authentication tag over aad and the ciphertext
+// in: plaintext
+// length: bytes of plaintext
+// aad: additional data that is authenticated but not encrypted, NULL if aad_length is 0
+// aad_length: bytes of additional data
+// key: 256-bit key
+// nonce: 96-bit nonce, never reused with the same key
+//
+void aead_seal(uint8_t *out, uint8_t tag[AEAD_TAG_BYTES], const uint8_t *in, size_t length,
+    const uint8_t *aad, size_t aad_length, const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES]);
+
+//
+// Checks the tag of a message and decrypts it. Nothing is written to out if the check fails.
+//
+// Returns true if the tag matched.
+//
+// out: length bytes of plaintext, may be the same buffer as in
+// in: ciphertext
+// length: bytes of ciphertext
+// tag: authentication tag from aead_seal()
+// aad: additional data passed to aead_seal(), NULL if aad_length is 0
+// aad_length: bytes of additional data
+// key: 256-bit key
+// nonce: 96-bit nonce
+//
+bool aead_open(uint8_t *out, const uint8_t *in, size_t length, const uint8_t tag[AEAD_TAG_BYTES],
+    const uint8_t *aad, size_t aad_length, const uint8_t key[AEAD_KEY_BYTES],
+    const uint8_t nonce[AEAD_NONCE_BYTES]);
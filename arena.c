@@ -0,0 +1,208 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "arena.h"
+
+// Every block starts with a header naming its class, so blocks may be freed on any thread.
+// 16 bytes keeps the payload as aligned as malloc() returns it.
+#define HEADER_SIZE 16
+#define LARGE       UINT32_MAX
+
+typedef struct block {
+    struct block *next;
+} block_t;
+
+typedef struct {
+    block_t *lists[ARENA_CLASSES]; // free blocks, linked through their payload
+    uint32_t counts[ARENA_CLASSES];
+    arena_stats_t stats;
+    bool registered; // true once the exit destructor is set up for this thread
+} cache_t;
+
+static _Thread_local cache_t cache;
+
+// biggest class handed out of the free lists, lowered by arena_fit()
+static uint32_t top_class = ARENA_CLASSES - 1;
+
+// totals from threads that have exited
+static arena_stats_t retired;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static void add_stats(arena_stats_t *total, arena_stats_t *stats) {
+    total->allocs += stats->allocs;
+    total->reallocs += stats->reallocs;
+    total->frees += stats->frees;
+    total->reused += stats->reused;
+    total->fresh += stats->fresh;
+    total->large += stats->large;
+}
+
+// runs when a thread that used the arena exits: hand back its blocks and keep its counts
+static void thread_exit(void *arg) {
+    cache_t *own = (cache_t *) arg;
+    for (uint32_t c = 0; c < ARENA_CLASSES; c++) {
+        while (own->lists[c] != NULL) {
+            block_t *b = own->lists[c];
+            own->lists[c] = b->next;
+            free((uint8_t *) b - HEADER_SIZE);
+        }
+        own->counts[c] = 0;
+    }
+    pthread_mutex_lock(&retired_lock);
+    add_stats(&retired, &own->stats);
+    pthread_mutex_unlock(&retired_lock);
+    memset(&own->stats, 0, sizeof(own->stats));
+    own->registered = false;
+}
+
+static void exit_key_init(void) {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+static cache_t *own_cache(void) {
+    if (!cache.registered) {
+        pthread_once(&exit_once, exit_key_init);
+        pthread_setspecific(exit_key, &cache);
+        cache.registered = true;
+    }
+    return &cache;
+}
+
+// smallest class holding size bytes, or LARGE if none is pooled
+static uint32_t class_of(size_t size) {
+    uint32_t c = 0;
+    while (c <= top_class && ((size_t) ARENA_MIN_CLASS << c) < size) {
+        c += 1;
+    }
+    return c <= top_class ? c : LARGE;
+}
+
+static void *block_alloc(cache_t *own, size_t size) {
+    uint32_t c = class_of(size);
+    uint8_t *raw;
+    if (c == LARGE) {
+        own->stats.large += 1;
+        raw = (uint8_t *) malloc(HEADER_SIZE + size);
+    } else if (own->lists[c] != NULL) {
+        own->stats.reused += 1;
+        block_t *b = own->lists[c];
+        own->lists[c] = b->next;
+        own->counts[c] -= 1;
+        return b;
+    } else {
+        own->stats.fresh += 1;
+        raw = (uint8_t *) malloc(HEADER_SIZE + ((size_t) ARENA_MIN_CLASS << c));
+    }
+    if (raw == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        abort();
+    }
+    memcpy(raw, &c, sizeof(c));
+    return raw + HEADER_SIZE;
+}
+
+static void block_free(cache_t *own, void *ptr) {
+    uint8_t *raw = (uint8_t *) ptr - HEADER_SIZE;
+    uint32_t c;
+    memcpy(&c, raw, sizeof(c));
+    if (c > top_class || own->counts[c] >= ARENA_CACHED) {
+        free(raw);
+        return;
+    }
+    block_t *b = (block_t *) ptr;
+    b->next = own->lists[c];
+    own->lists[c] = b;
+    own->counts[c] += 1;
+}
+
+static void *arena_alloc(size_t size) {
+    cache_t *own = own_cache();
+    own->stats.allocs += 1;
+    return block_alloc(own, size);
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size) {
+    cache_t *own = own_cache();
+    own->stats.reallocs += 1;
+
+    // still fits the block it already has
+    uint32_t c;
+    memcpy(&c, (uint8_t *) ptr - HEADER_SIZE, sizeof(c));
+    if (c != LARGE && new_size <= ((size_t) ARENA_MIN_CLASS << c)) {
+        return ptr;
+    }
+
+    void *moved = block_alloc(own, new_size);
+    memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    block_free(own, ptr);
+    return moved;
+}
+
+static void arena_free(void *ptr, size_t size) {
+    (void) size;
+    cache_t *own = own_cache();
+    own->stats.frees += 1;
+    block_free(own, ptr);
+}
+
+//
+// Installs the arena as GMP's allocator with mp_set_memory_functions().
+// Must be called before any GMP number is initialized, since blocks from the default allocator
+// cannot be handed to the arena.
+//
+void arena_enable(void) {
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+//
+// Sizes the classes for a key: numbers up to a few times the key size are pooled, anything
+// larger bypasses the free lists. Call before starting any threads.
+//
+// bits: bits in the largest modulus in use
+//
+void arena_fit(uint64_t bits) {
+    // products of two numbers below the modulus, plus room for GMP's extra limbs
+    uint64_t bytes = 2 * ((bits + 63) / 64 + 2) * sizeof(uint64_t);
+    uint32_t c = 0;
+    while (c < ARENA_CLASSES - 1 && ((uint64_t) ARENA_MIN_CLASS << c) < bytes) {
+        c += 1;
+    }
+    top_class = c;
+}
+
+//
+// Adds up the statistics of the calling thread and every thread that has exited.
+//
+// stats: filled with the totals
+//
+void arena_stats(arena_stats_t *stats) {
+    pthread_mutex_lock(&retired_lock);
+    *stats = retired;
+    pthread_mutex_unlock(&retired_lock);
+    add_stats(stats, &cache.stats);
+}
+
+//
+// Prints arena_stats() as one line.
+//
+// file: open and writable file stream
+//
+void arena_report(FILE *file) {
+    arena_stats_t stats;
+    arena_stats(&stats);
+    uint64_t handed = stats.reused + stats.fresh;
+    fprintf(file,
+        "arena: allocs = %lu, reallocs = %lu, frees = %lu, reused = %lu (%.1f%%), malloc = %lu, "
+        "large = %lu\n",
+        (unsigned long) stats.allocs, (unsigned long) stats.reallocs, (unsigned long) stats.frees,
+        (unsigned long) stats.reused, handed ? 100.0 * stats.reused / handed : 0.0,
+        (unsigned long) stats.fresh, (unsigned long) stats.large);
+}
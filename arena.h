@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Arena allocator for GMP.
+//
+// Once enabled, every block GMP allocates comes from per-thread free lists of power-of-two
+// size classes, so threads stop contending on the global malloc() for mpz temporaries.
+// Blocks larger than the biggest class go straight to malloc().
+//
+#define ARENA_MIN_CLASS 16 // smallest class in bytes, two 64-bit limbs
+#define ARENA_CLASSES   24 // classes up to ARENA_MIN_CLASS << 23 bytes
+#define ARENA_CACHED    64 // most free blocks a thread keeps per class
+
+typedef struct {
+    uint64_t allocs; // allocations requested by GMP
+    uint64_t reallocs; // reallocations requested by GMP
+    uint64_t frees; // frees requested by GMP
+    uint64_t reused; // blocks handed out from a free list
+    uint64_t fresh; // blocks that had to come from malloc()
+    uint64_t large; // requests too big for any class, passed to malloc()
+} arena_stats_t;
+
+//
+// Installs the arena as GMP's allocator with mp_set_memory_functions().
+// Must be called before any GMP number is initialized, since blocks from the default allocator
+// cannot be handed to the arena.
+//
+void arena_enable(void);
+
+//
+// Sizes the classes for a key: numbers up to a few times the key size are pooled, anything
+// larger bypasses the free lists. Call before starting any threads.
+//
+// bits: bits in the largest modulus in use
+//
+void arena_fit(uint64_t bits);
+
+//
+// Adds up the statistics of the calling thread and every thread that has exited.
+//
+// stats: filled with the totals
+//
+void arena_stats(arena_stats_t *stats);
+
+//
+// Prints arena_stats() as one line.
+//
+// file: open and writable file stream
+//
+void arena_report(FILE *file);
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h> //atof
+#include <string.h>
+#include <unistd.h> //getopt().
+#include <time.h>
+#include <gmp.h>
+#include <sys/resource.h>
+
+#include "ss.h"
+#include "pool.h"
+#include "montvec.h"
+#include "numtheory.h"
+#include "randstate.h"
+
+#define OPTIONS "b:z:k:l:t:i:s:h"
+
+// most sizes or key sizes accepted in one list
+#define MAX_LIST 16
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// parses a size such as 4096, 64K, 16M or 1G
+static uint64_t parse_size(const char *text) {
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'k':
+    case 'K': value <<= 10; break;
+    case 'm':
+    case 'M': value <<= 20; break;
+    case 'g':
+    case 'G': value <<= 30; break;
+    default: break;
+    }
+    return value;
+}
+
+// parses a comma-separated list of sizes, returns how many were read
+static int parse_list(char *text, uint64_t list[]) {
+    int count = 0;
+    for (char *item = strtok(text, ","); item != NULL && count < MAX_LIST;
+         item = strtok(NULL, ",")) {
+        list[count++] = parse_size(item);
+    }
+    return count;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// prints p50/p90/p99/max of the samples in microseconds as a JSON object
+static void print_percentiles(double *samples, uint64_t count) {
+    qsort(samples, count, sizeof(double), compare_double);
+    double p50 = count ? samples[(count - 1) * 50 / 100] : 0;
+    double p90 = count ? samples[(count - 1) * 90 / 100] : 0;
+    double p99 = count ? samples[(count - 1) * 99 / 100] : 0;
+    double max = count ? samples[count - 1] : 0;
+    printf("{\"samples\": %lu, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}",
+        (unsigned long) count, p50 * 1e6, p90 * 1e6, p99 * 1e6, max * 1e6);
+}
+
+// fills a temporary file with size random bytes
+static FILE *random_file(uint64_t size) {
+    FILE *file = tmpfile();
+    uint8_t buffer[1 << 16];
+    while (size > 0) {
+        uint64_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        for (uint64_t i = 0; i < chunk; i++) {
+            buffer[i] = random();
+        }
+        fwrite(buffer, sizeof(uint8_t), chunk, file);
+        size -= chunk;
+    }
+    rewind(file);
+    return file;
+}
+
+// true if both files hold the same bytes
+static bool same_contents(FILE *a, FILE *b) {
+    rewind(a);
+    rewind(b);
+    int x, y;
+    do {
+        x = fgetc(a);
+        y = fgetc(b);
+    } while (x == y && x != EOF);
+    return x == y;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+
+    char default_bits[] = "512,1024,2048";
+    char default_sizes[] = "1K,64K";
+    char *bits_text = default_bits;
+    char *sizes_text = default_sizes;
+    uint32_t keys = 4, latency_samples = 200, threads = 1, iters = 50;
+    uint32_t seed = 2023;
+
+    // help_message
+    const char *help_message
+        = "SYNOPSIS\n"
+          "   Benchmarks SS key generation, encryption and decryption in-process.\n"
+          "   Results are printed to stdout as JSON.\n"
+          "\n"
+          "USAGE\n"
+          "   ./bench [OPTIONS]\n"
+          "\n"
+          "OPTIONS\n"
+          "   -h              Display program help and usage.\n"
+          "   -b bits         Comma-separated key sizes (default: 512,1024,2048).\n"
+          "   -z sizes        Comma-separated input sizes, K/M/G suffixes allowed (default: 1K,64K).\n"
+          "   -k keys         Key pairs generated per key size for keys/s (default: 4).\n"
+          "   -l samples      Blocks timed individually for latency percentiles (default: 200).\n"
+          "   -t threads      Threads for file encryption and decryption (default: 1).\n"
+          "   -i iterations   Miller-Rabin iterations for testing primes (default: 50).\n"
+          "   -s seed         Random seed (default: 2023).\n";
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'b': bits_text = optarg; break;
+        case 'z': sizes_text = optarg; break;
+        case 'k': keys = atoi(optarg); break;
+        case 'l': latency_samples = atoi(optarg); break;
+        case 't':
+            if (!pool_parse_threads(&threads, optarg)) {
+                fprintf(stderr, "Error: invalid number of threads -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i': iters = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 'h': printf("%s", help_message); return 1;
+        default:
+            fprintf(stderr,
+                "Usage: %s [-b bits] [-z sizes] [-k keys] [-l samples] [-t threads] [-i iterations] "
+                "[-s seed] [-h]\n",
+                argv[0]);
+            exit(1);
+        }
+    }
+
+    uint64_t bit_list[MAX_LIST], size_list[MAX_LIST];
+    int bit_count = parse_list(bits_text, bit_list);
+    int size_count = parse_list(sizes_text, size_list);
+
+    randstate_init(seed);
+
+    mpz_t p, q, n, d, pq, m, c;
+    mpz_inits(p, q, n, d, pq, m, c, NULL);
+    ss_crt_t crt;
+    ss_crt_init(&crt);
+
+    double *samples = (double *) malloc((latency_samples + 1) * sizeof(double));
+
+    // blocks for the batch throughput runs
+    mpz_t *plain = (mpz_t *) malloc((latency_samples + 1) * sizeof(mpz_t));
+    mpz_t *cipher = (mpz_t *) malloc((latency_samples + 1) * sizeof(mpz_t));
+    for (uint32_t i = 0; i <= latency_samples; i++) {
+        mpz_inits(plain[i], cipher[i], NULL);
+    }
+
+    // the kernel the file runs use, restored after timing the others
+    const char *kernel = montvec_kernel()->name;
+
+    printf("{\n  \"threads\": %u,\n  \"kernel\": \"%s\",\n  \"results\": [", threads, kernel);
+    for (int b = 0; b < bit_count; b++) {
+        // Key generation rate: the last pair generated is used for the runs below.
+        double start = now();
+        for (uint32_t i = 0; i < keys; i++) {
+            ss_make_pub(p, q, n, bit_list[b], iters);
+            ss_make_priv(d, pq, p, q);
+            ss_make_crt(&crt, d, p, q);
+        }
+        double keygen_seconds = now() - start;
+
+        printf("%s\n    {\n      \"bits\": %lu,\n", b ? "," : "", (unsigned long) bit_list[b]);
+        printf("      \"keygen\": {\"keys\": %u, \"seconds\": %.6f, \"keys_per_sec\": %.3f},\n", keys,
+            keygen_seconds, keygen_seconds > 0 ? keys / keygen_seconds : 0);
+
+        // Per-block latency through the single-block API, on blocks as large as the file
+        // functions use.
+        mpz_sqrt(m, n);
+        uint64_t k = (mpz_sizeinbase(m, 2) - 1) / 8;
+        for (uint32_t i = 0; i < latency_samples; i++) {
+            mpz_urandomb(m, state, 8 * (k - 1));
+            mpz_setbit(m, 8 * k - 1);
+            start = now();
+            ss_encrypt(c, m, n);
+            samples[i] = now() - start;
+        }
+        printf("      \"block_bytes\": %lu,\n      \"encrypt_block_us\": ", (unsigned long) k);
+        print_percentiles(samples, latency_samples);
+        for (uint32_t i = 0; i < latency_samples; i++) {
+            mpz_urandomb(m, state, 8 * (k - 1));
+            mpz_setbit(m, 8 * k - 1);
+            ss_encrypt(c, m, n);
+            start = now();
+            ss_decrypt_crt(m, c, &crt);
+            samples[i] = now() - start;
+        }
+        printf(",\n      \"decrypt_block_us\": ");
+        print_percentiles(samples, latency_samples);
+
+        // Batch encryption throughput on one thread for every kernel this CPU can run.
+        for (uint32_t i = 0; i < latency_samples; i++) {
+            mpz_urandomb(plain[i], state, 8 * (k - 1));
+            mpz_setbit(plain[i], 8 * k - 1);
+        }
+        printf(",\n      \"encrypt_batch\": [");
+        for (size_t i = 0, printed = 0; montvec_kernel_at(i) != NULL; i++) {
+            if (!montvec_set_kernel(montvec_kernel_at(i)->name)) {
+                continue;
+            }
+            ss_ctx_t ctx;
+            ss_ctx_init_encrypt(&ctx, n);
+            start = now();
+            ss_encrypt_batch_ctx(&ctx, cipher, plain, latency_samples);
+            double seconds = now() - start;
+            printf("%s{\"kernel\": \"%s\", \"lanes\": %u, \"blocks_per_sec\": %.1f}",
+                printed++ ? ", " : "", ctx.vec.kernel->name, ctx.vec.lanes,
+                seconds > 0 ? latency_samples / seconds : 0);
+            ss_ctx_clear(&ctx);
+        }
+        printf("]");
+        montvec_set_kernel(kernel);
+        printf(",\n      \"files\": [");
+
+        // File throughput for each input size.
+        for (int z = 0; z < size_count; z++) {
+            FILE *plain = random_file(size_list[z]);
+            FILE *cipher = tmpfile();
+            FILE *output = tmpfile();
+
+            start = now();
+            ss_encrypt_file_mt(plain, cipher, n, threads, NULL);
+            fflush(cipher);
+            double encrypt_seconds = now() - start;
+
+            rewind(cipher);
+            start = now();
+            ss_decrypt_file_mt(cipher, output, d, pq, &crt, threads, NULL);
+            fflush(output);
+            double decrypt_seconds = now() - start;
+
+            double mb = size_list[z] / 1e6;
+            printf("%s\n        {\"bytes\": %lu, \"encrypt_seconds\": %.6f, \"encrypt_mb_per_sec\": %.4f, "
+                   "\"decrypt_seconds\": %.6f, \"decrypt_mb_per_sec\": %.4f, \"ok\": %s}",
+                z ? "," : "", (unsigned long) size_list[z], encrypt_seconds,
+                encrypt_seconds > 0 ? mb / encrypt_seconds : 0, decrypt_seconds,
+                decrypt_seconds > 0 ? mb / decrypt_seconds : 0,
+                same_contents(plain, output) ? "true" : "false");
+
+            fclose(plain);
+            fclose(cipher);
+            fclose(output);
+        }
+        printf("\n      ]\n    }");
+        fflush(stdout);
+    }
+
+    // ru_maxrss is reported in kilobytes on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\n  ],\n  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+
+    for (uint32_t i = 0; i <= latency_samples; i++) {
+        mpz_clears(plain[i], cipher[i], NULL);
+    }
+    free(plain);
+    free(cipher);
+    free(samples);
+    ss_crt_clear(&crt);
+    mpz_clears(p, q, n, d, pq, m, c, NULL);
+    randstate_clear();
+}
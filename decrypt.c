@@ -1,22 +1,84 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h> //atof
+#include <string.h>
 #include <unistd.h> //getopt().
+#include <getopt.h> //getopt_long().
+#include <ctype.h>
 #include <time.h>
 #include <gmp.h>
 #include <sys/stat.h>
 
 #include "ss.h"
+#include "pool.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "arena.h"
+#include "keycache.h"
+#include "stats.h"
+#include "ssproto.h"
+#include "ssindex.h"
+#include "keyring.h"
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:f:pHcvh"
+
+// --stats takes an optional format, so it is only spelled --stats or --stats=format
+static struct option long_options[] = { { "stats", optional_argument, NULL, 'S' },
+    { "range", required_argument, NULL, 'R' }, { "socket", required_argument, NULL, 'D' },
+    { "key", required_argument, NULL, 'K' }, { NULL, 0, NULL, 0 } };
+
+// parses a decimal byte count, returns false unless all of text is digits that fit in 64 bits
+static bool parse_count(uint64_t *count, const char *text, const char **end) {
+    if (!isdigit((unsigned char) *text)) {
+        return false;
+    }
+    char *rest;
+    errno = 0;
+    *count = strtoull(text, &rest, 10);
+    *end = rest;
+    return errno == 0;
+}
 
 int main(int argc, char **argv) {
+    // GMP allocates from per-thread free lists; must come before any mpz_t is initialized.
+    arena_enable();
+
     int opt = 0;
 
     // disable verbose by default
     int verbose = 0;
 
+    // single-threaded by default
+    uint32_t threads = 1;
+
+    // hexstring ciphertext by default
+    bool binary = false;
+
+    // read, compute and write one after another by default
+    bool pipelined = false;
+
+    // SS on every block by default, not a wrapped session key
+    bool hybrid = false;
+
+    // parse and prepare the key on every run by default
+    bool use_cache = false;
+
+    // no per-stage statistics by default
+    bool show_stats = false;
+    bool stats_json = false;
+
+    // do the work in this process by default, not in a running ssd
+    char *socket_name = NULL;
+
+    // -n names a key file by default, not a keyring to take one key from
+    bool keyed = false;
+    uint64_t key_id = 0;
+
+    // the whole input by default, not just the blocks covering a byte range
+    bool ranged = false;
+    uint64_t range_start = 0;
+    uint64_t range_length = 0;
+
     // file steams
     FILE *input = stdin;
     FILE *output = stdout;
@@ -41,10 +103,21 @@ int main(int argc, char **argv) {
           "   -v              Display verbose program output.\n"
           "   -i infile       Input file of data to decrypt (default: stdin).\n"
           "   -o outfile      Output file for decrypted data (default: stdout).\n"
-          "   -n pvfile       Private key file (default: ss.priv).\n";
+          "   -n pvfile       Private key file (default: ss.priv).\n"
+          "   -t threads      Number of threads to decrypt with (default: 1).\n"
+          "   -f format       Ciphertext format, hex or bin (default: hex).\n"
+          "   -p              Overlap reading and writing with decryption on separate threads.\n"
+          "   -H              Hybrid mode: SS-encrypted session key, ChaCha20-Poly1305 payload.\n"
+          "   -c              Keep the prepared key in pvfile.cache to speed up later runs.\n"
+          "   --stats[=format] Print per-stage timings to stderr, as text or json (default: text).\n"
+          "   --range start:length\n"
+          "                   Decrypt only plaintext bytes start to start + length - 1, reading\n"
+          "                   just the blocks that hold them. Needs -i; -t and -p do not apply.\n"
+          "   --socket path   Hand the work to the ssd daemon listening on path, using its keys.\n"
+          "   --key id        Use key id from the keyring given by -n, as printed by keygen -N.\n";
 
     // 1. Parse command-line options using getopt() and handle them accordingly.
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'i':
             input_file_name = optarg;
@@ -63,12 +136,105 @@ int main(int argc, char **argv) {
             }
             break;
         case 'n': priv_key_name = optarg; break;
+        case 't':
+            if (!pool_parse_threads(&threads, optarg)) {
+                fprintf(stderr, "Error: invalid number of threads -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "bin") == 0) {
+                binary = true;
+            } else if (strcmp(optarg, "hex") == 0) {
+                binary = false;
+            } else {
+                fprintf(stderr, "Error: unknown format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p': pipelined = true; break;
+        case 'H': hybrid = true; break;
+        case 'c': use_cache = true; break;
         case 'v': verbose = 1; break;
+        case 'S':
+            show_stats = true;
+            if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                stats_json = false;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_json = true;
+            } else {
+                fprintf(stderr, "Error: unknown stats format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R': {
+            const char *colon, *end;
+            ranged = true;
+            if (!parse_count(&range_start, optarg, &colon) || *colon != ':'
+                || !parse_count(&range_length, colon + 1, &end) || *end != '\0') {
+                fprintf(stderr, "Error: invalid range, expected start:length -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case 'D': socket_name = optarg; break;
+        case 'K':
+            keyed = true;
+            if (!keyring_parse_id(&key_id, optarg)) {
+                fprintf(stderr, "Error: invalid key ID, expected hex digits -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
         case 'h': printf("%s", help_message); return 1;
         default:
-            fprintf(stderr, "Usage: %s [-i infile] [-o outfile] [-n pbfile] [-v] [-h]\n", argv[0]);
+            fprintf(stderr,
+                "Usage: %s [-i infile] [-o outfile] [-n pvfile] [-t threads] [-f format] [-p] [-H] "
+                "[-c] [-v] [-h] [--stats[=format]] [--range start:length] [--socket path] "
+                "[--key id]\n",
+                argv[0]);
+            exit(1);
+        }
+    }
+    if (show_stats && !stats_enable()) {
+        fprintf(stderr, "Error: statistics were compiled out, rebuild with make STATS=1\n");
+        exit(1);
+    }
+
+    if (keyed && (use_cache || socket_name != NULL)) {
+        fprintf(stderr, "Error: --key does not apply with -c or --socket\n");
+        exit(1);
+    }
+
+    // With --socket, a running ssd holds the key and does the work.
+    if (socket_name != NULL) {
+        if (binary || hybrid || ranged) {
+            fprintf(stderr, "Error: the daemon only serves whole hexstring ciphertext\n");
             exit(1);
         }
+        char error[256];
+        if (!ssproto_request_file(
+                socket_name, SSPROTO_DECRYPT, input, output, error, sizeof(error))) {
+            fprintf(stderr, "Error: %s -- '%s'\n", error, socket_name);
+            exit(1);
+        }
+        if (show_stats) {
+            stats_report(stderr, stats_json);
+        }
+        fclose(input);
+        fclose(output);
+        return 0;
+    }
+    // Blocks are found by seeking, and hexstring lines through an index saved next to the input.
+    struct stat input_info;
+    if (ranged
+        && (input_file_name == NULL || fstat(fileno(input), &input_info) != 0
+            || !S_ISREG(input_info.st_mode))) {
+        fprintf(stderr, "Error: --range needs a regular input file given with -i\n");
+        exit(1);
+    }
+    if (ranged && hybrid) {
+        fprintf(stderr, "Error: --range does not apply to hybrid ciphertext\n");
+        exit(1);
     }
 
     // 2. Open the private key file using fopen(). Print a helpful error and exit the program in the event of failure
@@ -80,7 +246,41 @@ int main(int argc, char **argv) {
     // 3. Read the public key from the opened public key file.
     mpz_t pq, d;
     mpz_inits(pq, d, NULL);
-    ss_read_priv(pq, d, priv_key_file);
+    // Keys written by newer keygens also carry the CRT components; older two-line keys do not.
+    ss_crt_t crt;
+    ss_crt_init(&crt);
+    bool has_crt;
+    // With -c, an up-to-date compiled key cache stands in for parsing and preparing the key.
+    keycache_t cache;
+    keycache_open(&cache, use_cache ? priv_key_file : NULL, priv_key_name);
+    // With --key, the table of a keyring from keygen -N leads straight to the one key.
+    if (keyed) {
+        keyring_t ring;
+        if (!keyring_open(&ring, priv_key_file)) {
+            fprintf(stderr, "Error: invalid keyring -- '%s'\n", priv_key_name);
+            exit(1);
+        }
+        if (!keyring_read_priv(&ring, key_id, pq, d, &crt)) {
+            fprintf(stderr, "Error: no valid key %016lx in keyring -- '%s'\n",
+                (unsigned long) key_id, priv_key_name);
+            exit(1);
+        }
+        has_crt = true;
+    } else if (!keycache_load_priv(&cache, pq, d, &crt, &has_crt)) {
+        // Binary keys from keygen -F bin are told apart from hexstring ones by their first byte.
+        if (!ss_key_is_bin(priv_key_file)) {
+            has_crt = ss_read_priv_crt(pq, d, &crt, priv_key_file);
+        } else {
+            has_crt = ss_read_priv_bin(pq, d, &crt, priv_key_file);
+            if (!has_crt) {
+                fprintf(stderr, "Error: invalid private key file -- '%s'\n", priv_key_name);
+                exit(1);
+            }
+        }
+        keycache_save_priv(&cache, pq, d, has_crt ? &crt : NULL);
+    }
+    // ciphertexts are below n = p * pq
+    arena_fit(mpz_sizeinbase(pq, 2) + mpz_sizeinbase(crt.p, 2));
 
     // 4. If verbose output is enabled print the following, each with a trailing newline, in order:
     // (a) username
@@ -95,10 +295,55 @@ int main(int argc, char **argv) {
         gmp_printf("d  (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
     }
 
-    // 5. Encrypt the file using ss_encrypt_file().
-    ss_decrypt_file(input, output, d, pq);
+    // 5. Decrypt the file, using the CRT components when the key has them and the key prepared
+    // in the cache with -c.
+    const ss_ctx_t *prepared = keycache_ctx(&cache);
+    if (hybrid) {
+        if (!ss_decrypt_file_hybrid(input, output, d, pq, has_crt ? &crt : NULL, prepared)) {
+            fprintf(stderr, "Error: input is not hybrid ciphertext for this key or was modified\n");
+            exit(1);
+        }
+    } else if (ranged) {
+        ssindex_t index;
+        if (!binary && !ssindex_open(&index, input_file_name, input)) {
+            fprintf(stderr, "Error: unable to index input file -- '%s'\n", input_file_name);
+            exit(1);
+        }
+        if (!ss_decrypt_range(input, output, d, pq, has_crt ? &crt : NULL, binary ? NULL : &index,
+                range_start, range_length, prepared)) {
+            fprintf(stderr, binary ? "Error: input is not a ciphertext container for this key\n"
+                                   : "Error: input has a block that is not a number\n");
+            exit(1);
+        }
+        if (!binary) {
+            ssindex_clear(&index);
+        }
+    } else if (pipelined) {
+        if (!ss_decrypt_file_pipe(
+                input, output, d, pq, has_crt ? &crt : NULL, threads, binary, prepared)) {
+            fprintf(stderr, "Error: input is not a ciphertext container for this key\n");
+            exit(1);
+        }
+    } else if (binary) {
+        if (!ss_decrypt_file_bin(input, output, d, pq, has_crt ? &crt : NULL, threads, prepared)) {
+            fprintf(stderr, "Error: input is not a ciphertext container for this key\n");
+            exit(1);
+        }
+    } else {
+        ss_decrypt_file_mt(input, output, d, pq, has_crt ? &crt : NULL, threads, prepared);
+    }
+
+    // Allocation statistics go to stderr, since the plaintext may be going to stdout.
+    if (verbose) {
+        arena_report(stderr);
+    }
+    if (show_stats) {
+        stats_report(stderr, stats_json);
+    }
 
     // 6. Close the public key file and clear any mpz_t variables you have used.
+    keycache_close(&cache);
+    ss_crt_clear(&crt);
     mpz_clears(pq, d, NULL);
     fclose(input);
     fclose(output);
@@ -1,22 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h> //atof
+#include <string.h>
 #include <unistd.h> //getopt().
+#include <getopt.h> //getopt_long().
 #include <time.h>
 #include <gmp.h>
 #include <sys/stat.h>
 
 #include "ss.h"
+#include "pool.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "arena.h"
+#include "keycache.h"
+#include "keyring.h"
+#include "stats.h"
+#include "ssproto.h"
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:f:pHcvh"
+
+// --stats takes an optional format, so it is only spelled --stats or --stats=format
+static struct option long_options[] = { { "stats", optional_argument, NULL, 'S' },
+    { "socket", required_argument, NULL, 'D' }, { "key", required_argument, NULL, 'K' },
+    { NULL, 0, NULL, 0 } };
 
 int main(int argc, char **argv) {
+    // GMP allocates from per-thread free lists; must come before any mpz_t is initialized.
+    arena_enable();
+
     int opt = 0;
 
     // disable verbose by default
     int verbose = 0;
 
+    // single-threaded by default
+    uint32_t threads = 1;
+
+    // hexstring ciphertext by default
+    bool binary = false;
+
+    // read, compute and write one after another by default
+    bool pipelined = false;
+
+    // SS on every block by default, not a wrapped session key
+    bool hybrid = false;
+
+    // parse and prepare the key on every run by default
+    bool use_cache = false;
+
+    // no per-stage statistics by default
+    bool show_stats = false;
+    bool stats_json = false;
+
+    // do the work in this process by default, not in a running ssd
+    char *socket_name = NULL;
+
+    // -n names a key file by default, not a keyring to take one key from
+    bool keyed = false;
+    uint64_t key_id = 0;
+
     // file steams
     FILE *input = stdin;
     FILE *output = stdout;
@@ -41,10 +83,18 @@ int main(int argc, char **argv) {
           "   -v              Display verbose program output.\n"
           "   -i infile       Input file of data to encrypt (default: stdin).\n"
           "   -o outfile      Output file for encrypted data (default: stdout).\n"
-          "   -n pbfile       Public key file (default: ss.pub).\n";
+          "   -n pbfile       Public key file (default: ss.pub).\n"
+          "   -t threads      Number of threads to encrypt with (default: 1).\n"
+          "   -f format       Ciphertext format, hex or bin (default: hex).\n"
+          "   -p              Overlap reading and writing with encryption on separate threads.\n"
+          "   -H              Hybrid mode: SS-encrypted session key, ChaCha20-Poly1305 payload.\n"
+          "   -c              Keep the prepared key in pbfile.cache to speed up later runs.\n"
+          "   --stats[=format] Print per-stage timings to stderr, as text or json (default: text).\n"
+          "   --socket path   Hand the work to the ssd daemon listening on path, using its keys.\n"
+          "   --key id        Use key id from the keyring given by -n, as printed by keygen -N.\n";
 
     // 1. Parse command-line options using getopt() and handle them accordingly.
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'i':
             input_file_name = optarg;
@@ -63,12 +113,82 @@ int main(int argc, char **argv) {
             }
             break;
         case 'n': pub_key_name = optarg; break;
+        case 't':
+            if (!pool_parse_threads(&threads, optarg)) {
+                fprintf(stderr, "Error: invalid number of threads -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "bin") == 0) {
+                binary = true;
+            } else if (strcmp(optarg, "hex") == 0) {
+                binary = false;
+            } else {
+                fprintf(stderr, "Error: unknown format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p': pipelined = true; break;
+        case 'H': hybrid = true; break;
+        case 'c': use_cache = true; break;
         case 'v': verbose = 1; break;
+        case 'S':
+            show_stats = true;
+            if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                stats_json = false;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_json = true;
+            } else {
+                fprintf(stderr, "Error: unknown stats format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'D': socket_name = optarg; break;
+        case 'K':
+            keyed = true;
+            if (!keyring_parse_id(&key_id, optarg)) {
+                fprintf(stderr, "Error: invalid key ID, expected hex digits -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
         case 'h': printf("%s", help_message); return 1;
         default:
-            fprintf(stderr, "Usage: %s [-i infile] [-o outfile] [-n pbfile] [-v] [-h]\n", argv[0]);
+            fprintf(stderr,
+                "Usage: %s [-i infile] [-o outfile] [-n pbfile] [-t threads] [-f format] [-p] [-H] "
+                "[-c] [-v] [-h] [--stats[=format]] [--socket path] [--key id]\n",
+                argv[0]);
+            exit(1);
+        }
+    }
+    if (show_stats && !stats_enable()) {
+        fprintf(stderr, "Error: statistics were compiled out, rebuild with make STATS=1\n");
+        exit(1);
+    }
+
+    if (keyed && (use_cache || socket_name != NULL)) {
+        fprintf(stderr, "Error: --key does not apply with -c or --socket\n");
+        exit(1);
+    }
+
+    // With --socket, a running ssd holds the key and does the work.
+    if (socket_name != NULL) {
+        if (binary || hybrid) {
+            fprintf(stderr, "Error: the daemon only serves whole hexstring ciphertext\n");
+            exit(1);
+        }
+        char error[256];
+        if (!ssproto_request_file(
+                socket_name, SSPROTO_ENCRYPT, input, output, error, sizeof(error))) {
+            fprintf(stderr, "Error: %s -- '%s'\n", error, socket_name);
             exit(1);
         }
+        if (show_stats) {
+            stats_report(stderr, stats_json);
+        }
+        fclose(input);
+        fclose(output);
+        return 0;
     }
 
     // 2. Open the public key file using fopen(). Print a helpful error and exit the program in the event of failure
@@ -81,7 +201,32 @@ int main(int argc, char **argv) {
     mpz_t n;
     mpz_init(n);
     char username[250];
-    ss_read_pub(n, username, pub_key_file);
+    // With -c, an up-to-date compiled key cache stands in for parsing and preparing the key.
+    keycache_t cache;
+    keycache_open(&cache, use_cache ? pub_key_file : NULL, pub_key_name);
+    // With --key, the table of a keyring from keygen -N leads straight to the one key.
+    if (keyed) {
+        keyring_t ring;
+        if (!keyring_open(&ring, pub_key_file)) {
+            fprintf(stderr, "Error: invalid keyring -- '%s'\n", pub_key_name);
+            exit(1);
+        }
+        if (!keyring_read_pub(&ring, key_id, n, username, sizeof(username))) {
+            fprintf(stderr, "Error: no valid key %016lx in keyring -- '%s'\n",
+                (unsigned long) key_id, pub_key_name);
+            exit(1);
+        }
+    } else if (!keycache_load_pub(&cache, n, username, sizeof(username))) {
+        // Binary keys from keygen -F bin are told apart from hexstring ones by their first byte.
+        if (!ss_key_is_bin(pub_key_file)) {
+            ss_read_pub(n, username, pub_key_file);
+        } else if (!ss_read_pub_bin(n, username, sizeof(username), pub_key_file)) {
+            fprintf(stderr, "Error: invalid public key file -- '%s'\n", pub_key_name);
+            exit(1);
+        }
+        keycache_save_pub(&cache, n, username);
+    }
+    arena_fit(mpz_sizeinbase(n, 2));
 
     // 4. If verbose output is enabled print the following, each with a trailing newline, in order:
     // (a) username
@@ -96,10 +241,32 @@ int main(int argc, char **argv) {
         gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
     }
 
-    // 5. Encrypt the file using ss_encrypt_file().
-    ss_encrypt_file(input, output, n);
+    // 5. Encrypt the file using ss_encrypt_file(), split across threads if requested, with the
+    // key prepared in the cache with -c.
+    const ss_ctx_t *prepared = keycache_ctx(&cache);
+    if (hybrid) {
+        if (!ss_encrypt_file_hybrid(input, output, n, prepared)) {
+            fprintf(stderr, "Error: unable to generate a session key\n");
+            exit(1);
+        }
+    } else if (pipelined) {
+        ss_encrypt_file_pipe(input, output, n, threads, binary, prepared);
+    } else if (binary) {
+        ss_encrypt_file_bin(input, output, n, threads, prepared);
+    } else {
+        ss_encrypt_file_mt(input, output, n, threads, prepared);
+    }
+
+    // Allocation statistics go to stderr, since the ciphertext may be going to stdout.
+    if (verbose) {
+        arena_report(stderr);
+    }
+    if (show_stats) {
+        stats_report(stderr, stats_json);
+    }
 
     // 6. Close the public key file and clear any mpz_t variables you have used.
+    keycache_close(&cache);
     mpz_clear(n);
     fclose(input);
     fclose(output);
@@ -0,0 +1,289 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "hex.h"
+
+// The vector codecs need x86-64 intrinsics with per-function targets, and 64-bit limbs so a limb
+// is exactly 16 digits. Anything else builds with the scalar code only.
+#ifndef HEX_X86
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && GMP_NUMB_BITS == 64
+#define HEX_X86 1
+#else
+#define HEX_X86 0
+#endif
+#endif
+
+#if HEX_X86
+#include <immintrin.h>
+#endif
+
+#define DIGITS_PER_LIMB (GMP_NUMB_BITS / 4)
+
+static const char digit_chars[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B',
+    'C', 'D', 'E', 'F' };
+
+// value of one hex digit, or -1 if the character is not one
+static int hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+// writes count whole limbs, limbs[count - 1] first, DIGITS_PER_LIMB digits each
+static void encode_scalar(char *out, const mp_limb_t *limbs, size_t count) {
+    for (size_t i = count; i > 0; i--, out += DIGITS_PER_LIMB) {
+        mp_limb_t limb = limbs[i - 1];
+        for (int j = DIGITS_PER_LIMB - 1; j >= 0; j--) {
+            out[j] = digit_chars[limb & 15];
+            limb >>= 4;
+        }
+    }
+}
+
+// reads count whole limbs of DIGITS_PER_LIMB digits, limbs[count - 1] first
+static bool decode_scalar(mp_limb_t *limbs, const char *text, size_t count) {
+    for (size_t i = count; i > 0; i--, text += DIGITS_PER_LIMB) {
+        mp_limb_t limb = 0;
+        for (int j = 0; j < DIGITS_PER_LIMB; j++) {
+            int digit = hex_digit(text[j]);
+            if (digit < 0) {
+                return false;
+            }
+            limb = (limb << 4) | digit;
+        }
+        limbs[i - 1] = limb;
+    }
+    return true;
+}
+
+#if HEX_X86
+
+//
+// 2 limbs per step with SSSE3.
+// The limbs are byte-reversed into most significant byte first, split into high and low nibbles,
+// interleaved and mapped through a 16-entry shuffle table. Decoding classifies every character
+// as a digit or a letter at once, then multiply-adds pairs of nibbles into bytes.
+//
+__attribute__((target("ssse3"))) static void encode_ssse3(
+    char *out, const mp_limb_t *limbs, size_t count) {
+    const __m128i table = _mm_loadu_si128((const __m128i *) digit_chars);
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i low = _mm_set1_epi8(0x0F);
+    size_t i = count;
+    for (; i >= 2; i -= 2, out += 32) {
+        // limbs i - 1 and i - 2, most significant byte first
+        __m128i bytes
+            = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &limbs[i - 2]), reverse);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low);
+        __m128i nibbles = _mm_and_si128(bytes, low);
+        _mm_storeu_si128(
+            (__m128i *) out, _mm_shuffle_epi8(table, _mm_unpacklo_epi8(high, nibbles)));
+        _mm_storeu_si128(
+            (__m128i *) &out[16], _mm_shuffle_epi8(table, _mm_unpackhi_epi8(high, nibbles)));
+    }
+    encode_scalar(out, limbs, i);
+}
+
+// the values of 16 hex digits, returns false if any character is not one
+__attribute__((target("ssse3"))) static bool nibbles_ssse3(__m128i chars, __m128i *values) {
+    __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), chars));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lower));
+    *values = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+        _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    return _mm_movemask_epi8(_mm_or_si128(digit, letter)) == 0xFFFF;
+}
+
+__attribute__((target("ssse3"))) static bool decode_ssse3(
+    mp_limb_t *limbs, const char *text, size_t count) {
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    // the first digit of each pair is the high nibble
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    size_t i = count;
+    for (; i >= 2; i -= 2, text += 32) {
+        __m128i first, second;
+        bool valid = nibbles_ssse3(_mm_loadu_si128((const __m128i *) text), &first);
+        valid &= nibbles_ssse3(_mm_loadu_si128((const __m128i *) &text[16]), &second);
+        if (!valid) {
+            return false;
+        }
+        // limbs i - 1 and i - 2 most significant byte first, reversed into memory order
+        __m128i bytes = _mm_packus_epi16(
+            _mm_maddubs_epi16(first, weights), _mm_maddubs_epi16(second, weights));
+        _mm_storeu_si128((__m128i *) &limbs[i - 2], _mm_shuffle_epi8(bytes, reverse));
+    }
+    return decode_scalar(limbs, text, i);
+}
+
+//
+// 4 limbs per step with AVX2, the same steps as the SSSE3 codec in both 128-bit lanes.
+// The byte shuffles stay within a lane, so the lanes are swapped around them.
+//
+__attribute__((target("avx2"))) static void encode_avx2(
+    char *out, const mp_limb_t *limbs, size_t count) {
+    const __m256i table
+        = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) digit_chars));
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    size_t i = count;
+    for (; i >= 4; i -= 4, out += 64) {
+        // limbs i - 1, i - 2 in the low lane and i - 3, i - 4 in the high lane, most significant
+        // byte first
+        __m256i bytes
+            = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) &limbs[i - 4]), reverse);
+        bytes = _mm256_permute4x64_epi64(bytes, 0x4E);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low);
+        __m256i nibbles = _mm256_and_si256(bytes, low);
+        __m256i first = _mm256_shuffle_epi8(table, _mm256_unpacklo_epi8(high, nibbles));
+        __m256i second = _mm256_shuffle_epi8(table, _mm256_unpackhi_epi8(high, nibbles));
+        _mm256_storeu_si256((__m256i *) out, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *) &out[32], _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    encode_ssse3(out, limbs, i);
+}
+
+// the values of 32 hex digits, returns false if any character is not one
+__attribute__((target("avx2"))) static bool nibbles_avx2(__m256i chars, __m256i *values) {
+    __m256i lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), chars));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    *values
+        = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(chars, _mm256_set1_epi8('0'))),
+            _mm256_and_si256(letter, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+    return _mm256_movemask_epi8(_mm256_or_si256(digit, letter)) == -1;
+}
+
+__attribute__((target("avx2"))) static bool decode_avx2(
+    mp_limb_t *limbs, const char *text, size_t count) {
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    size_t i = count;
+    for (; i >= 4; i -= 4, text += 64) {
+        __m256i first, second;
+        bool valid = nibbles_avx2(_mm256_loadu_si256((const __m256i *) text), &first);
+        valid &= nibbles_avx2(_mm256_loadu_si256((const __m256i *) &text[32]), &second);
+        if (!valid) {
+            return false;
+        }
+        // the low lane holds limbs i - 1 and i - 3, the high lane i - 2 and i - 4, each most
+        // significant byte first; reverse them and put the limbs back in memory order
+        __m256i bytes = _mm256_packus_epi16(
+            _mm256_maddubs_epi16(first, weights), _mm256_maddubs_epi16(second, weights));
+        bytes = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(bytes, reverse), 0x72);
+        _mm256_storeu_si256((__m256i *) &limbs[i - 4], bytes);
+    }
+    return decode_ssse3(limbs, text, i);
+}
+
+#endif
+
+// the widest codec the CPU supports, picked once
+static void (*encode_limbs)(char *out, const mp_limb_t *limbs, size_t count) = encode_scalar;
+static bool (*decode_limbs)(mp_limb_t *limbs, const char *text, size_t count) = decode_scalar;
+static pthread_once_t codec_once = PTHREAD_ONCE_INIT;
+
+static void codec_init(void) {
+#if HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encode_limbs = encode_avx2;
+        decode_limbs = decode_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        encode_limbs = encode_ssse3;
+        decode_limbs = decode_ssse3;
+    }
+#endif
+}
+
+//
+// Writes c as uppercase hex digits without leading zeros, the same text as gmp_fprintf() with
+// "%ZX". Zero is written as "0". No newline or terminator is added.
+//
+// Provides:
+//  out: the digits
+//  returns the number of digits written
+//
+// Requires:
+//  out: room for mpz_sizeinbase(c, 16) characters
+//  c: a non-negative integer
+//
+uint64_t hex_encode(char *out, mpz_t c) {
+    pthread_once(&codec_once, codec_init);
+    size_t size = mpz_size(c);
+    if (size == 0) {
+        out[0] = '0';
+        return 1;
+    }
+    const mp_limb_t *limbs = mpz_limbs_read(c);
+
+    // The top limb is written without its leading zeros, the rest in full.
+    mp_limb_t top = limbs[size - 1];
+    int head = 0;
+    for (mp_limb_t rest = top; rest != 0; rest >>= 4) {
+        head += 1;
+    }
+    for (int j = head - 1; j >= 0; j--) {
+        out[j] = digit_chars[top & 15];
+        top >>= 4;
+    }
+    encode_limbs(&out[head], limbs, size - 1);
+    return head + (size - 1) * DIGITS_PER_LIMB;
+}
+
+//
+// Reads length hex digits, upper or lower case, into c. The text needs no terminator, so it can
+// be parsed in place from a mapping or a read buffer.
+//
+// Provides:
+//  c: the number, or 0 if the text was not valid
+//  returns false if the text is empty or contains anything but hex digits
+//
+// Requires:
+//  c: initialized
+//  text: length characters
+//
+bool hex_decode(mpz_t c, const char *text, uint64_t length) {
+    pthread_once(&codec_once, codec_init);
+    if (length == 0) {
+        mpz_set_ui(c, 0);
+        return false;
+    }
+    uint64_t size = (length + DIGITS_PER_LIMB - 1) / DIGITS_PER_LIMB;
+    mp_limb_t *limbs = mpz_limbs_write(c, size);
+
+    // The top limb takes the digits in front of the last whole limbs.
+    uint64_t head = length - (size - 1) * DIGITS_PER_LIMB;
+    mp_limb_t top = 0;
+    for (uint64_t j = 0; j < head; j++) {
+        int digit = hex_digit(text[j]);
+        if (digit < 0) {
+            mpz_limbs_finish(c, 0);
+            return false;
+        }
+        top = (top << 4) | digit;
+    }
+    limbs[size - 1] = top;
+    if (!decode_limbs(limbs, &text[head], size - 1)) {
+        mpz_limbs_finish(c, 0);
+        return false;
+    }
+    // leading zero digits leave zero limbs on top, which this drops
+    mpz_limbs_finish(c, size);
+    return true;
+}
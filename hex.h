@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+//
+// Hexstring codec for ciphertext lines.
+//
+// Converts straight between the limbs of a number and text in a caller's buffer, without the
+// format parsing and temporary allocations of gmp_fprintf() and gmp_fscanf(). Whole limbs go
+// through SSSE3 or AVX2 nibble shuffles when the CPU has them, picked at runtime, and the digits
+// of the top limb through a scalar loop. Build with -DHEX_X86=0 to keep only the scalar code.
+//
+
+//
+// Writes c as uppercase hex digits without leading zeros, the same text as gmp_fprintf() with
+// "%ZX". Zero is written as "0". No newline or terminator is added.
+//
+// Provides:
+//  out: the digits
+//  returns the number of digits written
+//
+// Requires:
+//  out: room for mpz_sizeinbase(c, 16) characters
+//  c: a non-negative integer
+//
+uint64_t hex_encode(char *out, mpz_t c);
+
+//
+// Reads length hex digits, upper or lower case, into c. The text needs no terminator, so it can
+// be parsed in place from a mapping or a read buffer.
+//
+// Provides:
+//  c: the number, or 0 if the text was not valid
+//  returns false if the text is empty or contains anything but hex digits
+//
+// Requires:
+//  c: initialized
+//  text: length characters
+//
+bool hex_decode(mpz_t c, const char *text, uint64_t length);
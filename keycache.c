@@ -0,0 +1,506 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#include "keycache.h"
+#include "ss.h"
+#include "mont.h"
+#include "montvec.h"
+#include "mapfile.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x00000100000001b3ULL
+
+// every payload field starts on an 8-byte boundary, so limbs can be read in place
+#define PAD(bytes) (((bytes) + 7) & ~(uint64_t) 7)
+
+// FNV-1a taking 64-bit words instead of bytes, eight times fewer steps over the payload
+static uint64_t fnv1a(uint64_t hash, const uint8_t *bytes, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], sizeof(word));
+        hash ^= word;
+        hash *= FNV_PRIME;
+    }
+    for (; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// a growing payload, checksummed once it is complete
+typedef struct {
+    uint8_t *data;
+    size_t size, capacity;
+} writer_t;
+
+static void put(writer_t *w, const void *bytes, size_t size) {
+    size_t padded = PAD(size);
+    if (w->size + padded > w->capacity) {
+        w->capacity = 2 * (w->size + padded);
+        w->data = (uint8_t *) realloc(w->data, w->capacity);
+    }
+    memcpy(&w->data[w->size], bytes, size);
+    memset(&w->data[w->size + size], 0, padded - size);
+    w->size += padded;
+}
+
+static void put_u64(writer_t *w, uint64_t value) {
+    put(w, &value, sizeof(value));
+}
+
+static void put_mpz(writer_t *w, mpz_t x) {
+    put_u64(w, mpz_size(x));
+    put(w, mpz_limbs_read(x), mpz_size(x) * sizeof(mp_limb_t));
+}
+
+static void put_string(writer_t *w, const char *s) {
+    put_u64(w, strlen(s));
+    put(w, s, strlen(s));
+}
+
+static void put_mont(writer_t *w, mont_t *ctx, mont_exp_t *exp) {
+    put_u64(w, ctx->size);
+    put_u64(w, ctx->ninv);
+    put(w, ctx->n, ctx->size * sizeof(mp_limb_t));
+    put(w, ctx->r, ctx->size * sizeof(mp_limb_t));
+    put(w, ctx->r2, ctx->size * sizeof(mp_limb_t));
+    put_u64(w, exp->width);
+    put_u64(w, exp->count);
+    put_u64(w, exp->tail);
+    put(w, exp->windows, exp->count * sizeof(mont_window_t));
+}
+
+// everything ss_ctx_init_copy() reads from a prepared context
+static void put_ctx(writer_t *w, ss_ctx_t *ctx) {
+    put_u64(w, ctx->crt);
+    put_u64(w, ctx->k);
+    put_mpz(w, ctx->modulus);
+    put_mpz(w, ctx->q);
+    put_mpz(w, ctx->qinv);
+    put_mont(w, &ctx->ctx, &ctx->exp);
+    if (ctx->crt) {
+        put_mont(w, &ctx->q_ctx, &ctx->q_exp);
+    }
+
+    // Decrypting contexts have no multi-buffer digits, and neither does the scalar fallback.
+    montvec_t *vec = &ctx->vec;
+    put_string(w, vec->kernel != NULL ? vec->kernel->name : "");
+    if (vec->kernel != NULL && vec->kernel->mul != NULL) {
+        uint64_t stride = (uint64_t) vec->digits * vec->lanes;
+        put_u64(w, vec->lanes);
+        put_u64(w, vec->digits);
+        put_u64(w, vec->size);
+        put_u64(w, vec->ninv);
+        put(w, vec->limbs, vec->size * sizeof(mp_limb_t));
+        put(w, vec->n, stride * sizeof(uint64_t));
+        put(w, vec->r2, stride * sizeof(uint64_t));
+    }
+}
+
+// a cursor over the mapped payload; any read past the end clears ok and returns zeros
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    bool ok;
+} reader_t;
+
+static const void *get(reader_t *r, uint64_t count, uint64_t width) {
+    if (!r->ok || count > r->size / width || PAD(count * width) > r->size) {
+        r->ok = false;
+        return NULL;
+    }
+    const void *bytes = r->data;
+    r->data += PAD(count * width);
+    r->size -= PAD(count * width);
+    return bytes;
+}
+
+static uint64_t get_u64(reader_t *r) {
+    const uint8_t *bytes = (const uint8_t *) get(r, 1, sizeof(uint64_t));
+    uint64_t value = 0;
+    if (bytes != NULL) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+// points x at limbs inside the mapping; x must never be written or cleared
+static void get_mpz(reader_t *r, mpz_t x) {
+    uint64_t size = get_u64(r);
+    const mp_limb_t *limbs = (const mp_limb_t *) get(r, size, sizeof(mp_limb_t));
+    mpz_roinit_n(x, limbs, r->ok ? size : 0);
+}
+
+// views of a Montgomery context and recoding inside the mapping, for the copy functions
+static void get_mont(reader_t *r, mont_t *ctx, mont_exp_t *exp) {
+    memset(ctx, 0, sizeof(mont_t));
+    ctx->size = get_u64(r);
+    ctx->ninv = get_u64(r);
+    ctx->n = (mp_limb_t *) get(r, ctx->size, sizeof(mp_limb_t));
+    ctx->r = (mp_limb_t *) get(r, ctx->size, sizeof(mp_limb_t));
+    ctx->r2 = (mp_limb_t *) get(r, ctx->size, sizeof(mp_limb_t));
+    memset(exp, 0, sizeof(mont_exp_t));
+    exp->width = get_u64(r);
+    exp->count = get_u64(r);
+    exp->tail = get_u64(r);
+    exp->windows = (mont_window_t *) get(r, exp->count, sizeof(mont_window_t));
+    // window widths run from 1 to 7, and the context must have a modulus
+    r->ok = r->ok && ctx->size > 0 && exp->width >= 1 && exp->width <= 7;
+}
+
+// a view of a prepared context inside the mapping, checked against the key it belongs to
+static void get_ctx(reader_t *r, ss_ctx_t *ctx, mpz_t modulus, mpz_t q) {
+    memset(ctx, 0, sizeof(ss_ctx_t));
+    ctx->crt = get_u64(r) != 0;
+    ctx->k = get_u64(r);
+    get_mpz(r, ctx->modulus);
+    get_mpz(r, ctx->q);
+    get_mpz(r, ctx->qinv);
+    get_mont(r, &ctx->ctx, &ctx->exp);
+    if (ctx->crt) {
+        get_mont(r, &ctx->q_ctx, &ctx->q_exp);
+    }
+    r->ok = r->ok && (ctx->crt == (q != NULL)) && mpz_cmp(ctx->modulus, modulus) == 0
+        && (q == NULL || mpz_cmp(ctx->q, q) == 0)
+        && (size_t) ctx->ctx.size == mpz_size(ctx->modulus);
+
+    uint64_t length = get_u64(r);
+    const char *name = (const char *) get(r, length, 1);
+    if (!r->ok || length == 0) {
+        return;
+    }
+    // The kernel is looked up by name; one this build lacks makes the cache stale.
+    montvec_t *vec = &ctx->vec;
+    for (size_t i = 0; montvec_kernel_at(i) != NULL; i++) {
+        const montvec_kernel_t *kernel = montvec_kernel_at(i);
+        if (strlen(kernel->name) == length && memcmp(kernel->name, name, length) == 0) {
+            vec->kernel = kernel;
+        }
+    }
+    if (vec->kernel == NULL) {
+        r->ok = false;
+        return;
+    }
+    vec->lanes = 1;
+    if (vec->kernel->mul == NULL) {
+        return;
+    }
+    vec->lanes = get_u64(r);
+    vec->digits = get_u64(r);
+    vec->size = get_u64(r);
+    vec->ninv = get_u64(r);
+    uint64_t stride = (uint64_t) vec->digits * vec->lanes;
+    vec->limbs = (mp_limb_t *) get(r, vec->size, sizeof(mp_limb_t));
+    vec->n = (uint64_t *) get(r, stride, sizeof(uint64_t));
+    vec->r2 = (uint64_t *) get(r, stride, sizeof(uint64_t));
+    r->ok = r->ok && vec->lanes == vec->kernel->lanes && vec->digits > 0
+        && vec->digits <= vec->kernel->max_digits && (size_t) vec->size == mpz_size(modulus);
+}
+
+//
+// Sets up the cache for a key file by fingerprinting its contents, then rewinds the key file so
+// it can still be parsed if the cache turns out to be missing or stale.
+//
+// Provides:
+//  cache: ready for the load and save functions
+//  returns false if caching is off: keyfile was NULL or cannot be rewound
+//
+// Requires:
+//  cache: the cache to set up
+//  keyfile: the open key file, or NULL to leave caching off
+//  key_path: name of the key file; the cache is key_path with KEYCACHE_SUFFIX appended
+//
+bool keycache_open(keycache_t *cache, FILE *keyfile, const char *key_path) {
+    cache->path = NULL;
+    cache->hash = FNV_OFFSET;
+    cache->key_size = 0;
+    cache->file = NULL;
+    cache->prepared = false;
+
+    // Pipes cannot be read twice, so they are parsed without a cache.
+    if (keyfile == NULL || fseek(keyfile, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    // Keys are small, so the whole file is hashed in one piece.
+    size_t capacity = 4096;
+    uint8_t *contents = (uint8_t *) malloc(capacity);
+    size_t j;
+    while ((j = fread(&contents[cache->key_size], sizeof(uint8_t), capacity - cache->key_size,
+                keyfile))
+        > 0) {
+        cache->key_size += j;
+        if (cache->key_size == capacity) {
+            capacity *= 2;
+            contents = (uint8_t *) realloc(contents, capacity);
+        }
+    }
+    cache->hash = fnv1a(FNV_OFFSET, contents, cache->key_size);
+    free(contents);
+    if (ferror(keyfile) || fseek(keyfile, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    clearerr(keyfile);
+
+    cache->path = (char *) malloc(strlen(key_path) + sizeof(KEYCACHE_SUFFIX));
+    strcpy(cache->path, key_path);
+    strcat(cache->path, KEYCACHE_SUFFIX);
+    return true;
+}
+
+// undoes map_cache(); the mapping may be empty if the file could not be mapped
+static void unmap_cache(keycache_t *cache) {
+    if (cache->file != NULL) {
+        mapfile_close(&cache->map, cache->file);
+        fclose(cache->file);
+        cache->file = NULL;
+    }
+}
+
+// maps the cache file and checks its header against the key file, leaving r on the payload
+static bool map_cache(keycache_t *cache, uint8_t kind, reader_t *r) {
+    *r = (reader_t) { NULL, 0, false };
+    cache->file = cache->path != NULL ? fopen(cache->path, "r") : NULL;
+    if (cache->file == NULL) {
+        return false;
+    }
+    if (!mapfile_open(&cache->map, cache->file) || cache->map.size < KEYCACHE_HEADER_SIZE) {
+        unmap_cache(cache);
+        return false;
+    }
+
+    uint64_t fields[4];
+    uint16_t version;
+    mapfile_t *map = &cache->map;
+    const uint8_t *data = map->data;
+    memcpy(fields, &data[8], sizeof(fields));
+    memcpy(&version, &data[4], sizeof(version));
+    r->data = &data[KEYCACHE_HEADER_SIZE];
+    r->size = map->size - KEYCACHE_HEADER_SIZE;
+    r->ok = memcmp(data, KEYCACHE_MAGIC, 4) == 0 && version == KEYCACHE_VERSION
+        && data[6] == kind && data[7] == sizeof(mp_limb_t) && fields[0] == cache->hash
+        && fields[1] == cache->key_size && fields[3] == r->size
+        && fields[2] == fnv1a(FNV_OFFSET, r->data, r->size);
+    return r->ok;
+}
+
+// keeps the view of the context inside the mapping for keycache_ctx(), or gives up on the
+// mapping
+static bool prepare_from(keycache_t *cache, bool ok) {
+    if (!ok) {
+        unmap_cache(cache);
+        return false;
+    }
+    cache->prepared = true;
+    return true;
+}
+
+// writes the header and payload to a temporary file and renames it over the cache
+static bool write_cache(keycache_t *cache, uint8_t kind, writer_t *w) {
+    uint8_t header[KEYCACHE_HEADER_SIZE];
+    uint16_t version = KEYCACHE_VERSION;
+    uint64_t fields[4] = { cache->hash, cache->key_size, fnv1a(FNV_OFFSET, w->data, w->size),
+        w->size };
+    memcpy(header, KEYCACHE_MAGIC, 4);
+    memcpy(&header[4], &version, sizeof(version));
+    header[6] = kind;
+    header[7] = sizeof(mp_limb_t);
+    memcpy(&header[8], fields, sizeof(fields));
+
+    // The process id keeps concurrent runs from writing into each other's temporary file.
+    char *temp = (char *) malloc(strlen(cache->path) + 32);
+    sprintf(temp, "%s.%ld", cache->path, (long) getpid());
+    FILE *file = fopen(temp, "w");
+    // A private key's cache holds the key itself, so it gets the same permissions as ss.priv.
+    if (file != NULL) {
+        fchmod(fileno(file), 0600);
+    }
+    bool written = file != NULL && fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(w->data, sizeof(uint8_t), w->size, file) == w->size;
+    written = file != NULL && fclose(file) == 0 && written;
+    written = written && rename(temp, cache->path) == 0;
+    if (!written) {
+        remove(temp);
+    }
+    free(temp);
+    free(w->data);
+    return written;
+}
+
+//
+// Loads a public key and its prepared context from the cache.
+//
+// Provides:
+//  n: public exponent/modulus
+//  username: the username from the key file
+//  returns false if caching is off or the cache is missing, stale or damaged
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  username_size: bytes of room in username
+//  all mpz_t arguments to be initialized
+//
+bool keycache_load_pub(keycache_t *cache, mpz_t n, char *username, size_t username_size) {
+    reader_t r;
+    bool ok = map_cache(cache, KEYCACHE_PUBLIC, &r);
+
+    mpz_t key;
+    uint64_t length = get_u64(&r);
+    const char *name = (const char *) get(&r, length, 1);
+    get_mpz(&r, key);
+    get_ctx(&r, &cache->ctx, key, NULL);
+    ok = ok && r.ok && r.size == 0 && length < username_size;
+    if (ok) {
+        memcpy(username, name, length);
+        username[length] = '\0';
+        mpz_set(n, key);
+    }
+    return prepare_from(cache, ok);
+}
+
+//
+// Prepares a public key and writes it with its context to the cache for later runs. The cache
+// file is replaced atomically, so readers never see part of it.
+//
+// Provides:
+//  returns false if caching is off or the cache file could not be written
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  n: public exponent/modulus parsed from the key file
+//  username: the username parsed from the key file
+//
+bool keycache_save_pub(keycache_t *cache, mpz_t n, const char *username) {
+    if (cache->path == NULL) {
+        return false;
+    }
+    ss_ctx_init_encrypt(&cache->ctx, n);
+    cache->prepared = true;
+
+    writer_t w = { NULL, 0, 0 };
+    put_string(&w, username);
+    put_mpz(&w, n);
+    put_ctx(&w, &cache->ctx);
+    return write_cache(cache, KEYCACHE_PUBLIC, &w);
+}
+
+//
+// Loads a private key and its prepared context from the cache.
+//
+// Provides:
+//  pq: private modulus
+//  d: private exponent
+//  crt: CRT components, if the key has them
+//  has_crt: whether the key has the CRT components
+//  returns false if caching is off or the cache is missing, stale or damaged
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  all mpz_t arguments to be initialized
+//
+bool keycache_load_priv(keycache_t *cache, mpz_t pq, mpz_t d, ss_crt_t *crt, bool *has_crt) {
+    reader_t r;
+    bool ok = map_cache(cache, KEYCACHE_PRIVATE, &r);
+
+    // the same fields as ss_crt_t, but pointing into the mapping
+    mpz_t key_pq, key_d, p, q, dp, dq, qinv;
+    bool with_crt = get_u64(&r) != 0;
+    get_mpz(&r, key_pq);
+    get_mpz(&r, key_d);
+    mpz_t *parts[] = { &p, &q, &dp, &dq, &qinv };
+    for (int i = 0; i < 5; i++) {
+        if (with_crt) {
+            get_mpz(&r, *parts[i]);
+        } else {
+            mpz_roinit_n(*parts[i], NULL, 0);
+        }
+    }
+    get_ctx(&r, &cache->ctx, with_crt ? p : key_pq, with_crt ? q : NULL);
+    ok = ok && r.ok && r.size == 0;
+    if (ok) {
+        *has_crt = with_crt;
+        mpz_set(pq, key_pq);
+        mpz_set(d, key_d);
+        mpz_set(crt->p, p);
+        mpz_set(crt->q, q);
+        mpz_set(crt->dp, dp);
+        mpz_set(crt->dq, dq);
+        mpz_set(crt->qinv, qinv);
+    }
+    return prepare_from(cache, ok);
+}
+
+//
+// Prepares a private key and writes it with its context to the cache for later runs, replacing
+// the cache file atomically.
+//
+// Provides:
+//  returns false if caching is off or the cache file could not be written
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  pq: private modulus parsed from the key file
+//  d: private exponent parsed from the key file
+//  crt: CRT components parsed from the key file, or NULL for older two-line keys
+//
+bool keycache_save_priv(keycache_t *cache, mpz_t pq, mpz_t d, ss_crt_t *crt) {
+    if (cache->path == NULL) {
+        return false;
+    }
+    ss_ctx_init_decrypt(&cache->ctx, d, pq, crt);
+    cache->prepared = true;
+
+    writer_t w = { NULL, 0, 0 };
+    put_u64(&w, crt != NULL);
+    put_mpz(&w, pq);
+    put_mpz(&w, d);
+    if (crt != NULL) {
+        put_mpz(&w, crt->p);
+        put_mpz(&w, crt->q);
+        put_mpz(&w, crt->dp);
+        put_mpz(&w, crt->dq);
+        put_mpz(&w, crt->qinv);
+    }
+    put_ctx(&w, &cache->ctx);
+    return write_cache(cache, KEYCACHE_PRIVATE, &w);
+}
+
+//
+// The key's prepared context, for the prepared argument of the ss.h file functions.
+//
+// Provides:
+//  returns the context loaded or prepared by the last load or save call, or NULL if none was
+//
+// Requires:
+//  cache: set up by keycache_open()
+//
+const ss_ctx_t *keycache_ctx(const keycache_t *cache) {
+    return cache->prepared ? &cache->ctx : NULL;
+}
+
+//
+// Frees everything owned by the cache, including the context keycache_ctx() handed out.
+//
+// Requires:
+//  cache: set up by keycache_open()
+//
+void keycache_close(keycache_t *cache) {
+    if (cache->prepared) {
+        // a loaded context only points into the mapping
+        if (cache->file == NULL) {
+            ss_ctx_clear(&cache->ctx);
+        }
+        cache->prepared = false;
+    }
+    unmap_cache(cache);
+    free(cache->path);
+    cache->path = NULL;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "ss.h"
+#include "mapfile.h"
+
+//
+// Compiled key cache.
+//
+// A key file's parsed values and the prepared context derived from them (block size, Montgomery
+// constants, exponent recodings and multi-buffer digits), stored next to the key so later runs
+// map them in instead of parsing and deriving them again. The cache is tied to the exact bytes
+// of the key file and to this build's limb size, and is rebuilt whenever either changes.
+//
+// A 40-byte header followed by the payload. Integers are in native byte order, since the cache
+// never leaves the machine that wrote it. Both hashes are FNV-1a over 64-bit native words, with
+// any bytes left over hashed one at a time.
+//
+//  offset  size  field
+//       0     4  magic "SSKC"
+//       4     2  version
+//       6     1  key kind, KEYCACHE_PUBLIC or KEYCACHE_PRIVATE
+//       7     1  bytes per GMP limb
+//       8     8  hash of the key file's contents
+//      16     8  bytes in the key file
+//      24     8  hash of the payload
+//      32     8  bytes in the payload
+//
+// Every payload field is padded to a multiple of 8 bytes.
+//
+#define KEYCACHE_MAGIC       "SSKC"
+#define KEYCACHE_VERSION     1
+#define KEYCACHE_HEADER_SIZE 40
+#define KEYCACHE_SUFFIX      ".cache"
+#define KEYCACHE_PUBLIC      0
+#define KEYCACHE_PRIVATE     1
+
+typedef struct {
+    char *path; // the cache file, NULL when caching is off
+    uint64_t hash; // hash of the key file's contents
+    uint64_t key_size; // bytes in the key file
+    FILE *file; // the cache file while ctx points into its mapping
+    mapfile_t map;
+    bool prepared; // ctx holds the key
+    ss_ctx_t ctx; // a view into the mapping once loaded, or prepared from the parsed key
+} keycache_t;
+
+//
+// Sets up the cache for a key file by fingerprinting its contents, then rewinds the key file so
+// it can still be parsed if the cache turns out to be missing or stale.
+//
+// Provides:
+//  cache: ready for the load and save functions
+//  returns false if caching is off: keyfile was NULL or cannot be rewound
+//
+// Requires:
+//  cache: the cache to set up
+//  keyfile: the open key file, or NULL to leave caching off
+//  key_path: name of the key file; the cache is key_path with KEYCACHE_SUFFIX appended
+//
+bool keycache_open(keycache_t *cache, FILE *keyfile, const char *key_path);
+
+//
+// Loads a public key and its prepared context from the cache.
+//
+// Provides:
+//  n: public exponent/modulus
+//  username: the username from the key file
+//  returns false if caching is off or the cache is missing, stale or damaged
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  username_size: bytes of room in username
+//  all mpz_t arguments to be initialized
+//
+bool keycache_load_pub(keycache_t *cache, mpz_t n, char *username, size_t username_size);
+
+//
+// Prepares a public key and writes it with its context to the cache for later runs. The cache
+// file is replaced atomically, so readers never see part of it.
+//
+// Provides:
+//  returns false if caching is off or the cache file could not be written
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  n: public exponent/modulus parsed from the key file
+//  username: the username parsed from the key file
+//
+bool keycache_save_pub(keycache_t *cache, mpz_t n, const char *username);
+
+//
+// Loads a private key and its prepared context from the cache.
+//
+// Provides:
+//  pq: private modulus
+//  d: private exponent
+//  crt: CRT components, if the key has them
+//  has_crt: whether the key has the CRT components
+//  returns false if caching is off or the cache is missing, stale or damaged
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  all mpz_t arguments to be initialized
+//
+bool keycache_load_priv(keycache_t *cache, mpz_t pq, mpz_t d, ss_crt_t *crt, bool *has_crt);
+
+//
+// Prepares a private key and writes it with its context to the cache for later runs, replacing
+// the cache file atomically.
+//
+// Provides:
+//  returns false if caching is off or the cache file could not be written
+//
+// Requires:
+//  cache: set up by keycache_open()
+//  pq: private modulus parsed from the key file
+//  d: private exponent parsed from the key file
+//  crt: CRT components parsed from the key file, or NULL for older two-line keys
+//
+bool keycache_save_priv(keycache_t *cache, mpz_t pq, mpz_t d, ss_crt_t *crt);
+
+//
+// The key's prepared context, for the prepared argument of the ss.h file functions.
+//
+// Provides:
+//  returns the context loaded or prepared by the last load or save call, or NULL if none was
+//
+// Requires:
+//  cache: set up by keycache_open()
+//
+const ss_ctx_t *keycache_ctx(const keycache_t *cache);
+
+//
+// Frees everything owned by the cache, including the context keycache_ctx() handed out.
+//
+// Requires:
+//  cache: set up by keycache_open()
+//
+void keycache_close(keycache_t *cache);
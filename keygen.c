@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h> //atof
+#include <string.h>
 #include <unistd.h> //getopt().
+#include <getopt.h> //getopt_long().
 #include <time.h>
 #include <gmp.h>
 #include <sys/stat.h>
@@ -8,10 +10,142 @@
 #include "ss.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "arena.h"
+#include "stats.h"
+#include "pool.h"
+#include "keyring.h"
+#include "ssbin.h"
 
-#define OPTIONS "b:i:n:d:s:hv"
+#define OPTIONS "b:i:n:d:s:w:t:F:N:o:hv"
+
+// keys generated per round of a bulk run for each thread, before they are written out
+#define BULK_KEYS_PER_THREAD 64
+
+// --stats takes an optional format, so it is only spelled --stats or --stats=format
+static struct option long_options[]
+    = { { "stats", optional_argument, NULL, 'S' }, { NULL, 0, NULL, 0 } };
+
+// one key pair of a bulk run, serialized in the binary key format
+typedef struct {
+    uint64_t id;
+    char *pub;
+    size_t pub_size;
+    char *priv;
+    size_t priv_size;
+    bool ok; // false if the thread could not seed a random state
+} bulk_key_t;
+
+// one round of a bulk run: keys[i] is key number first + i of the run
+typedef struct {
+    uint64_t first;
+    uint64_t existing; // keys already in the keyring, which a seeded run numbers its keys after
+    bool seeded;
+    uint32_t seed;
+    uint32_t bits;
+    uint32_t iters;
+    uint64_t interval;
+    char *username;
+    bulk_key_t *keys;
+} bulk_t;
+
+//
+// Generates one key pair of a bulk run from a random state of its own, so the pool can hand
+// keys to whichever thread is free: with -s, the state is derived from the seed and the key's
+// number in the keyring, which makes the keyring the same whatever the number of threads, and
+// keeps a run that adds to a keyring from generating the keys an earlier run with the same seed
+// already put in it.
+//
+static void bulk_key(void *arg, uint64_t index, uint32_t thread) {
+    (void) thread;
+    bulk_t *bulk = (bulk_t *) arg;
+    bulk_key_t *key = &bulk->keys[index];
+    gmp_randstate_t rng;
+    if (bulk->seeded) {
+        randstate_derive(rng, bulk->seed, bulk->existing + bulk->first + index);
+        key->ok = true;
+    } else {
+        key->ok = randstate_entropy(rng);
+    }
+    if (!key->ok) {
+        gmp_randclear(rng);
+        return;
+    }
+
+    mpz_t p, q, n, d, pq;
+    mpz_inits(p, q, n, d, pq, NULL);
+    ss_crt_t crt;
+    ss_crt_init(&crt);
+    ss_make_pub_r(p, q, n, bulk->bits, bulk->iters, bulk->interval, rng);
+    ss_make_priv(d, pq, p, q);
+    ss_make_crt(&crt, d, p, q);
+    key->id = ssbin_fingerprint(n);
+
+    FILE *pub = open_memstream(&key->pub, &key->pub_size);
+    ss_write_pub_bin(n, bulk->username, pub);
+    fclose(pub);
+    FILE *priv = open_memstream(&key->priv, &key->priv_size);
+    ss_write_priv_bin(pq, d, &crt, priv);
+    fclose(priv);
+
+    ss_crt_clear(&crt);
+    mpz_clears(p, q, n, d, pq, NULL);
+    gmp_randclear(rng);
+}
+
+//
+// Generates count key pairs on a pool of threads and adds them to a keyring, then prints the ID
+// of each new key in order once the keyring is written. Exits with an error message on failure,
+// leaving the keyring as it was and printing no IDs.
+//
+static void bulk_keygen(const char *keyring_name, uint64_t count, uint32_t threads,
+    bulk_t *bulk) {
+    keyring_writer_t writer;
+    if (!keyring_create(&writer, keyring_name)) {
+        fprintf(stderr, "Error: unable to write keyring, or it is not a keyring -- '%s'\n",
+            keyring_name);
+        exit(1);
+    }
+
+    pool_t *pool = pool_create(threads);
+    uint64_t round = (uint64_t) BULK_KEYS_PER_THREAD * threads;
+    bulk->keys = (bulk_key_t *) calloc(round, sizeof(bulk_key_t));
+    bulk->existing = writer.count;
+    uint64_t *ids = (uint64_t *) malloc(count * sizeof(uint64_t));
+    bool ok = ids != NULL;
+    for (bulk->first = 0; ok && bulk->first < count; bulk->first += round) {
+        uint64_t keys = count - bulk->first < round ? count - bulk->first : round;
+        pool_run(pool, bulk_key, bulk, keys);
+        for (uint64_t i = 0; i < keys; i++) {
+            bulk_key_t *key = &bulk->keys[i];
+            ok = ok && key->ok
+                && keyring_add(&writer, key->id, (uint8_t *) key->pub, key->pub_size,
+                    (uint8_t *) key->priv, key->priv_size);
+            if (ok) {
+                ids[bulk->first + i] = key->id;
+            }
+            free(key->pub);
+            free(key->priv);
+            memset(key, 0, sizeof(bulk_key_t));
+        }
+    }
+    pool_delete(&pool);
+    free(bulk->keys);
+
+    if (!keyring_commit(&writer, ok)) {
+        fprintf(stderr, "Error: unable to write keyring, or a key ID is already in it -- '%s'\n",
+            keyring_name);
+        exit(1);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        printf("%016lx\n", (unsigned long) ids[i]);
+    }
+    free(ids);
+}
 
 int main(int argc, char **argv) {
+    // GMP allocates from per-thread free lists; must come before any mpz_t is initialized.
+    arena_enable();
+
     int opt = 0;
 
     // setting default bits and iterations
@@ -20,6 +154,10 @@ int main(int argc, char **argv) {
     // disable verbose by default
     int verbose = 0;
 
+    // no per-stage statistics by default
+    bool show_stats = false;
+    bool stats_json = false;
+
     // file steams
     FILE *pub_key_file;
     FILE *priv_key_file;
@@ -29,6 +167,20 @@ int main(int argc, char **argv) {
     char *priv_key_name = "ss.priv";
 
     uint32_t seed = time(NULL);
+    bool seeded = false;
+
+    // random restart prime search by default
+    uint64_t interval = 0;
+
+    // single-threaded by default
+    uint32_t threads = 1;
+
+    // hexstring key files by default
+    bool binary = false;
+
+    // one key pair by default, not a keyring of many
+    uint64_t count = 0;
+    char *keyring_name = NULL;
 
     // help_message
     const char *help_message
@@ -45,25 +197,93 @@ int main(int argc, char **argv) {
           "   -i iterations   Miller-Rabin iterations for testing primes (default: 50).\n"
           "   -n pbfile       Public key file (default: ss.pub).\n"
           "   -d pvfile       Private key file (default: ss.priv).\n"
-          "   -s seed         Random seed for testing.\n";
+          "   -s seed         Random seed for testing.\n"
+          "   -w width        Search primes by sieving intervals of this width (default: 0, off).\n"
+          "   -t threads      Search for p and q in parallel on this many threads (default: 1).\n"
+          "                   With -N, generate that many keys at a time instead.\n"
+          "   -F format       Key file format, hex or bin (default: hex).\n"
+          "   -N count        Generate count key pairs into the keyring given by -o, and print\n"
+          "                   their IDs, one per line. An existing keyring is added to;\n"
+          "                   with -s, its new keys are numbered after the keys already in it.\n"
+          "   -o keyring      Keyring file for -N.\n"
+          "   --stats[=format] Print per-stage timings to stderr, as text or json (default: text).\n";
 
     // 1. Parse command-line options using getopt() and handle them accordingly.
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'b': bits = atoi(optarg); break;
         case 'i': iters = atoi(optarg); break;
         case 'n': pub_key_name = optarg; break;
         case 'd': priv_key_name = optarg; break;
-        case 's': seed = atoi(optarg); break;
+        case 's':
+            seed = atoi(optarg);
+            seeded = true;
+            break;
+        case 'w': interval = strtoull(optarg, NULL, 10); break;
+        case 't':
+            if (!pool_parse_threads(&threads, optarg)) {
+                fprintf(stderr, "Error: invalid number of threads -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N': count = strtoull(optarg, NULL, 10); break;
+        case 'o': keyring_name = optarg; break;
+        case 'F':
+            if (strcmp(optarg, "bin") == 0) {
+                binary = true;
+            } else if (strcmp(optarg, "hex") == 0) {
+                binary = false;
+            } else {
+                fprintf(stderr, "Error: unknown format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
         case 'v': verbose = 1; break;
+        case 'S':
+            show_stats = true;
+            if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                stats_json = false;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_json = true;
+            } else {
+                fprintf(stderr, "Error: unknown stats format -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
         case 'h': printf("%s", help_message); return 1;
         default:
             fprintf(stderr,
-                "Usage: %s [-b bits] [-i iterations] [-n pbfile] [-d pvfile] [-s seed] [-v] [-h]\n",
+                "Usage: %s [-b bits] [-i iterations] [-n pbfile] [-d pvfile] [-s seed] [-w width] "
+                "[-t threads] [-F format] [-N count -o keyring] [-v] [-h] [--stats[=format]]\n",
                 argv[0]);
             exit(1);
         }
     }
+    if (show_stats && !stats_enable()) {
+        fprintf(stderr, "Error: statistics were compiled out, rebuild with make STATS=1\n");
+        exit(1);
+    }
+    if ((count > 0) != (keyring_name != NULL)) {
+        fprintf(stderr, "Error: -N and -o go together, and need at least 1 key\n");
+        exit(1);
+    }
+    // the threaded search of a single key pair draws fresh candidates and cannot sieve intervals
+    if (count == 0 && threads > 1 && interval > 0) {
+        fprintf(stderr, "Error: -w does not apply with -t, except with -N\n");
+        exit(1);
+    }
+
+    // With -N, many key pairs go into one keyring instead of the two key files.
+    if (count > 0) {
+        arena_fit(bits);
+        bulk_t bulk = { .seeded = seeded, .seed = seed, .bits = bits, .iters = iters,
+            .interval = interval, .username = getenv("USER") };
+        bulk_keygen(keyring_name, count, threads, &bulk);
+        if (show_stats) {
+            stats_report(stderr, stats_json);
+        }
+        return 0;
+    }
 
     // 2. Open the public and private key files using fopen().
 
@@ -93,16 +313,32 @@ int main(int argc, char **argv) {
     // 5. Make the public and private keys using ss_make_pub() and ss_make_priv(), respectively.
     mpz_t p, q, n, d, pq;
     mpz_inits(p, q, n, d, pq, NULL);
+    arena_fit(bits);
 
-    ss_make_pub(p, q, n, bits, iters);
+    // Threaded search draws from per-thread streams derived from the seed instead.
+    if (threads > 1) {
+        ss_make_pub_mt(p, q, n, bits, iters, threads, seed);
+    } else {
+        ss_make_pub_search(p, q, n, bits, iters, interval);
+    }
     ss_make_priv(d, pq, p, q);
 
+    // Precompute the CRT components so decrypt can work mod p and mod q separately.
+    ss_crt_t crt;
+    ss_crt_init(&crt);
+    ss_make_crt(&crt, d, p, q);
+
     // 6. Get the current user’s name as a string. You will want to use getenv().
     char *username = getenv("USER");
 
     // 7. Write the computed public and private key to their respective files.
-    ss_write_pub(n, username, pub_key_file);
-    ss_write_priv(pq, d, priv_key_file);
+    if (binary) {
+        ss_write_pub_bin(n, username, pub_key_file);
+        ss_write_priv_bin(pq, d, &crt, priv_key_file);
+    } else {
+        ss_write_pub(n, username, pub_key_file);
+        ss_write_priv_crt(pq, d, &crt, priv_key_file);
+    }
 
     // 8. If verbose output is enabled print the following, each with a trailing newline, in order:
     if (verbose) {
@@ -118,8 +354,21 @@ int main(int argc, char **argv) {
         gmp_printf("d  (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
         // (f) the private modulus pq
         gmp_printf("pq (%d bits) = %Zd\n", mpz_sizeinbase(pq, 2), pq);
+        // (g) how many prime candidates the small-prime sieve rejected
+        prime_stats_t stats;
+        prime_stats(&stats);
+        printf("candidates = %lu, sieved = %lu (%.1f%%), Miller-Rabin = %lu\n",
+            (unsigned long) stats.candidates, (unsigned long) stats.sieved,
+            stats.candidates ? 100.0 * stats.sieved / stats.candidates : 0.0,
+            (unsigned long) stats.tested);
+        // (h) how GMP's allocations were served
+        arena_report(stdout);
+    }
+    if (show_stats) {
+        stats_report(stderr, stats_json);
     }
 
+    ss_crt_clear(&crt);
     mpz_clears(p, q, n, d, pq, NULL);
     fclose(pub_key_file);
     fclose(priv_key_file);
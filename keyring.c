@@ -0,0 +1,356 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#include "keyring.h"
+#include "ssbin.h"
+
+static void put_be(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// reads table entry i
+static bool read_entry(keyring_t *ring, uint64_t i, keyring_entry_t *entry) {
+    uint8_t bytes[KEYRING_ENTRY_SIZE];
+    if (fseeko(ring->file, ring->table + i * KEYRING_ENTRY_SIZE, SEEK_SET) != 0
+        || fread(bytes, sizeof(bytes), 1, ring->file) != 1) {
+        return false;
+    }
+    entry->id = get_be(bytes, 8);
+    entry->offset = get_be(&bytes[8], 8);
+    entry->pub_size = get_be(&bytes[16], 4);
+    entry->priv_size = get_be(&bytes[20], 4);
+    // both keys must lie between the header and the table
+    return entry->offset >= KEYRING_HEADER_SIZE && entry->offset <= ring->table
+        && (uint64_t) entry->pub_size + entry->priv_size <= ring->table - entry->offset;
+}
+
+// reads size bytes at offset, returns them to be freed with free(), or NULL
+static uint8_t *read_at(FILE *file, uint64_t offset, uint32_t size) {
+    uint8_t *bytes = (uint8_t *) malloc((size_t) size + 1);
+    if (fseeko(file, offset, SEEK_SET) != 0 || fread(bytes, sizeof(uint8_t), size, file) != size) {
+        free(bytes);
+        return NULL;
+    }
+    return bytes;
+}
+
+//
+// Reads and validates a keyring's header.
+//
+// Provides:
+//  ring: ready for keyring_find()
+//  returns false if file is not a keyring, or its table does not end the file
+//
+// Requires:
+//  ring: the keyring to set up; holds on to file, which the caller still closes
+//  file: open and readable file stream to a regular file
+//
+bool keyring_open(keyring_t *ring, FILE *file) {
+    uint8_t header[KEYRING_HEADER_SIZE];
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)
+        || fseeko(file, 0, SEEK_SET) != 0
+        || fread(header, sizeof(header), 1, file) != 1 || memcmp(header, KEYRING_MAGIC, 4) != 0
+        || get_be(&header[4], 2) != KEYRING_VERSION) {
+        return false;
+    }
+    ring->file = file;
+    ring->count = get_be(&header[8], 8);
+    ring->table = get_be(&header[16], 8);
+    uint64_t size = info.st_size;
+    return ring->table >= KEYRING_HEADER_SIZE && ring->table <= size
+        && ring->count == (size - ring->table) / KEYRING_ENTRY_SIZE
+        && (size - ring->table) % KEYRING_ENTRY_SIZE == 0;
+}
+
+//
+// Finds a key's table entry by binary search, reading only the entries on the way.
+//
+// Provides:
+//  entry: the key's table entry
+//  returns false if there is no key with that ID
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//
+bool keyring_find(keyring_t *ring, uint64_t id, keyring_entry_t *entry) {
+    uint64_t low = 0, high = ring->count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (!read_entry(ring, middle, entry)) {
+            return false;
+        }
+        if (entry->id == id) {
+            return true;
+        }
+        if (entry->id < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+//
+// Reads a key's public half from a keyring.
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the key's creator
+//  returns false if there is no key with that ID, or it is damaged
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//  username_size: bytes of room in username
+//  all mpz_t arguments to be initialized
+//
+bool keyring_read_pub(
+    keyring_t *ring, uint64_t id, mpz_t n, char username[], size_t username_size) {
+    keyring_entry_t entry;
+    if (!keyring_find(ring, id, &entry)) {
+        return false;
+    }
+    uint8_t *key = read_at(ring->file, entry.offset, entry.pub_size);
+    bool ok = key != NULL && ss_load_pub_bin(n, username, username_size, key, entry.pub_size)
+        && ssbin_fingerprint(n) == id;
+    free(key);
+    return ok;
+}
+
+//
+// Reads a key's private half, with its CRT components, from a keyring.
+//
+// Provides:
+//  pq: private modulus
+//  d: private exponent
+//  crt: CRT components
+//  returns false if there is no key with that ID, or it is damaged
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool keyring_read_priv(keyring_t *ring, uint64_t id, mpz_t pq, mpz_t d, ss_crt_t *crt) {
+    keyring_entry_t entry;
+    if (!keyring_find(ring, id, &entry)) {
+        return false;
+    }
+    uint8_t *key = read_at(ring->file, entry.offset + entry.pub_size, entry.priv_size);
+    bool ok = key != NULL && ss_load_priv_bin(pq, d, crt, key, entry.priv_size);
+    free(key);
+    if (ok) {
+        // n = p * pq, which ties the private key to the ID of its public key
+        mpz_t n;
+        mpz_init(n);
+        mpz_mul(n, crt->p, pq);
+        ok = ssbin_fingerprint(n) == id;
+        mpz_clear(n);
+    }
+    return ok;
+}
+
+// copies the keys and table entries of the existing keyring at path into the writer
+static bool copy_keyring(keyring_writer_t *writer, FILE *file) {
+    keyring_t ring;
+    if (!keyring_open(&ring, file)) {
+        return false;
+    }
+    writer->capacity = ring.count + 1024;
+    writer->entries = (keyring_entry_t *) malloc(writer->capacity * sizeof(keyring_entry_t));
+    for (uint64_t i = 0; i < ring.count; i++) {
+        if (!read_entry(&ring, i, &writer->entries[i])) {
+            return false;
+        }
+    }
+    writer->count = ring.count;
+
+    // the keys stay at the same offsets, since the header has a fixed size
+    uint8_t buffer[1 << 16];
+    uint64_t left = ring.table - KEYRING_HEADER_SIZE;
+    if (fseeko(file, KEYRING_HEADER_SIZE, SEEK_SET) != 0) {
+        return false;
+    }
+    while (left > 0) {
+        size_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        if (fread(buffer, sizeof(uint8_t), chunk, file) != chunk
+            || fwrite(buffer, sizeof(uint8_t), chunk, writer->file) != chunk) {
+            return false;
+        }
+        left -= chunk;
+    }
+    return true;
+}
+
+//
+// Starts writing a keyring. If path is already a keyring, its keys are kept and new ones are
+// added to them; nothing changes on disk until keyring_commit().
+//
+// Provides:
+//  writer: ready for keyring_add()
+//  returns false if path exists but is not a keyring, or the temporary file cannot be written
+//
+// Requires:
+//  writer: the writer to set up
+//  path: name of the keyring; the temporary file is path with the process id appended
+//
+bool keyring_create(keyring_writer_t *writer, const char *path) {
+    memset(writer, 0, sizeof(keyring_writer_t));
+    writer->path = strdup(path);
+    // The process id keeps concurrent runs from writing into each other's temporary file.
+    writer->temp = (char *) malloc(strlen(path) + 32);
+    sprintf(writer->temp, "%s.%ld", path, (long) getpid());
+
+    // Created with the private key's permissions from the start, so no key is ever readable.
+    int fd = open(writer->temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    writer->file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    uint8_t header[KEYRING_HEADER_SIZE] = { 0 };
+    bool ok = writer->file != NULL && fwrite(header, sizeof(header), 1, writer->file) == 1;
+
+    FILE *existing = ok ? fopen(path, "r") : NULL;
+    if (existing != NULL) {
+        ok = copy_keyring(writer, existing);
+        fclose(existing);
+    } else if (ok && errno != ENOENT) {
+        ok = false;
+    }
+    if (ok && writer->entries == NULL) {
+        writer->capacity = 1024;
+        writer->entries = (keyring_entry_t *) malloc(writer->capacity * sizeof(keyring_entry_t));
+    }
+    if (!ok) {
+        if (writer->file == NULL && fd >= 0) {
+            close(fd);
+        }
+        keyring_commit(writer, false);
+    }
+    return ok;
+}
+
+//
+// Adds one key pair.
+//
+// Provides:
+//  returns false if the keys could not be written
+//
+// Requires:
+//  writer: set up by keyring_create()
+//  id: the key ID, ssbin_fingerprint() of the public key
+//  pub: the public key as ss_write_pub_bin() wrote it
+//  pub_size: bytes in pub
+//  priv: the private key as ss_write_priv_bin() wrote it
+//  priv_size: bytes in priv
+//
+bool keyring_add(keyring_writer_t *writer, uint64_t id, const uint8_t *pub, uint32_t pub_size,
+    const uint8_t *priv, uint32_t priv_size) {
+    if (writer->count == writer->capacity) {
+        writer->capacity *= 2;
+        writer->entries = (keyring_entry_t *) realloc(
+            writer->entries, writer->capacity * sizeof(keyring_entry_t));
+    }
+    off_t offset = ftello(writer->file);
+    writer->entries[writer->count++] = (keyring_entry_t) { id, offset, pub_size, priv_size };
+    return offset >= 0 && fwrite(pub, sizeof(uint8_t), pub_size, writer->file) == pub_size
+        && fwrite(priv, sizeof(uint8_t), priv_size, writer->file) == priv_size;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint64_t x = ((const keyring_entry_t *) a)->id, y = ((const keyring_entry_t *) b)->id;
+    return (x > y) - (x < y);
+}
+
+// writes the sorted table after the keys, then the header that points to it
+static bool write_table(keyring_writer_t *writer) {
+    qsort(writer->entries, writer->count, sizeof(keyring_entry_t), compare_entries);
+    for (uint64_t i = 1; i < writer->count; i++) {
+        if (writer->entries[i].id == writer->entries[i - 1].id) {
+            return false;
+        }
+    }
+    off_t table = ftello(writer->file);
+    uint8_t bytes[KEYRING_ENTRY_SIZE];
+    for (uint64_t i = 0; i < writer->count; i++) {
+        put_be(bytes, writer->entries[i].id, 8);
+        put_be(&bytes[8], writer->entries[i].offset, 8);
+        put_be(&bytes[16], writer->entries[i].pub_size, 4);
+        put_be(&bytes[20], writer->entries[i].priv_size, 4);
+        if (fwrite(bytes, sizeof(bytes), 1, writer->file) != 1) {
+            return false;
+        }
+    }
+    uint8_t header[KEYRING_HEADER_SIZE] = { 0 };
+    memcpy(header, KEYRING_MAGIC, 4);
+    put_be(&header[4], KEYRING_VERSION, 2);
+    put_be(&header[8], writer->count, 8);
+    put_be(&header[16], table, 8);
+    return table >= 0 && fseeko(writer->file, 0, SEEK_SET) == 0
+        && fwrite(header, sizeof(header), 1, writer->file) == 1;
+}
+
+//
+// Writes the table and header and renames the finished keyring over path, or throws it away.
+// Frees everything owned by the writer either way.
+//
+// Provides:
+//  returns false if two keys have the same ID or the keyring could not be written, in which
+//  case path is left as it was
+//
+// Requires:
+//  writer: set up by keyring_create()
+//  keep: false to throw the keyring away without touching path
+//
+bool keyring_commit(keyring_writer_t *writer, bool keep) {
+    bool written = keep && writer->file != NULL && write_table(writer);
+    written = writer->file != NULL && fclose(writer->file) == 0 && written;
+    written = written && rename(writer->temp, writer->path) == 0;
+    if (!written) {
+        remove(writer->temp);
+    }
+    free(writer->entries);
+    free(writer->temp);
+    free(writer->path);
+    memset(writer, 0, sizeof(keyring_writer_t));
+    return written;
+}
+
+//
+// Parses a key ID as keygen -N prints it: up to 16 hex digits.
+//
+// Provides:
+//  id: the key ID
+//  returns false unless all of text is 1 to 16 hex digits
+//
+// Requires:
+//  text: the key ID as text
+//
+bool keyring_parse_id(uint64_t *id, const char *text) {
+    size_t digits = strspn(text, "0123456789abcdefABCDEF");
+    if (digits == 0 || digits > 16 || text[digits] != '\0') {
+        return false;
+    }
+    *id = strtoull(text, NULL, 16);
+    return true;
+}
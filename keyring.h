@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "ss.h"
+
+//
+// Keyring: many key pairs in one file, for provisioning keys in bulk.
+//
+// A 32-byte header, the keys, then a table of one entry per key sorted by key ID, so a key is
+// found by binary search over the table without reading any of the others. A key's ID is the
+// fingerprint of its public key n (ssbin_fingerprint()), the same value binary ciphertext
+// containers carry in their header. All integers are big-endian.
+//
+//  offset  size  field
+//       0     4  magic "SSKR"
+//       4     2  version
+//       6     2  reserved, 0
+//       8     8  number of keys
+//      16     8  offset of the table
+//      24     8  reserved, 0
+//
+// Each key is its public key followed by its private key, both exactly as the binary key files
+// of keygen -F bin (see ss.h), so each carries its own checksum. Each table entry is:
+//
+//  offset  size  field
+//       0     8  key ID
+//       8     8  offset of the public key
+//      16     4  bytes in the public key
+//      20     4  bytes in the private key, which follows the public key
+//
+// The file holds private keys, so it is created with the same permissions as ss.priv.
+//
+#define KEYRING_MAGIC       "SSKR"
+#define KEYRING_VERSION     1
+#define KEYRING_HEADER_SIZE 32
+#define KEYRING_ENTRY_SIZE  24
+
+typedef struct {
+    uint64_t id;
+    uint64_t offset; // where the public key starts
+    uint32_t pub_size;
+    uint32_t priv_size;
+} keyring_entry_t;
+
+// an open keyring, read one entry at a time
+typedef struct {
+    FILE *file;
+    uint64_t count; // keys
+    uint64_t table; // offset of the table
+} keyring_t;
+
+// a keyring being written: existing keys are copied to a temporary file, new ones appended
+typedef struct {
+    char *path;
+    char *temp; // the temporary file, renamed over path by keyring_commit()
+    FILE *file;
+    keyring_entry_t *entries;
+    uint64_t count;
+    uint64_t capacity;
+} keyring_writer_t;
+
+//
+// Reads and validates a keyring's header.
+//
+// Provides:
+//  ring: ready for keyring_find()
+//  returns false if file is not a keyring, or its table does not end the file
+//
+// Requires:
+//  ring: the keyring to set up; holds on to file, which the caller still closes
+//  file: open and readable file stream to a regular file
+//
+bool keyring_open(keyring_t *ring, FILE *file);
+
+//
+// Finds a key's table entry by binary search, reading only the entries on the way.
+//
+// Provides:
+//  entry: the key's table entry
+//  returns false if there is no key with that ID
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//
+bool keyring_find(keyring_t *ring, uint64_t id, keyring_entry_t *entry);
+
+//
+// Reads a key's public half from a keyring.
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the key's creator
+//  returns false if there is no key with that ID, or it is damaged
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//  username_size: bytes of room in username
+//  all mpz_t arguments to be initialized
+//
+bool keyring_read_pub(
+    keyring_t *ring, uint64_t id, mpz_t n, char username[], size_t username_size);
+
+//
+// Reads a key's private half, with its CRT components, from a keyring.
+//
+// Provides:
+//  pq: private modulus
+//  d: private exponent
+//  crt: CRT components
+//  returns false if there is no key with that ID, or it is damaged
+//
+// Requires:
+//  ring: set up by keyring_open()
+//  id: the key ID
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool keyring_read_priv(keyring_t *ring, uint64_t id, mpz_t pq, mpz_t d, ss_crt_t *crt);
+
+//
+// Starts writing a keyring. If path is already a keyring, its keys are kept and new ones are
+// added to them; nothing changes on disk until keyring_commit().
+//
+// Provides:
+//  writer: ready for keyring_add()
+//  returns false if path exists but is not a keyring, or the temporary file cannot be written
+//
+// Requires:
+//  writer: the writer to set up
+//  path: name of the keyring; the temporary file is path with the process id appended
+//
+bool keyring_create(keyring_writer_t *writer, const char *path);
+
+//
+// Adds one key pair.
+//
+// Provides:
+//  returns false if the keys could not be written
+//
+// Requires:
+//  writer: set up by keyring_create()
+//  id: the key ID, ssbin_fingerprint() of the public key
+//  pub: the public key as ss_write_pub_bin() wrote it
+//  pub_size: bytes in pub
+//  priv: the private key as ss_write_priv_bin() wrote it
+//  priv_size: bytes in priv
+//
+bool keyring_add(keyring_writer_t *writer, uint64_t id, const uint8_t *pub, uint32_t pub_size,
+    const uint8_t *priv, uint32_t priv_size);
+
+//
+// Writes the table and header and renames the finished keyring over path, or throws it away.
+// Frees everything owned by the writer either way.
+//
+// Provides:
+//  returns false if two keys have the same ID or the keyring could not be written, in which
+//  case path is left as it was
+//
+// Requires:
+//  writer: set up by keyring_create()
+//  keep: false to throw the keyring away without touching path
+//
+bool keyring_commit(keyring_writer_t *writer, bool keep);
+
+//
+// Parses a key ID as keygen -N prints it: up to 16 hex digits.
+//
+// Provides:
+//  id: the key ID
+//  returns false unless all of text is 1 to 16 hex digits
+//
+// Requires:
+//  text: the key ID as text
+//
+bool keyring_parse_id(uint64_t *id, const char *text);
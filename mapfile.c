@@ -0,0 +1,68 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mapfile.h"
+
+//
+// Maps the rest of a stream, starting at its current position, for one sequential pass.
+//
+// Provides:
+//  map: the mapping, with base set to NULL when the stream cannot be mapped
+//  returns true if the stream was mapped
+//
+// Requires:
+//  map: the mapping to fill in
+//  file: open and readable file stream
+//
+bool mapfile_open(mapfile_t *map, FILE *file) {
+    map->base = NULL;
+    map->length = 0;
+    map->data = NULL;
+    map->size = 0;
+
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    // ftello() accounts for anything stdio has already buffered ahead
+    off_t position = ftello(file);
+    if (position < 0 || position >= info.st_size) {
+        return false;
+    }
+
+    void *base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    // the kernel can read ahead aggressively and drop pages behind us
+    madvise(base, info.st_size, MADV_SEQUENTIAL);
+
+    map->base = base;
+    map->length = info.st_size;
+    map->data = (const uint8_t *) base + position;
+    map->size = info.st_size - position;
+    return true;
+}
+
+//
+// Unmaps a stream and moves it to the end of the file, as if it had been read through.
+//
+// Requires:
+//  map: filled in by mapfile_open()
+//  file: the stream that was mapped
+//
+void mapfile_close(mapfile_t *map, FILE *file) {
+    if (map->base == NULL) {
+        return;
+    }
+    munmap(map->base, map->length);
+    map->base = NULL;
+    fseeko(file, 0, SEEK_END);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// A read-only memory mapping of the unread part of an input stream.
+// Only regular files can be mapped; pipes, terminals and empty files fall back to stdio.
+//
+typedef struct {
+    void *base; // start of the mapping, NULL if the stream is not mapped
+    size_t length; // bytes mapped
+    const uint8_t *data; // the stream's current position inside the mapping
+    size_t size; // bytes from data to the end of the file
+} mapfile_t;
+
+//
+// Maps the rest of a stream, starting at its current position, for one sequential pass.
+//
+// Provides:
+//  map: the mapping, with base set to NULL when the stream cannot be mapped
+//  returns true if the stream was mapped
+//
+// Requires:
+//  map: the mapping to fill in
+//  file: open and readable file stream
+//
+bool mapfile_open(mapfile_t *map, FILE *file);
+
+//
+// Unmaps a stream and moves it to the end of the file, as if it had been read through.
+//
+// Requires:
+//  map: filled in by mapfile_open()
+//  file: the stream that was mapped
+//
+void mapfile_close(mapfile_t *map, FILE *file);
@@ -0,0 +1,339 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "mont.h"
+
+// copies the low size limbs of x into out, zero-padding above its used limbs
+static void limbs_from_mpz(mp_limb_t *out, mpz_t x, mp_size_t size) {
+    mp_size_t used = mpz_size(x);
+    if (used > 0) {
+        memcpy(out, mpz_limbs_read(x), used * sizeof(mp_limb_t));
+    }
+    memset(&out[used], 0, (size - used) * sizeof(mp_limb_t));
+}
+
+//
+// Montgomery reduction: rp = tp / R mod n.
+// tp holds 2 * size limbs and is clobbered; the result is fully reduced below n.
+//
+static void redc(mp_limb_t *rp, mp_limb_t *tp, mont_t *ctx) {
+    mp_size_t size = ctx->size;
+
+    // Clear one low limb per round. Each cleared limb is reused to hold that round's carry.
+    for (mp_size_t i = 0; i < size; i++) {
+        mp_limb_t u = tp[i] * ctx->ninv;
+        tp[i] = mpn_addmul_1(&tp[i], ctx->n, size, u);
+    }
+    mp_limb_t carry = mpn_add_n(rp, &tp[size], tp, size);
+
+    // The sum is below 2n, so at most one subtraction is needed.
+    if (carry != 0 || mpn_cmp(rp, ctx->n, size) >= 0) {
+        mpn_sub_n(rp, rp, ctx->n, size);
+    }
+}
+
+// rp = ap * bp / R mod n, with tp as 2 * size limbs of scratch
+static void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, mp_limb_t *tp,
+    mont_t *ctx) {
+    if (ap == bp) {
+        mpn_sqr(tp, ap, ctx->size);
+    } else {
+        mpn_mul_n(tp, ap, bp, ctx->size);
+    }
+    redc(rp, tp, ctx);
+}
+
+//
+// Builds the Montgomery context for a modulus.
+//
+// ctx: the context to initialize
+// n: odd modulus greater than 1
+//
+void mont_init(mont_t *ctx, mpz_t n) {
+    ctx->size = 0;
+    ctx->capacity = 0;
+    ctx->n = NULL;
+    mont_set(ctx, n);
+}
+
+//
+// Builds a context with the same modulus as another by copying its constants, skipping the
+// divisions mont_init() needs.
+//
+// ctx: the context to initialize
+// src: a context, or a view of one with only size, n, r, r2 and ninv filled in
+//
+void mont_init_copy(mont_t *ctx, const mont_t *src) {
+    mp_size_t size = src->size;
+    // same layout as mont_set(), so the context can be rebuilt in place later
+    ctx->n = (mp_limb_t *) malloc((6 * size + 3) * sizeof(mp_limb_t));
+    ctx->size = size;
+    ctx->capacity = size;
+    ctx->r = &ctx->n[size];
+    ctx->r2 = &ctx->n[2 * size];
+    ctx->temp = &ctx->n[3 * size];
+    ctx->ninv = src->ninv;
+    memcpy(ctx->n, src->n, size * sizeof(mp_limb_t));
+    memcpy(ctx->r, src->r, size * sizeof(mp_limb_t));
+    memcpy(ctx->r2, src->r2, size * sizeof(mp_limb_t));
+}
+
+//
+// Rebuilds an initialized or zero-filled context for a new modulus.
+// Reuses the existing buffers, so it does not allocate unless n has more limbs than before.
+//
+// ctx: an initialized context
+// n: odd modulus greater than 1
+//
+void mont_set(mont_t *ctx, mpz_t n) {
+    mp_size_t size = mpz_size(n);
+    if (size > ctx->capacity) {
+        // n, R, R^2, then 2 * size + 1 limbs of dividend and size + 2 of quotient
+        free(ctx->n);
+        ctx->n = (mp_limb_t *) malloc((6 * size + 3) * sizeof(mp_limb_t));
+        ctx->capacity = size;
+    }
+    mp_size_t capacity = ctx->capacity;
+    ctx->size = size;
+    ctx->r = &ctx->n[capacity];
+    ctx->r2 = &ctx->n[2 * capacity];
+    ctx->temp = &ctx->n[3 * capacity];
+    limbs_from_mpz(ctx->n, n, size);
+
+    // Newton's iteration for n^-1 mod 2^64: n * n = 1 mod 8, and every step doubles the bits.
+    mp_limb_t inv = ctx->n[0];
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - ctx->n[0] * inv;
+    }
+    ctx->ninv = -inv;
+
+    // R mod n and R^2 mod n, dividing with mpn_tdiv_qr() so nothing is allocated
+    mp_limb_t *dividend = ctx->temp;
+    mp_limb_t *quotient = &ctx->temp[2 * capacity + 1];
+    memset(dividend, 0, size * sizeof(mp_limb_t));
+    dividend[size] = 1;
+    mpn_tdiv_qr(quotient, ctx->r, 0, dividend, size + 1, ctx->n, size);
+    memset(dividend, 0, 2 * size * sizeof(mp_limb_t));
+    dividend[2 * size] = 1;
+    mpn_tdiv_qr(quotient, ctx->r2, 0, dividend, 2 * size + 1, ctx->n, size);
+}
+
+//
+// Frees the memory used by a Montgomery context.
+//
+// ctx: an initialized context
+//
+void mont_clear(mont_t *ctx) {
+    free(ctx->n);
+    ctx->n = ctx->r = ctx->r2 = ctx->temp = NULL;
+    ctx->size = ctx->capacity = 0;
+}
+
+// picks the sliding window width that minimizes multiplications for an exponent size
+static uint32_t window_width(mp_bitcnt_t bits) {
+    if (bits <= 8) {
+        return 1;
+    } else if (bits <= 24) {
+        return 2;
+    } else if (bits <= 80) {
+        return 3;
+    } else if (bits <= 240) {
+        return 4;
+    } else if (bits <= 672) {
+        return 5;
+    } else if (bits <= 1792) {
+        return 6;
+    }
+    return 7;
+}
+
+//
+// Recodes an exponent into sliding windows.
+//
+// exp: the recoding to initialize
+// e: non-negative exponent
+//
+void mont_exp_init(mont_exp_t *exp, mpz_t e) {
+    exp->capacity = 0;
+    exp->windows = NULL;
+    mont_exp_set(exp, e);
+}
+
+//
+// Copies a recoding instead of recoding the exponent again.
+//
+// exp: the recoding to initialize
+// src: a recoding, or a view of one with only width, count, windows and tail filled in
+//
+void mont_exp_init_copy(mont_exp_t *exp, const mont_exp_t *src) {
+    exp->width = src->width;
+    exp->count = src->count;
+    exp->capacity = src->count > 0 ? src->count : 1;
+    exp->windows = (mont_window_t *) malloc(exp->capacity * sizeof(mont_window_t));
+    memcpy(exp->windows, src->windows, src->count * sizeof(mont_window_t));
+    exp->tail = src->tail;
+}
+
+//
+// Recodes a new exponent into an initialized or zero-filled recoding, reusing its buffer when it
+// is big enough.
+//
+// exp: an initialized recoding
+// e: non-negative exponent
+//
+void mont_exp_set(mont_exp_t *exp, mpz_t e) {
+    mp_bitcnt_t bits = mpz_sgn(e) == 0 ? 0 : mpz_sizeinbase(e, 2);
+    exp->width = window_width(bits);
+    exp->count = 0;
+    // every window covers at least one set bit, so this is an upper bound
+    if (bits + 1 > exp->capacity) {
+        free(exp->windows);
+        exp->windows = (mont_window_t *) malloc((bits + 1) * sizeof(mont_window_t));
+        exp->capacity = bits + 1;
+    }
+
+    uint64_t zeros = 0;
+    mp_bitcnt_t i = bits;
+    while (i > 0) {
+        mp_bitcnt_t top = i - 1;
+        if (!mpz_tstbit(e, top)) {
+            zeros += 1;
+            i -= 1;
+            continue;
+        }
+        // Take up to width bits below top, then shrink so the window ends on a set bit.
+        mp_bitcnt_t low = top + 1 >= exp->width ? top + 1 - exp->width : 0;
+        while (!mpz_tstbit(e, low)) {
+            low += 1;
+        }
+        uint32_t digit = 0;
+        for (mp_bitcnt_t b = top + 1; b-- > low;) {
+            digit = (digit << 1) | mpz_tstbit(e, b);
+        }
+        exp->windows[exp->count].shift = zeros + (top - low + 1);
+        exp->windows[exp->count].digit = digit;
+        exp->count += 1;
+        zeros = 0;
+        i = low;
+    }
+    exp->tail = zeros;
+}
+
+//
+// Frees the memory used by a recoded exponent.
+//
+// exp: an initialized recoding
+//
+void mont_exp_clear(mont_exp_t *exp) {
+    free(exp->windows);
+    exp->windows = NULL;
+    exp->count = exp->capacity = 0;
+}
+
+//
+// Returns how many limbs of scratch mont_powm_scratch() needs for a modulus and exponent.
+//
+// ctx: context for the modulus n
+// exp: the recoded exponent
+//
+mp_size_t mont_scratch_limbs(mont_t *ctx, mont_exp_t *exp) {
+    // odd powers a^1, a^3, ..., a^(2^width - 1), a^2, accumulator, and 2 * size of product space
+    return (((mp_size_t) 1 << (exp->width - 1)) + 4) * ctx->size;
+}
+
+//
+// Computes o = a^e mod n with an exponent recoded by mont_exp_init().
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// exp: the recoded exponent e
+// ctx: context for the modulus n
+//
+void mont_powm_exp(mpz_t o, mpz_t a, mont_exp_t *exp, mont_t *ctx) {
+    mp_limb_t *scratch = (mp_limb_t *) malloc(mont_scratch_limbs(ctx, exp) * sizeof(mp_limb_t));
+    mont_powm_scratch(o, a, exp, ctx, scratch);
+    free(scratch);
+}
+
+//
+// Same as mont_powm_exp() with caller-provided scratch, so it makes no heap allocations
+// as long as a is below R and o already has room for n.
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// exp: the recoded exponent e
+// ctx: context for the modulus n
+// scratch: at least mont_scratch_limbs(ctx, exp) limbs
+//
+void mont_powm_scratch(mpz_t o, mpz_t a, mont_exp_t *exp, mont_t *ctx, mp_limb_t *scratch) {
+    mp_size_t size = ctx->size;
+    uint64_t entries = (uint64_t) 1 << (exp->width - 1);
+    mp_limb_t *table = scratch;
+    mp_limb_t *square = &scratch[entries * size];
+    mp_limb_t *acc = &square[size];
+    mp_limb_t *tp = &acc[size];
+
+    // Bring the base into Montgomery form: a * R^2 / R = a * R mod n.
+    // Any a below R works here, since a * (R^2 mod n) < nR still reduces fully.
+    if (mpz_size(a) > (size_t) size) {
+        mpz_t n, reduced;
+        mpz_roinit_n(n, ctx->n, size);
+        mpz_init(reduced);
+        mpz_mod(reduced, a, n);
+        limbs_from_mpz(table, reduced, size);
+        mpz_clear(reduced);
+    } else {
+        limbs_from_mpz(table, a, size);
+    }
+    mont_mul(table, table, ctx->r2, tp, ctx);
+
+    // table[i] = a^(2i + 1)
+    if (entries > 1) {
+        mont_mul(square, table, table, tp, ctx);
+        for (uint64_t i = 1; i < entries; i++) {
+            mont_mul(&table[i * size], &table[(i - 1) * size], square, tp, ctx);
+        }
+    }
+
+    // The first window starts from 1, so its squarings can be skipped.
+    if (exp->count == 0) {
+        memcpy(acc, ctx->r, size * sizeof(mp_limb_t));
+    } else {
+        memcpy(acc, &table[(exp->windows[0].digit >> 1) * size], size * sizeof(mp_limb_t));
+    }
+    for (uint64_t w = 1; w < exp->count; w++) {
+        for (uint32_t s = 0; s < exp->windows[w].shift; s++) {
+            mont_mul(acc, acc, acc, tp, ctx);
+        }
+        mont_mul(acc, acc, &table[(exp->windows[w].digit >> 1) * size], tp, ctx);
+    }
+    for (uint64_t s = 0; s < exp->tail && exp->count > 0; s++) {
+        mont_mul(acc, acc, acc, tp, ctx);
+    }
+
+    // Leave Montgomery form: acc * 1 / R.
+    memcpy(tp, acc, size * sizeof(mp_limb_t));
+    memset(&tp[size], 0, size * sizeof(mp_limb_t));
+    redc(acc, tp, ctx);
+
+    mp_limb_t *out = mpz_limbs_write(o, size);
+    memcpy(out, acc, size * sizeof(mp_limb_t));
+    mpz_limbs_finish(o, size);
+}
+
+//
+// Computes o = a^e mod n using Montgomery multiplication.
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// e: non-negative exponent
+// ctx: context for the modulus n
+//
+void mont_powm(mpz_t o, mpz_t a, mpz_t e, mont_t *ctx) {
+    mont_exp_t exp;
+    mont_exp_init(&exp, e);
+    mont_powm_exp(o, a, &exp, ctx);
+    mont_exp_clear(&exp);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include <gmp.h>
+
+//
+// Montgomery arithmetic context for one odd modulus n, built on GMP's mpn_ layer.
+// Numbers in Montgomery form are stored as x * R mod n, where R = 2^(GMP_NUMB_BITS * size).
+// The context is read-only after mont_init(), so one context can be shared between threads.
+// A zero-filled context holds no buffers yet and can be passed to mont_set() or mont_clear().
+//
+typedef struct {
+    mp_size_t size; // limbs in n
+    mp_size_t capacity; // largest size the buffers can hold without reallocating
+    mp_limb_t *n; // modulus
+    mp_limb_t *r; // R mod n, the Montgomery form of 1
+    mp_limb_t *r2; // R^2 mod n, converts into Montgomery form
+    mp_limb_t *temp; // room to compute R and R^2 mod n in mont_set()
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+} mont_t;
+
+//
+// One step of a recoded exponent: square shift times, then multiply by base^digit.
+//
+typedef struct {
+    uint32_t shift;
+    uint32_t digit; // odd, below 2^width
+} mont_window_t;
+
+//
+// An exponent recoded into sliding windows, most significant first.
+// Recoding once lets every block under a key skip the bit scanning and reuse the same schedule.
+//
+typedef struct {
+    uint32_t width; // window width in bits, chosen from the exponent size
+    uint64_t count; // number of windows
+    uint64_t capacity; // windows the buffer can hold without reallocating
+    mont_window_t *windows;
+    uint64_t tail; // squarings left after the last window (trailing zero bits)
+} mont_exp_t;
+
+//
+// Builds the Montgomery context for a modulus.
+//
+// ctx: the context to initialize
+// n: odd modulus greater than 1
+//
+void mont_init(mont_t *ctx, mpz_t n);
+
+//
+// Builds a context with the same modulus as another by copying its constants, skipping the
+// divisions mont_init() needs.
+//
+// ctx: the context to initialize
+// src: a context, or a view of one with only size, n, r, r2 and ninv filled in
+//
+void mont_init_copy(mont_t *ctx, const mont_t *src);
+
+//
+// Rebuilds an initialized or zero-filled context for a new modulus.
+// Reuses the existing buffers, so it does not allocate unless n has more limbs than before.
+//
+// ctx: an initialized context
+// n: odd modulus greater than 1
+//
+void mont_set(mont_t *ctx, mpz_t n);
+
+//
+// Frees the memory used by a Montgomery context.
+//
+// ctx: an initialized context
+//
+void mont_clear(mont_t *ctx);
+
+//
+// Computes o = a^e mod n using Montgomery multiplication.
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// e: non-negative exponent
+// ctx: context for the modulus n
+//
+void mont_powm(mpz_t o, mpz_t a, mpz_t e, mont_t *ctx);
+
+//
+// Recodes an exponent into sliding windows.
+//
+// exp: the recoding to initialize
+// e: non-negative exponent
+//
+void mont_exp_init(mont_exp_t *exp, mpz_t e);
+
+//
+// Copies a recoding instead of recoding the exponent again.
+//
+// exp: the recoding to initialize
+// src: a recoding, or a view of one with only width, count, windows and tail filled in
+//
+void mont_exp_init_copy(mont_exp_t *exp, const mont_exp_t *src);
+
+//
+// Recodes a new exponent into an initialized or zero-filled recoding, reusing its buffer when it
+// is big enough.
+//
+// exp: an initialized recoding
+// e: non-negative exponent
+//
+void mont_exp_set(mont_exp_t *exp, mpz_t e);
+
+//
+// Frees the memory used by a recoded exponent.
+//
+// exp: an initialized recoding
+//
+void mont_exp_clear(mont_exp_t *exp);
+
+//
+// Returns how many limbs of scratch mont_powm_scratch() needs for a modulus and exponent.
+//
+// ctx: context for the modulus n
+// exp: the recoded exponent
+//
+mp_size_t mont_scratch_limbs(mont_t *ctx, mont_exp_t *exp);
+
+//
+// Computes o = a^e mod n with an exponent recoded by mont_exp_init().
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// exp: the recoded exponent e
+// ctx: context for the modulus n
+//
+void mont_powm_exp(mpz_t o, mpz_t a, mont_exp_t *exp, mont_t *ctx);
+
+//
+// Same as mont_powm_exp() with caller-provided scratch, so it makes no heap allocations
+// as long as a is below R and o already has room for n.
+//
+// o: result, may alias a
+// a: base, any non-negative integer
+// exp: the recoded exponent e
+// ctx: context for the modulus n
+// scratch: at least mont_scratch_limbs(ctx, exp) limbs
+//
+void mont_powm_scratch(mpz_t o, mpz_t a, mont_exp_t *exp, mont_t *ctx, mp_limb_t *scratch);
@@ -0,0 +1,424 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "montvec.h"
+
+// The vector kernels need x86-64 intrinsics with per-function targets, and 64-bit limbs for the
+// digit conversions. Anything else builds with the scalar fallback only.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && GMP_NUMB_BITS == 64
+#define MONTVEC_X86 1
+#include <immintrin.h>
+#else
+#define MONTVEC_X86 0
+#endif
+
+// alignment of every digit array, one AVX-512 register
+#define MONTVEC_ALIGN 64
+
+#if MONTVEC_X86
+
+static bool ifma_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+}
+
+//
+// 8 lanes of 52-bit digits with the AVX-512 IFMA multiply-adds.
+// Each round adds a[j] * b[i] and n[j] * m into two accumulators at once, so every column takes at
+// most four 52-bit halves per round and the 64-bit accumulators absorb about a thousand rounds
+// before carries have to be propagated, which only happens once at the end.
+//
+__attribute__((target("avx512f,avx512ifma"))) static void mul_ifma(uint64_t *r,
+    const uint64_t *a, const uint64_t *b, const uint64_t *n, uint64_t ninv, uint32_t digits,
+    uint64_t *temp) {
+    const __m512i *av = (const __m512i *) a, *bv = (const __m512i *) b;
+    const __m512i *nv = (const __m512i *) n;
+    __m512i *t = (__m512i *) temp;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i inv = _mm512_set1_epi64((long long) ninv);
+    const __m512i mask = _mm512_set1_epi64((1LL << 52) - 1);
+
+    for (uint32_t j = 0; j < 2 * digits; j++) {
+        _mm512_store_si512(&t[j], zero);
+    }
+    for (uint32_t i = 0; i < digits; i++) {
+        __m512i *ti = &t[i];
+        __m512i bi = _mm512_load_si512(&bv[i]);
+
+        // m makes the lowest column divisible by 2^52; madd52lo only reads the low 52 bits of
+        // the column, which is all m depends on.
+        __m512i low = _mm512_madd52lo_epu64(_mm512_load_si512(&ti[0]), av[0], bi);
+        __m512i m = _mm512_madd52lo_epu64(zero, low, inv);
+        low = _mm512_madd52lo_epu64(low, nv[0], m);
+
+        // cur is column j + 1, finished with the low halves before it is stored
+        __m512i cur = _mm512_load_si512(&ti[1]);
+        cur = _mm512_add_epi64(cur, _mm512_srli_epi64(low, 52));
+        cur = _mm512_madd52hi_epu64(cur, av[0], bi);
+        cur = _mm512_madd52hi_epu64(cur, nv[0], m);
+        for (uint32_t j = 1; j < digits; j++) {
+            cur = _mm512_madd52lo_epu64(cur, av[j], bi);
+            cur = _mm512_madd52lo_epu64(cur, nv[j], m);
+            _mm512_store_si512(&ti[j], cur);
+            cur = _mm512_load_si512(&ti[j + 1]);
+            cur = _mm512_madd52hi_epu64(cur, av[j], bi);
+            cur = _mm512_madd52hi_epu64(cur, nv[j], m);
+        }
+        _mm512_store_si512(&ti[digits], cur);
+    }
+
+    // The result is t[digits..2 * digits - 1]; it is below 2n < R, so the last carry is zero.
+    __m512i carry = zero;
+    for (uint32_t j = 0; j < digits; j++) {
+        __m512i x = _mm512_add_epi64(_mm512_load_si512(&t[digits + j]), carry);
+        carry = _mm512_srli_epi64(x, 52);
+        _mm512_store_si512((__m512i *) &r[8 * j], _mm512_and_si512(x, mask));
+    }
+}
+
+static bool avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+//
+// 4 lanes of 26-bit digits with AVX2's 32x32 -> 64-bit multiplies. The products stay below
+// 2^52, so columns can take thousands of them before the 64-bit accumulators overflow.
+//
+__attribute__((target("avx2"))) static void mul_avx2(uint64_t *r, const uint64_t *a,
+    const uint64_t *b, const uint64_t *n, uint64_t ninv, uint32_t digits, uint64_t *temp) {
+    const __m256i *av = (const __m256i *) a, *bv = (const __m256i *) b;
+    const __m256i *nv = (const __m256i *) n;
+    __m256i *t = (__m256i *) temp;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i inv = _mm256_set1_epi64x((long long) ninv);
+    const __m256i mask = _mm256_set1_epi64x((1LL << 26) - 1);
+
+    for (uint32_t j = 0; j < 2 * digits; j++) {
+        _mm256_store_si256(&t[j], zero);
+    }
+    for (uint32_t i = 0; i < digits; i++) {
+        __m256i *ti = &t[i];
+        __m256i bi = _mm256_load_si256(&bv[i]);
+
+        __m256i low = _mm256_add_epi64(_mm256_load_si256(&ti[0]), _mm256_mul_epu32(av[0], bi));
+        __m256i m = _mm256_and_si256(_mm256_mul_epu32(low, inv), mask);
+        low = _mm256_add_epi64(low, _mm256_mul_epu32(nv[0], m));
+
+        __m256i cur = _mm256_add_epi64(_mm256_load_si256(&ti[1]), _mm256_srli_epi64(low, 26));
+        for (uint32_t j = 1; j < digits; j++) {
+            cur = _mm256_add_epi64(cur, _mm256_mul_epu32(av[j], bi));
+            cur = _mm256_add_epi64(cur, _mm256_mul_epu32(nv[j], m));
+            _mm256_store_si256(&ti[j], cur);
+            cur = _mm256_load_si256(&ti[j + 1]);
+        }
+        _mm256_store_si256(&ti[digits], cur);
+    }
+
+    __m256i carry = zero;
+    for (uint32_t j = 0; j < digits; j++) {
+        __m256i x = _mm256_add_epi64(_mm256_load_si256(&t[digits + j]), carry);
+        carry = _mm256_srli_epi64(x, 26);
+        _mm256_store_si256((__m256i *) &r[4 * j], _mm256_and_si256(x, mask));
+    }
+}
+
+#endif
+
+static bool scalar_supported(void) {
+    return true;
+}
+
+// fastest first, so the default selection takes the first supported automatic kernel
+static const montvec_kernel_t kernels[] = {
+#if MONTVEC_X86
+    { "ifma", 8, 52, 1000, true, ifma_supported, mul_ifma },
+    { "avx2", 4, 26, 2000, false, avx2_supported, mul_avx2 },
+#endif
+    { "scalar", 1, 0, 0, true, scalar_supported, NULL },
+};
+
+// the kernel new contexts use, picked on first use unless montvec_set_kernel() was called
+static const montvec_kernel_t *kernel = NULL;
+
+//switches new contexts to the named kernel, returns false if it is missing or unsupported
+bool montvec_set_kernel(const char *name) {
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported()) {
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+//returns the kernel new contexts are built with
+const montvec_kernel_t *montvec_kernel(void) {
+    for (size_t i = 0; kernel == NULL; i++) {
+        if (kernels[i].automatic && kernels[i].supported()) {
+            kernel = &kernels[i];
+        }
+    }
+    return kernel;
+}
+
+//returns the i-th compiled-in kernel, or NULL past the end
+const montvec_kernel_t *montvec_kernel_at(size_t i) {
+    return i < sizeof(kernels) / sizeof(kernels[0]) ? &kernels[i] : NULL;
+}
+
+// writes the low digits of the size limbs of x into one lane of the interleaved array out
+static void to_digits(uint64_t *out, uint32_t lane, const mp_limb_t *x, mp_size_t size,
+    const montvec_t *ctx) {
+    uint32_t radix = ctx->kernel->radix;
+    uint64_t mask = ((uint64_t) 1 << radix) - 1;
+    for (uint32_t i = 0; i < ctx->digits; i++) {
+        uint64_t bit = (uint64_t) i * radix;
+        mp_size_t word = bit / 64;
+        uint32_t shift = bit % 64;
+        uint64_t digit = 0;
+        if (word < size) {
+            digit = x[word] >> shift;
+            if (shift + radix > 64 && word + 1 < size) {
+                digit |= x[word + 1] << (64 - shift);
+            }
+        }
+        out[(uint64_t) i * ctx->lanes + lane] = digit & mask;
+    }
+}
+
+// gathers one lane of normalized digits back into size limbs
+static void from_digits(mp_limb_t *x, mp_size_t size, const uint64_t *in, uint32_t lane,
+    const montvec_t *ctx) {
+    uint32_t radix = ctx->kernel->radix;
+    memset(x, 0, size * sizeof(mp_limb_t));
+    for (uint32_t i = 0; i < ctx->digits; i++) {
+        uint64_t bit = (uint64_t) i * radix;
+        mp_size_t word = bit / 64;
+        uint32_t shift = bit % 64;
+        uint64_t digit = in[(uint64_t) i * ctx->lanes + lane];
+        if (word < size) {
+            x[word] |= digit << shift;
+        }
+        if (shift + radix > 64 && word + 1 < size) {
+            x[word + 1] |= digit >> (64 - shift);
+        }
+    }
+}
+
+// copies x into every lane of out
+static void broadcast(uint64_t *out, mpz_t x, const montvec_t *ctx) {
+    for (uint32_t lane = 0; lane < ctx->lanes; lane++) {
+        to_digits(out, lane, mpz_limbs_read(x), mpz_size(x), ctx);
+    }
+}
+
+// carves the digit arrays and limbs out of one aligned buffer, once lanes, digits, entries and
+// size are set
+static void allocate(montvec_t *ctx) {
+    // n, R^2, 1, the table, a^2 and the accumulator, then the kernel's 2 * digits of columns
+    uint64_t stride = (uint64_t) ctx->digits * ctx->lanes;
+    uint64_t words = (5 + ctx->entries) * stride + 2 * stride;
+    uint64_t bytes = words * sizeof(uint64_t) + ctx->size * sizeof(mp_limb_t);
+    bytes = (bytes + MONTVEC_ALIGN - 1) / MONTVEC_ALIGN * MONTVEC_ALIGN;
+    uint64_t *words_base = (uint64_t *) aligned_alloc(MONTVEC_ALIGN, bytes);
+    ctx->buffer = words_base;
+    ctx->n = words_base;
+    ctx->r2 = &ctx->n[stride];
+    ctx->one = &ctx->r2[stride];
+    ctx->square = &ctx->one[stride];
+    ctx->acc = &ctx->square[stride];
+    ctx->table = &ctx->acc[stride];
+    ctx->temp = &ctx->table[ctx->entries * stride];
+    ctx->limbs = (mp_limb_t *) &ctx->temp[2 * stride];
+}
+
+//
+// Builds a context for exponentiating with recoded exponents modulo n.
+// Falls back to the scalar kernel if n is too large for the current one.
+//
+// ctx: the context to initialize
+// n: odd modulus greater than 1
+// exp: recoded exponent, used to size the table of odd powers
+//
+void montvec_init(montvec_t *ctx, mpz_t n, mont_exp_t *exp) {
+    memset(ctx, 0, sizeof(montvec_t));
+    ctx->kernel = montvec_kernel();
+    ctx->lanes = 1;
+    if (ctx->kernel->mul == NULL) {
+        return;
+    }
+
+    // R must exceed 4n so that products of inputs below 2n reduce to below 2n again.
+    uint32_t radix = ctx->kernel->radix;
+    uint64_t digits = (mpz_sizeinbase(n, 2) + 2 + radix - 1) / radix;
+    if (digits > ctx->kernel->max_digits) {
+        ctx->kernel = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+        return;
+    }
+    ctx->lanes = ctx->kernel->lanes;
+    ctx->digits = digits;
+    ctx->entries = 1u << (exp->width - 1);
+    ctx->size = mpz_size(n);
+    allocate(ctx);
+    memcpy(ctx->limbs, mpz_limbs_read(n), ctx->size * sizeof(mp_limb_t));
+
+    // -n^-1 mod 2^radix by Newton's iteration, as in mont_set()
+    uint64_t inv = ctx->limbs[0];
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - ctx->limbs[0] * inv;
+    }
+    ctx->ninv = -inv & (((uint64_t) 1 << radix) - 1);
+
+    // The setup runs once per key, so plain mpz arithmetic is fine here.
+    mpz_t x;
+    mpz_init(x);
+    broadcast(ctx->n, n, ctx);
+    mpz_setbit(x, 2 * (mp_bitcnt_t) radix * ctx->digits);
+    mpz_mod(x, x, n);
+    broadcast(ctx->r2, x, ctx);
+    mpz_set_ui(x, 1);
+    broadcast(ctx->one, x, ctx);
+    mpz_clear(x);
+}
+
+//
+// Builds a context for the same modulus and kernel as another by copying its digits, skipping
+// the division montvec_init() needs. Falls back to montvec_init() if src was built with a kernel
+// other than the current one.
+//
+// ctx: the context to initialize
+// src: a context, a zero-filled one, or a view of one with only kernel, lanes, digits, size,
+//  limbs, ninv, n and r2 filled in
+// n: the modulus src was built for
+// exp: recoded exponent, used to size the table of odd powers
+//
+void montvec_init_copy(montvec_t *ctx, const montvec_t *src, mpz_t n, mont_exp_t *exp) {
+    if (src->kernel == NULL) {
+        memset(ctx, 0, sizeof(montvec_t));
+        return;
+    }
+    if (src->kernel != montvec_kernel()) {
+        montvec_init(ctx, n, exp);
+        return;
+    }
+    memset(ctx, 0, sizeof(montvec_t));
+    ctx->kernel = src->kernel;
+    ctx->lanes = src->lanes;
+    if (ctx->kernel->mul == NULL) {
+        return;
+    }
+    ctx->digits = src->digits;
+    ctx->entries = 1u << (exp->width - 1);
+    ctx->size = src->size;
+    ctx->ninv = src->ninv;
+    allocate(ctx);
+    uint64_t stride = (uint64_t) ctx->digits * ctx->lanes;
+    memcpy(ctx->limbs, src->limbs, ctx->size * sizeof(mp_limb_t));
+    memcpy(ctx->n, src->n, stride * sizeof(uint64_t));
+    memcpy(ctx->r2, src->r2, stride * sizeof(uint64_t));
+    for (uint64_t i = 0; i < stride; i++) {
+        ctx->one[i] = i < ctx->lanes;
+    }
+}
+
+//
+// Frees the memory used by a context.
+//
+// ctx: an initialized or zero-filled context
+//
+void montvec_clear(montvec_t *ctx) {
+    free(ctx->buffer);
+    memset(ctx, 0, sizeof(montvec_t));
+}
+
+// raises the lanes loaded into table[0] to e, leaving them in acc in Montgomery form
+static void powm_group(mont_exp_t *exp, montvec_t *ctx) {
+    uint64_t stride = (uint64_t) ctx->digits * ctx->lanes;
+    uint32_t digits = ctx->digits;
+    uint64_t *table = ctx->table, *square = ctx->square, *acc = ctx->acc;
+    void (*mul)(uint64_t *, const uint64_t *, const uint64_t *, const uint64_t *, uint64_t,
+        uint32_t, uint64_t *)
+        = ctx->kernel->mul;
+
+    // Same schedule as mont_powm_scratch(): every lane shares the exponent, so the lanes stay in
+    // lockstep and read the same table entry.
+    mul(table, table, ctx->r2, ctx->n, ctx->ninv, digits, ctx->temp);
+    uint64_t entries = (uint64_t) 1 << (exp->width - 1);
+    if (entries > 1) {
+        mul(square, table, table, ctx->n, ctx->ninv, digits, ctx->temp);
+        for (uint64_t i = 1; i < entries; i++) {
+            mul(&table[i * stride], &table[(i - 1) * stride], square, ctx->n, ctx->ninv, digits,
+                ctx->temp);
+        }
+    }
+
+    if (exp->count == 0) {
+        // R mod n, the Montgomery form of 1
+        mul(acc, ctx->r2, ctx->one, ctx->n, ctx->ninv, digits, ctx->temp);
+    } else {
+        memcpy(acc, &table[(exp->windows[0].digit >> 1) * stride], stride * sizeof(uint64_t));
+    }
+    for (uint64_t w = 1; w < exp->count; w++) {
+        for (uint32_t s = 0; s < exp->windows[w].shift; s++) {
+            mul(acc, acc, acc, ctx->n, ctx->ninv, digits, ctx->temp);
+        }
+        mul(acc, acc, &table[(exp->windows[w].digit >> 1) * stride], ctx->n, ctx->ninv, digits,
+            ctx->temp);
+    }
+    for (uint64_t s = 0; s < exp->tail && exp->count > 0; s++) {
+        mul(acc, acc, acc, ctx->n, ctx->ninv, digits, ctx->temp);
+    }
+
+    // Out of Montgomery form. The product with 1 is at most n, and equal to n only for 0.
+    mul(acc, acc, ctx->one, ctx->n, ctx->ninv, digits, ctx->temp);
+}
+
+//
+// Computes o[i] = a[i]^e mod n for count numbers, ctx->lanes of them at a time.
+// The results are identical to mont_powm_exp().
+//
+// o: results, each may alias the matching a
+// a: bases, any non-negative integers
+// count: number of bases
+// exp: the recoded exponent e, with a window width no larger than the one ctx was built for
+// ctx: context for n, built with a kernel other than the scalar fallback
+//
+void montvec_powm(mpz_t o[], mpz_t a[], uint64_t count, mont_exp_t *exp, montvec_t *ctx) {
+    mpz_t n;
+    mpz_roinit_n(n, ctx->limbs, ctx->size);
+
+    for (uint64_t first = 0; first < count; first += ctx->lanes) {
+        uint32_t used = count - first < ctx->lanes ? count - first : ctx->lanes;
+
+        // Unused lanes exponentiate 0 and are thrown away.
+        for (uint32_t lane = 0; lane < ctx->lanes; lane++) {
+            if (lane >= used) {
+                to_digits(ctx->table, lane, NULL, 0, ctx);
+            } else if (mpz_cmp(a[first + lane], n) >= 0) {
+                mpz_t reduced;
+                mpz_init(reduced);
+                mpz_mod(reduced, a[first + lane], n);
+                to_digits(ctx->table, lane, mpz_limbs_read(reduced), mpz_size(reduced), ctx);
+                mpz_clear(reduced);
+            } else {
+                mpz_ptr x = a[first + lane];
+                to_digits(ctx->table, lane, mpz_limbs_read(x), mpz_size(x), ctx);
+            }
+        }
+
+        powm_group(exp, ctx);
+
+        for (uint32_t lane = 0; lane < used; lane++) {
+            mp_limb_t *x = mpz_limbs_write(o[first + lane], ctx->size);
+            from_digits(x, ctx->size, ctx->acc, lane, ctx);
+            if (mpn_cmp(x, ctx->limbs, ctx->size) >= 0) {
+                mpn_sub_n(x, x, ctx->limbs, ctx->size);
+            }
+            mpz_limbs_finish(o[first + lane], ctx->size);
+        }
+    }
+}
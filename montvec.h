@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <gmp.h>
+
+#include "mont.h"
+
+// most numbers any kernel exponentiates side by side
+#define MONTVEC_LANES 8
+
+//
+// One multi-buffer Montgomery multiplication kernel.
+// Numbers are split into radix-bit digits and stored lane-interleaved: digit i of lane l is at
+// x[i * lanes + l], so one vector register holds the same digit of every number in a group.
+//
+typedef struct {
+    const char *name;
+    uint32_t lanes; // numbers multiplied at once, 1 for the scalar fallback
+    uint32_t radix; // bits per digit
+    uint32_t max_digits; // largest number of digits the accumulators can take without overflow
+    bool automatic; // picked by the default selection when the CPU supports it
+    bool (*supported)(void);
+
+    //
+    // r = a * b / R mod n in every lane, where R = 2^(radix * digits).
+    // Inputs below 2n give a result below 2n; r may alias a or b. NULL for the scalar fallback,
+    // whose callers use mont_powm_scratch() instead.
+    //
+    void (*mul)(uint64_t *r, const uint64_t *a, const uint64_t *b, const uint64_t *n,
+        uint64_t ninv, uint32_t digits, uint64_t *temp);
+} montvec_kernel_t;
+
+//
+// Multi-buffer exponentiation context for one odd modulus and window width.
+// Holds the modulus in digit form and scratch for one group of lanes, so montvec_powm() makes
+// no heap allocations. Not safe to share between threads; give each thread its own.
+// A zero-filled context holds no buffers yet and can be passed to montvec_clear().
+//
+typedef struct {
+    const montvec_kernel_t *kernel; // chosen when the context was built
+    uint32_t lanes; // numbers per group
+    uint32_t digits; // digits per number, with R = 2^(radix * digits) > 4n
+    uint32_t entries; // odd powers kept per number
+    mp_size_t size; // limbs in n
+    mp_limb_t *limbs; // n as limbs, for the final reduction
+    uint64_t ninv; // -n^-1 mod 2^radix
+    uint64_t *n; // modulus digits, the same in every lane
+    uint64_t *r2; // R^2 mod n, converts into Montgomery form
+    uint64_t *one; // 1, converts out of Montgomery form
+    uint64_t *table; // odd powers a^1, a^3, ... of every lane
+    uint64_t *square, *acc; // a^2 and the running result of every lane
+    uint64_t *temp; // 2 * digits of accumulators for the kernel
+    void *buffer; // one aligned allocation behind all of the digit arrays
+} montvec_t;
+
+//
+// Switches to the named kernel ("ifma", "avx2" or "scalar") for contexts built afterwards.
+// Returns false if there is no such kernel or the CPU cannot run it.
+// The default is the fastest supported kernel. Switch before starting any threads.
+//
+bool montvec_set_kernel(const char *name);
+
+//
+// Returns the kernel new contexts are built with.
+//
+const montvec_kernel_t *montvec_kernel(void);
+
+//
+// Returns the i-th kernel compiled in, or NULL past the end.
+//
+const montvec_kernel_t *montvec_kernel_at(size_t i);
+
+//
+// Builds a context for exponentiating with recoded exponents modulo n.
+// Falls back to the scalar kernel if n is too large for the current one.
+//
+// ctx: the context to initialize
+// n: odd modulus greater than 1
+// exp: recoded exponent, used to size the table of odd powers
+//
+void montvec_init(montvec_t *ctx, mpz_t n, mont_exp_t *exp);
+
+//
+// Builds a context for the same modulus and kernel as another by copying its digits, skipping
+// the division montvec_init() needs. Falls back to montvec_init() if src was built with a kernel
+// other than the current one.
+//
+// ctx: the context to initialize
+// src: a context, a zero-filled one, or a view of one with only kernel, lanes, digits, size,
+//  limbs, ninv, n and r2 filled in
+// n: the modulus src was built for
+// exp: recoded exponent, used to size the table of odd powers
+//
+void montvec_init_copy(montvec_t *ctx, const montvec_t *src, mpz_t n, mont_exp_t *exp);
+
+//
+// Frees the memory used by a context.
+//
+// ctx: an initialized or zero-filled context
+//
+void montvec_clear(montvec_t *ctx);
+
+//
+// Computes o[i] = a[i]^e mod n for count numbers, ctx->lanes of them at a time.
+// The results are identical to mont_powm_exp().
+//
+// o: results, each may alias the matching a
+// a: bases, any non-negative integers
+// count: number of bases
+// exp: the recoded exponent e, with a window width no larger than the one ctx was built for
+// ctx: context for n, built with a kernel other than the scalar fallback
+//
+void montvec_powm(mpz_t o[], mpz_t a[], uint64_t count, mont_exp_t *exp, montvec_t *ctx);
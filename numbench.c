@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h> //atof
+#include <string.h>
+#include <unistd.h> //getopt().
+#include <time.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "randstate.h"
+
+#define OPTIONS "b:B:m:i:s:h"
+
+// most operand sizes or backends accepted in one list
+#define MAX_LIST 16
+
+// operands shared by every operation at one size
+typedef struct {
+    mpz_t a, b, n, d, prime, out;
+    uint64_t iters;
+    numtheory_ctx_t ctx; // reused across calls, as in the key generation loops
+} operands_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_gcd(operands_t *ops) {
+    gcd_ctx(ops->out, ops->a, ops->b, &ops->ctx);
+}
+
+static void run_mod_inverse(operands_t *ops) {
+    mod_inverse_ctx(ops->out, ops->a, ops->n, &ops->ctx);
+}
+
+static void run_pow_mod(operands_t *ops) {
+    pow_mod_ctx(ops->out, ops->a, ops->d, ops->n, &ops->ctx);
+}
+
+static void run_is_prime(operands_t *ops) {
+    // a prime input runs every Miller-Rabin round, the worst case
+    is_prime_ctx(ops->prime, ops->iters, state, &ops->ctx);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(operands_t *ops);
+} operation_t;
+
+static const operation_t operations[] = {
+    { "gcd", run_gcd },
+    { "mod_inverse", run_mod_inverse },
+    { "pow_mod", run_pow_mod },
+    { "is_prime", run_is_prime },
+};
+
+int main(int argc, char **argv) {
+    int opt = 0;
+
+    char default_bits[] = "256,512,1024,2048,4096";
+    char *bits_text = default_bits;
+    char *backends_text = NULL;
+    double target = 0.2;
+    uint64_t iters = 20;
+    uint32_t seed = 2023;
+
+    // help_message
+    const char *help_message
+        = "SYNOPSIS\n"
+          "   Times each numtheory primitive per operand size and backend.\n"
+          "   Results are printed to stdout as CSV.\n"
+          "\n"
+          "USAGE\n"
+          "   ./numbench [OPTIONS]\n"
+          "\n"
+          "OPTIONS\n"
+          "   -h              Display program help and usage.\n"
+          "   -b bits         Comma-separated operand sizes (default: 256,512,1024,2048,4096).\n"
+          "   -B backends     Comma-separated backends (default: all of them).\n"
+          "   -m ms           Milliseconds spent timing each measurement (default: 200).\n"
+          "   -i iterations   Miller-Rabin iterations for is_prime (default: 20).\n"
+          "   -s seed         Random seed (default: 2023).\n";
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'b': bits_text = optarg; break;
+        case 'B': backends_text = optarg; break;
+        case 'm': target = atof(optarg) / 1000; break;
+        case 'i': iters = strtoull(optarg, NULL, 10); break;
+        case 's': seed = atoi(optarg); break;
+        case 'h': printf("%s", help_message); return 1;
+        default:
+            fprintf(stderr, "Usage: %s [-b bits] [-B backends] [-m ms] [-i iterations] [-s seed] [-h]\n",
+                argv[0]);
+            exit(1);
+        }
+    }
+
+    uint64_t bit_list[MAX_LIST];
+    int bit_count = 0;
+    for (char *item = strtok(bits_text, ","); item != NULL && bit_count < MAX_LIST;
+         item = strtok(NULL, ",")) {
+        bit_list[bit_count++] = strtoull(item, NULL, 10);
+    }
+
+    const numtheory_backend_t *backend_list[MAX_LIST];
+    int backend_count = 0;
+    if (backends_text == NULL) {
+        for (size_t i = 0; numtheory_backend_at(i) != NULL && backend_count < MAX_LIST; i++) {
+            backend_list[backend_count++] = numtheory_backend_at(i);
+        }
+    } else {
+        for (char *item = strtok(backends_text, ","); item != NULL && backend_count < MAX_LIST;
+             item = strtok(NULL, ",")) {
+            if (!numtheory_set_backend(item)) {
+                fprintf(stderr, "Error: unknown backend -- '%s'\n", item);
+                exit(1);
+            }
+            backend_list[backend_count++] = numtheory_backend();
+        }
+    }
+
+    randstate_init(seed);
+
+    operands_t ops;
+    mpz_inits(ops.a, ops.b, ops.n, ops.d, ops.prime, ops.out, NULL);
+    ops.iters = iters;
+    numtheory_ctx_init(&ops.ctx);
+
+    printf("backend,operation,bits,calls,ns_per_call\n");
+    for (int b = 0; b < bit_count; b++) {
+        // Same operands for every backend, so the rows are comparable.
+        uint64_t bits = bit_list[b];
+        mpz_urandomb(ops.a, state, bits);
+        mpz_urandomb(ops.b, state, bits);
+        mpz_urandomb(ops.n, state, bits);
+        mpz_urandomb(ops.d, state, bits);
+        mpz_setbit(ops.n, bits - 1);
+        mpz_setbit(ops.n, 0);
+        numtheory_set_backend("native");
+        make_prime(ops.prime, bits - 1, iters);
+
+        for (int k = 0; k < backend_count; k++) {
+            numtheory_set_backend(backend_list[k]->name);
+            for (size_t o = 0; o < sizeof(operations) / sizeof(operations[0]); o++) {
+                // Warm up once, then run until the time budget is spent.
+                operations[o].run(&ops);
+                uint64_t calls = 0;
+                double start = now(), elapsed = 0;
+                while (elapsed < target) {
+                    operations[o].run(&ops);
+                    calls += 1;
+                    elapsed = now() - start;
+                }
+                printf("%s,%s,%lu,%lu,%.1f\n", backend_list[k]->name, operations[o].name,
+                    (unsigned long) bits, (unsigned long) calls, elapsed * 1e9 / calls);
+                fflush(stdout);
+            }
+        }
+    }
+
+    numtheory_ctx_clear(&ops.ctx);
+    mpz_clears(ops.a, ops.b, ops.n, ops.d, ops.prime, ops.out, NULL);
+    randstate_clear();
+}
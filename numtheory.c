@@ -7,17 +7,57 @@
 
 #include "numtheory.h"
 #include "randstate.h"
+#include "mont.h"
+#include "stats.h"
 
 //for testing
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+//--------------------------------------scratch-------------------------------------
+//sets up an empty context; nothing is allocated until the primitives need room
+void numtheory_ctx_init(numtheory_ctx_t *ctx) {
+    for (int i = 0; i < NUMTHEORY_TEMPS; i++) {
+        mpz_init(ctx->t[i]);
+    }
+    memset(&ctx->mont, 0, sizeof(ctx->mont));
+    memset(&ctx->exp, 0, sizeof(ctx->exp));
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+}
+
+//frees everything the context has grown
+void numtheory_ctx_clear(numtheory_ctx_t *ctx) {
+    for (int i = 0; i < NUMTHEORY_TEMPS; i++) {
+        mpz_clear(ctx->t[i]);
+    }
+    mont_clear(&ctx->mont);
+    mont_exp_clear(&ctx->exp);
+    free(ctx->scratch);
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+}
+
+//o = a^d mod n on the context's Montgomery buffers, for odd n > 1
+static void ctx_mont_powm(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx) {
+    mont_set(&ctx->mont, n);
+    mont_exp_set(&ctx->exp, d);
+    mp_size_t size = mont_scratch_limbs(&ctx->mont, &ctx->exp);
+    if (size > ctx->scratch_size) {
+        free(ctx->scratch);
+        ctx->scratch = (mp_limb_t *) malloc(size * sizeof(mp_limb_t));
+        ctx->scratch_size = size;
+    }
+    mont_powm_scratch(o, a, &ctx->exp, &ctx->mont, ctx->scratch);
+}
 
 //-----------------------------------------gcd--------------------------------------
 //mpz version gcd
-void gcd(mpz_t g, mpz_t a, mpz_t b) {
-    // declare
-    mpz_t temp, copy_a, copy_b;
-    // initialize
-    mpz_inits(temp, copy_a, copy_b, NULL);
+static void gcd_native(mpz_t g, mpz_t a, mpz_t b, numtheory_ctx_t *ctx) {
+    // temporaries live in the context
+    mpz_ptr temp = ctx->t[0], copy_a = ctx->t[1], copy_b = ctx->t[2];
     // copy over
     mpz_set(copy_a, a);
     mpz_set(copy_b, b);
@@ -33,7 +73,6 @@ void gcd(mpz_t g, mpz_t a, mpz_t b) {
     }
     // dont return a; sort it in d instead
     mpz_set(g, copy_a);
-    mpz_clears(temp, copy_a, copy_b, NULL);
 }
 
 //regular version gcd
@@ -49,11 +88,11 @@ void gcd(mpz_t g, mpz_t a, mpz_t b) {
 
 //----------------------------------------mod_inverse-------------------------------
 //mpz version mod_inverse
-void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
+static void mod_inverse_native(mpz_t o, mpz_t a, mpz_t n, numtheory_ctx_t *ctx) {
     // int r = n, r0 = a, t = 0, t0 = 1, q;
-    mpz_t r, r1, t, t1, q, q_value, current_r, current_r1, q_times_r1, current_t, q_times_t1;
-    mpz_inits(
-        r, r1, t, t1, q, q_value, current_r, current_r1, q_times_r1, current_t, q_times_t1, NULL);
+    mpz_ptr r = ctx->t[0], r1 = ctx->t[1], t = ctx->t[2], t1 = ctx->t[3], q = ctx->t[4],
+            q_value = ctx->t[5], current_r = ctx->t[6], current_r1 = ctx->t[7],
+            q_times_r1 = ctx->t[8], current_t = ctx->t[9], q_times_t1 = ctx->t[10];
 
     mpz_set(r, n);
     mpz_set(r1, a);
@@ -95,9 +134,6 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
     } else {
         mpz_set(o, t);
     }
-
-    mpz_clears(
-        r, r1, t, t1, q, q_value, current_r, current_r1, q_times_r1, current_t, q_times_t1, NULL);
 }
 
 //regular version mod_inverse
@@ -121,9 +157,9 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
 
 //----------------------------------------pow_mod-----------------------------------
 //mpz version pow_mod
-void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
-    mpz_t v, p, copy_d, v_times_p, p_times_p, d_over_2;
-    mpz_inits(v, p, copy_d, v_times_p, p_times_p, d_over_2, NULL);
+static void pow_mod_native(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx) {
+    mpz_ptr v = ctx->t[0], p = ctx->t[1], copy_d = ctx->t[2], v_times_p = ctx->t[3],
+            p_times_p = ctx->t[4], d_over_2 = ctx->t[5];
 
     // int v = 1;
     mpz_set_ui(v, 1);
@@ -145,7 +181,6 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
         mpz_set(copy_d, d_over_2);
     }
     mpz_set(o, v);
-    mpz_clears(v, p, copy_d, v_times_p, p_times_p, d_over_2, NULL);
 }
 
 //regular version pow_mod
@@ -163,8 +198,10 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
 // }
 
 //----------------------------------------is_prime----------------------------------
-//mpz version is_prime
-bool is_prime(mpz_t n, uint64_t iters) {
+//mpz version is_prime, drawing its witnesses from the given random state and raising them with
+//the given pow_mod, which may use ctx->t[0] to ctx->t[5] but must leave the rest alone
+static bool miller_rabin(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx,
+    void (*pow_mod)(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx)) {
     //check extrem condition where If n is even or less than 2, it is not prime
     if (mpz_cmp_ui(n, 2) == 0) {
         return true;
@@ -178,8 +215,8 @@ bool is_prime(mpz_t n, uint64_t iters) {
         return false;
     }
 
-    mpz_t rand_num, n_minus_1, copy_n_minus_1, n_minus_3, y, ui_2;
-    mpz_inits(rand_num, n_minus_1, copy_n_minus_1, n_minus_3, y, ui_2, NULL);
+    mpz_ptr rand_num = ctx->t[6], n_minus_1 = ctx->t[7], copy_n_minus_1 = ctx->t[8],
+            n_minus_3 = ctx->t[9], y = ctx->t[10], ui_2 = ctx->t[11];
 
     //r = n - 1;
     mpz_sub_ui(n_minus_1, n, 1);
@@ -201,32 +238,36 @@ bool is_prime(mpz_t n, uint64_t iters) {
 
     for (uint64_t i = 0; i < iters; i++) {
         //rand num from 0 to n - 4
-        mpz_urandomm(rand_num, state, n_minus_3);
+        mpz_urandomm(rand_num, rng, n_minus_3);
         //add to so that rand num is from 2 to n -2
         mpz_add_ui(rand_num, rand_num, 2);
+        STATS_ADD(STATS_ROUNDS, 1);
 
-        pow_mod(y, rand_num, copy_n_minus_1, n);
+        pow_mod(y, rand_num, copy_n_minus_1, n, ctx);
 
         if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_1) != 0) {
             j = 1;
             while (j <= (s - 1) && mpz_cmp(y, n_minus_1) != 0) {
-                pow_mod(y, y, ui_2, n);
+                //y = y^2 mod n
+                mpz_mul(y, y, y);
+                mpz_mod(y, y, n);
                 if (mpz_cmp_ui(y, 1) == 0) {
-                    mpz_clears(rand_num, n_minus_1, copy_n_minus_1, n_minus_3, y, ui_2, NULL);
                     return false;
                 }
                 j += 1;
             }
             if (mpz_cmp(y, n_minus_1) != 0) {
-                mpz_clears(rand_num, n_minus_1, copy_n_minus_1, n_minus_3, y, ui_2, NULL);
                 return false;
             }
         }
     }
-    mpz_clears(rand_num, n_minus_1, copy_n_minus_1, n_minus_3, y, ui_2, NULL);
     return true;
 }
 
+static bool is_prime_native(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx) {
+    return miller_rabin(n, iters, rng, ctx, pow_mod_native);
+}
+
 // regular version is_prime
 // int r_is_prime(int n, int k) {
 //     // If n is even or less than 2, it is not prime
@@ -262,21 +303,336 @@ bool is_prime(mpz_t n, uint64_t iters) {
 //     return 1;
 // }
 
+//----------------------------------------backends----------------------------------
+//GMP's own implementations of the same primitives
+
+static void gcd_gmp(mpz_t g, mpz_t a, mpz_t b, numtheory_ctx_t *ctx) {
+    (void) ctx;
+    mpz_gcd(g, a, b);
+}
+
+static void mod_inverse_gmp(mpz_t o, mpz_t a, mpz_t n, numtheory_ctx_t *ctx) {
+    (void) ctx;
+    //same convention as the native version: 0 when there is no inverse
+    if (mpz_invert(o, a, n) == 0) {
+        mpz_set_ui(o, 0);
+    }
+}
+
+static void pow_mod_gmp(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx) {
+    (void) ctx;
+    mpz_powm(o, a, d, n);
+}
+
+static bool is_prime_gmp(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx) {
+    (void) rng;
+    (void) ctx;
+    return mpz_probab_prime_p(n, iters) > 0;
+}
+
+//the Montgomery engine from mont.c; it needs an odd modulus, so even ones fall back
+static void pow_mod_mont(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx) {
+    if (mpz_odd_p(n) == 0 || mpz_cmp_ui(n, 1) <= 0) {
+        pow_mod_native(o, a, d, n, ctx);
+        return;
+    }
+    ctx_mont_powm(o, a, d, n, ctx);
+}
+
+//n is odd by the time miller_rabin() raises a witness, so the engine applies directly
+static bool is_prime_mont(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx) {
+    return miller_rabin(n, iters, rng, ctx, ctx_mont_powm);
+}
+
+static const numtheory_backend_t backends[] = {
+    { "native", gcd_native, mod_inverse_native, pow_mod_native, is_prime_native },
+    { "gmp", gcd_gmp, mod_inverse_gmp, pow_mod_gmp, is_prime_gmp },
+    { "mont", gcd_native, mod_inverse_native, pow_mod_mont, is_prime_mont },
+};
+
+#ifndef NUMTHEORY_BACKEND
+#define NUMTHEORY_BACKEND 0
+#endif
+
+//the backend every public function dispatches to, chosen at compile time by default
+static const numtheory_backend_t *backend = &backends[NUMTHEORY_BACKEND];
+
+//switches all numtheory functions to the named backend, returns false if there is none
+bool numtheory_set_backend(const char *name) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            backend = &backends[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+//returns the backend currently in use
+const numtheory_backend_t *numtheory_backend(void) {
+    return backend;
+}
+
+//returns the i-th available backend, or NULL past the end
+const numtheory_backend_t *numtheory_backend_at(size_t i) {
+    return i < sizeof(backends) / sizeof(backends[0]) ? &backends[i] : NULL;
+}
+
+//the plain versions set up a context just for the one call
+void gcd(mpz_t g, mpz_t a, mpz_t b) {
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    backend->gcd(g, a, b, &ctx);
+    numtheory_ctx_clear(&ctx);
+}
+
+void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    backend->mod_inverse(o, a, n, &ctx);
+    numtheory_ctx_clear(&ctx);
+}
+
+void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    backend->pow_mod(o, a, d, n, &ctx);
+    numtheory_ctx_clear(&ctx);
+}
+
+bool is_prime(mpz_t n, uint64_t iters) {
+    return is_prime_r(n, iters, state);
+}
+
+//is_prime drawing its witnesses from the given random state instead of the global one
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rng) {
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    bool prime = backend->is_prime(n, iters, rng, &ctx);
+    numtheory_ctx_clear(&ctx);
+    return prime;
+}
+
+void gcd_ctx(mpz_t g, mpz_t a, mpz_t b, numtheory_ctx_t *ctx) {
+    backend->gcd(g, a, b, ctx);
+}
+
+void mod_inverse_ctx(mpz_t o, mpz_t a, mpz_t n, numtheory_ctx_t *ctx) {
+    backend->mod_inverse(o, a, n, ctx);
+}
+
+void pow_mod_ctx(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx) {
+    backend->pow_mod(o, a, d, n, ctx);
+}
+
+bool is_prime_ctx(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx) {
+    STATS_START(start);
+    bool prime = backend->is_prime(n, iters, rng, ctx);
+    STATS_STOP(STATS_IS_PRIME, start);
+    return prime;
+}
+
+//------------------------------------small primes----------------------------------
+//the first SMALL_PRIMES primes, plus their products grouped so each fits in an unsigned long
+static unsigned long small_primes[SMALL_PRIMES];
+static unsigned long group_products[SMALL_PRIMES];
+static uint32_t group_ends[SMALL_PRIMES];
+static uint32_t groups = 0;
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+static atomic_uint_fast64_t stat_candidates, stat_sieved, stat_tested;
+
+//sieve of Eratosthenes, run once on first use
+static void small_primes_init(void) {
+    //the 2048th prime is 17863
+    uint32_t limit = 17864;
+    bool *composite = (bool *) calloc(limit, sizeof(bool));
+    uint32_t count = 0;
+    for (uint32_t i = 2; i < limit && count < SMALL_PRIMES; i++) {
+        if (composite[i]) {
+            continue;
+        }
+        small_primes[count++] = i;
+        for (uint32_t j = i * i; j < limit; j += i) {
+            composite[j] = true;
+        }
+    }
+    free(composite);
+
+    //pack consecutive primes into products below 2^64 so one mpz_fdiv_ui covers several
+    unsigned long product = 1;
+    for (uint32_t i = 0; i < SMALL_PRIMES; i++) {
+        if (product > (unsigned long) -1 / small_primes[i]) {
+            group_products[groups] = product;
+            group_ends[groups++] = i;
+            product = 1;
+        }
+        product *= small_primes[i];
+    }
+    group_products[groups] = product;
+    group_ends[groups++] = SMALL_PRIMES;
+}
+
+//returns false if n is divisible by one of the small primes (and is not that prime)
+bool small_prime_sieve(mpz_t n) {
+    pthread_once(&small_primes_once, small_primes_init);
+
+    //small enough to be in the table itself: leave it to is_prime
+    if (mpz_cmp_ui(n, small_primes[SMALL_PRIMES - 1]) <= 0) {
+        return true;
+    }
+    uint32_t start = 0;
+    for (uint32_t g = 0; g < groups; g++) {
+        //residue of n by the group product, then by each prime in the group
+        unsigned long residue = mpz_fdiv_ui(n, group_products[g]);
+        for (uint32_t i = start; i < group_ends[g]; i++) {
+            if (residue % small_primes[i] == 0) {
+                return false;
+            }
+        }
+        start = group_ends[g];
+    }
+    return true;
+}
+
+//copies out the make_prime() counters
+void prime_stats(prime_stats_t *stats) {
+    stats->candidates = atomic_load(&stat_candidates);
+    stats->sieved = atomic_load(&stat_sieved);
+    stats->tested = atomic_load(&stat_tested);
+}
+
 //------------------------------------make_prime------------------------------------
 //mpz version make_prime
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
+    make_prime_r(p, bits, iters, state);
+}
+
+//make_prime drawing from the given random state instead of the global one
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rng) {
     // mpz_urandomb(p, state, bits);
     // && mpz_sizeinbase(p, 2) < bits
+    //one context for every candidate of the search
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    STATS_START(start);
     bool checker = false;
     while (checker == false) {
-        //generate a random number from 0 to 2^bits - 1
-        mpz_urandomb(p, state, bits + 1);
-        //check the number of bits of the random number
-        //if is less than the number of bits
-        if (mpz_sizeinbase(p, 2) < bits + 1) {
-            //go back and retart
-            continue;
+        checker = prime_candidate_r(p, bits, iters, rng, &ctx);
+    }
+    STATS_STOP(STATS_MAKE_PRIME, start);
+    numtheory_ctx_clear(&ctx);
+}
+
+//draws one random candidate into p and returns true if it is a prime of bits + 1 bits
+bool prime_candidate_r(
+    mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx) {
+    //generate a random number from 0 to 2^bits - 1
+    mpz_urandomb(p, rng, bits + 1);
+    //check the number of bits of the random number
+    //if is less than the number of bits
+    if (mpz_sizeinbase(p, 2) < bits + 1) {
+        //go back and retart
+        return false;
+    }
+    atomic_fetch_add(&stat_candidates, 1);
+    STATS_ADD(STATS_CANDIDATES, 1);
+    //cheap trial division rules out most composites before any pow_mod
+    if (!small_prime_sieve(p)) {
+        atomic_fetch_add(&stat_sieved, 1);
+        return false;
+    }
+    atomic_fetch_add(&stat_tested, 1);
+    return is_prime_ctx(p, iters, rng, ctx);
+}
+
+//-------------------------------make_prime_search----------------------------------
+//incremental version of make_prime: one random odd start, then sieve an interval ahead of it
+void make_prime_search(mpz_t p, uint64_t bits, uint64_t iters, uint64_t interval) {
+    make_prime_search_r(p, bits, iters, interval, state);
+}
+
+//make_prime_search drawing from the given random state instead of the global one
+void make_prime_search_r(
+    mpz_t p, uint64_t bits, uint64_t iters, uint64_t interval, gmp_randstate_t rng) {
+    pthread_once(&small_primes_once, small_primes_init);
+
+    //too small to sieve safely, since a candidate could be one of the small primes itself
+    if (bits + 1 < 16 || interval < 2) {
+        make_prime_r(p, bits, iters, rng);
+        return;
+    }
+
+    //only odd offsets are kept: slot i stands for start + 2i
+    uint64_t slots = interval / 2;
+    uint8_t *marks = (uint8_t *) malloc((slots + 7) / 8);
+    unsigned long *residues = (unsigned long *) malloc(SMALL_PRIMES * sizeof(unsigned long));
+
+    mpz_t start, limit;
+    mpz_inits(start, limit, NULL);
+    numtheory_ctx_t ctx;
+    numtheory_ctx_init(&ctx);
+    //every candidate must stay below 2^(bits + 1), like make_prime
+    mpz_setbit(limit, bits + 1);
+
+    //one random odd starting point with the top bit forced
+    mpz_urandomb(start, rng, bits + 1);
+    mpz_setbit(start, bits);
+    mpz_setbit(start, 0);
+
+    STATS_START(search);
+    bool found = false;
+    while (!found) {
+        //start mod each small prime, a group product at a time
+        uint32_t first = 0;
+        for (uint32_t g = 0; g < groups; g++) {
+            unsigned long residue = mpz_fdiv_ui(start, group_products[g]);
+            for (uint32_t i = first; i < group_ends[g]; i++) {
+                residues[i] = residue % small_primes[i];
+            }
+            first = group_ends[g];
+        }
+
+        //mark every slot i with start + 2i = 0 (mod prime), i.e. i = -r / 2 (mod prime)
+        memset(marks, 0, (slots + 7) / 8);
+        for (uint32_t i = 1; i < SMALL_PRIMES; i++) {
+            unsigned long prime = small_primes[i];
+            uint64_t slot = ((prime - residues[i]) % prime) * ((prime + 1) / 2) % prime;
+            for (; slot < slots; slot += prime) {
+                marks[slot / 8] |= 1 << (slot % 8);
+            }
+        }
+
+        //only the survivors get a Miller-Rabin test
+        for (uint64_t i = 0; i < slots && !found; i++) {
+            atomic_fetch_add(&stat_candidates, 1);
+            STATS_ADD(STATS_CANDIDATES, 1);
+            if (marks[i / 8] & (1 << (i % 8))) {
+                atomic_fetch_add(&stat_sieved, 1);
+                continue;
+            }
+            mpz_add_ui(p, start, 2 * i);
+            if (mpz_cmp(p, limit) >= 0) {
+                break;
+            }
+            atomic_fetch_add(&stat_tested, 1);
+            found = is_prime_ctx(p, iters, rng, &ctx);
+        }
+
+        if (!found) {
+            //move on to the next interval, or start over if it would grow past bits + 1 bits
+            mpz_add_ui(start, start, 2 * slots);
+            if (mpz_cmp(start, limit) >= 0) {
+                mpz_urandomb(start, rng, bits + 1);
+                mpz_setbit(start, bits);
+                mpz_setbit(start, 0);
+            }
         }
-        checker = is_prime(p, iters);
     }
+    STATS_STOP(STATS_MAKE_PRIME, search);
+
+    numtheory_ctx_clear(&ctx);
+    mpz_clears(start, limit, NULL);
+    free(residues);
+    free(marks);
 }
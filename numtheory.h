@@ -1,10 +1,61 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
 
+#include "mont.h"
+
+// number of small primes used to sieve candidates in make_prime()
+#define SMALL_PRIMES 2048
+
+// counters for make_prime() across all calls, reported by keygen -v
+typedef struct {
+    uint64_t candidates; // random candidates of the right size
+    uint64_t sieved; // rejected by trial division with the small primes
+    uint64_t tested; // sent to is_prime()
+} prime_stats_t;
+
+// number of mpz temporaries in a numtheory_ctx_t, enough for the hungriest primitive
+#define NUMTHEORY_TEMPS 12
+
+// scratch for the numtheory primitives, so loops that call them repeatedly stop allocating.
+// Buffers grow to the largest operands seen and are kept until numtheory_ctx_clear().
+// One context per thread.
+typedef struct {
+    mpz_t t[NUMTHEORY_TEMPS];
+    mont_t mont; // Montgomery context for the last modulus
+    mont_exp_t exp; // recoding of the last exponent
+    mp_limb_t *scratch; // limbs for mont_powm_scratch()
+    mp_size_t scratch_size;
+} numtheory_ctx_t;
+
+// one implementation of the numtheory primitives; all public functions dispatch through one
+typedef struct {
+    const char *name;
+    void (*gcd)(mpz_t g, mpz_t a, mpz_t b, numtheory_ctx_t *ctx);
+    void (*mod_inverse)(mpz_t o, mpz_t a, mpz_t n, numtheory_ctx_t *ctx);
+    void (*pow_mod)(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx);
+    bool (*is_prime)(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx);
+} numtheory_backend_t;
+
+void numtheory_ctx_init(numtheory_ctx_t *ctx);
+
+void numtheory_ctx_clear(numtheory_ctx_t *ctx);
+
+// backends: "native" (the loops in numtheory.c, is_prime raising its witnesses with the native
+// pow_mod), "gmp" (mpz_gcd, mpz_invert, mpz_powm, mpz_probab_prime_p) and "mont" (native, with
+// pow_mod and is_prime's witnesses on the Montgomery engine).
+// The default is picked at compile time with -DNUMTHEORY_BACKEND=<index>, 0 for native.
+// Switch before starting any threads.
+bool numtheory_set_backend(const char *name);
+
+const numtheory_backend_t *numtheory_backend(void);
+
+const numtheory_backend_t *numtheory_backend_at(size_t i);
+
 void gcd(mpz_t g, mpz_t a, mpz_t b);
 
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
@@ -13,4 +64,29 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rng);
+
+// the same primitives reusing the scratch in ctx
+void gcd_ctx(mpz_t g, mpz_t a, mpz_t b, numtheory_ctx_t *ctx);
+
+void mod_inverse_ctx(mpz_t o, mpz_t a, mpz_t n, numtheory_ctx_t *ctx);
+
+void pow_mod_ctx(mpz_t o, mpz_t a, mpz_t d, mpz_t n, numtheory_ctx_t *ctx);
+
+bool is_prime_ctx(mpz_t n, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rng);
+
+bool prime_candidate_r(
+    mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rng, numtheory_ctx_t *ctx);
+
+void make_prime_search(mpz_t p, uint64_t bits, uint64_t iters, uint64_t interval);
+
+void make_prime_search_r(
+    mpz_t p, uint64_t bits, uint64_t iters, uint64_t interval, gmp_randstate_t rng);
+
+bool small_prime_sieve(mpz_t n);
+
+void prime_stats(prime_stats_t *stats);
@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "pipeline.h"
+
+//
+// Bounded single-producer, single-consumer ring of slot numbers.
+// Pushing and popping never take a lock; the semaphore only lets an empty consumer sleep
+// instead of spinning. Every ring is sized for all the slots, so a push never finds it full.
+//
+typedef struct {
+    uint32_t *items;
+    uint32_t mask; // capacity - 1, capacity a power of two
+    atomic_uint_fast64_t head; // next item to pop, only moved by the consumer
+    atomic_uint_fast64_t tail; // next free position, only moved by the producer
+    sem_t ready; // counts items pushed but not yet popped
+} ring_t;
+
+static void ring_init(ring_t *ring, uint32_t slots) {
+    uint32_t capacity = 1;
+    while (capacity < slots) {
+        capacity *= 2;
+    }
+    ring->items = (uint32_t *) malloc(capacity * sizeof(uint32_t));
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    sem_init(&ring->ready, 0, 0);
+}
+
+static void ring_clear(ring_t *ring) {
+    sem_destroy(&ring->ready);
+    free(ring->items);
+}
+
+static void ring_push(ring_t *ring, uint32_t item) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->items[tail & ring->mask] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    sem_post(&ring->ready);
+}
+
+static uint32_t ring_pop(ring_t *ring) {
+    while (sem_wait(&ring->ready) != 0) {
+        // interrupted by a signal, wait again
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // pairs with the release in ring_push(), so the item and the slot it names are visible
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        // the semaphore can only be posted after the store, so this never actually spins
+    }
+    uint32_t item = ring->items[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_relaxed);
+    return item;
+}
+
+typedef struct {
+    pipeline_t *pipeline;
+    ring_t free; // writer -> reader: slots ready to be refilled
+    ring_t filled; // reader -> compute
+    ring_t computed; // compute -> writer
+    bool *last; // whether each slot holds the last piece, set by the reader
+} run_t;
+
+static void *reader(void *arg) {
+    run_t *run = (run_t *) arg;
+    bool last = false;
+    while (!last) {
+        uint32_t slot = ring_pop(&run->free);
+        last = run->pipeline->read(run->pipeline->state, slot);
+        run->last[slot] = last;
+        ring_push(&run->filled, slot);
+    }
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    run_t *run = (run_t *) arg;
+    bool last = false;
+    while (!last) {
+        uint32_t slot = ring_pop(&run->computed);
+        run->pipeline->write(run->pipeline->state, slot);
+        last = run->last[slot];
+        ring_push(&run->free, slot);
+    }
+    return NULL;
+}
+
+//
+// Runs the pipeline until the reader reports the last piece and the writer has written it.
+//
+// pipeline: stages and slot count
+//
+void pipeline_run(pipeline_t *pipeline) {
+    run_t run;
+    run.pipeline = pipeline;
+    ring_init(&run.free, pipeline->slots);
+    ring_init(&run.filled, pipeline->slots);
+    ring_init(&run.computed, pipeline->slots);
+    run.last = (bool *) calloc(pipeline->slots, sizeof(bool));
+    for (uint32_t slot = 0; slot < pipeline->slots; slot++) {
+        ring_push(&run.free, slot);
+    }
+
+    pthread_t read_thread, write_thread;
+    pthread_create(&read_thread, NULL, reader, &run);
+    pthread_create(&write_thread, NULL, writer, &run);
+
+    // the calling thread is the compute stage
+    bool last = false;
+    while (!last) {
+        uint32_t slot = ring_pop(&run.filled);
+        pipeline->compute(pipeline->state, slot);
+        last = run.last[slot];
+        ring_push(&run.computed, slot);
+    }
+
+    pthread_join(read_thread, NULL);
+    pthread_join(write_thread, NULL);
+    free(run.last);
+    ring_clear(&run.free);
+    ring_clear(&run.filled);
+    ring_clear(&run.computed);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// A three-stage streaming pipeline: a reader thread fills slots, the calling thread computes on
+// them, and a writer thread drains them in order. The stages hand slot numbers to each other
+// through single-producer, single-consumer rings, and a slot only goes back to the reader once
+// the writer is done with it, so memory stays at a fixed number of slots whatever the input size.
+//
+typedef struct {
+    uint32_t slots; // number of slots in flight, at least 2
+    void *state; // passed to every callback
+
+    //
+    // Fills slot number slot with the next piece of input.
+    // Returns true if this was the last piece; it is still computed and written.
+    //
+    bool (*read)(void *state, uint32_t slot);
+
+    //
+    // Processes a filled slot. Runs on the thread that called pipeline_run().
+    //
+    void (*compute)(void *state, uint32_t slot);
+
+    //
+    // Writes out a computed slot. Slots arrive in the order they were read.
+    //
+    void (*write)(void *state, uint32_t slot);
+} pipeline_t;
+
+//
+// Runs the pipeline until the reader reports the last piece and the writer has written it.
+//
+// pipeline: stages and slot count
+//
+void pipeline_run(pipeline_t *pipeline);
@@ -0,0 +1,183 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+typedef struct {
+    pool_t *pool;
+    pthread_t thread;
+    uint32_t id; // thread index passed to jobs, the calling thread is 0
+} worker_t;
+
+struct pool {
+    uint32_t threads; // including the calling thread
+    worker_t *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a new job is posted
+    pthread_cond_t done; // signalled when the last worker finishes a job
+
+    pool_fn *fn;
+    void *arg;
+    uint64_t count;
+    atomic_uint_fast64_t next; // next index to hand out
+
+    uint64_t generation; // bumped for every posted job
+    uint32_t active; // workers still busy with the current job
+    bool shutdown;
+};
+
+// claim indices of the current job until they run out
+static void drain(pool_t *pool, uint32_t thread) {
+    uint64_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        pool->fn(pool->arg, i, thread);
+    }
+}
+
+static void *worker(void *arg) {
+    worker_t *self = (worker_t *) arg;
+    pool_t *pool = self->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain(pool, self->id);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active -= 1;
+        if (pool->active == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+//
+// Creates a pool of threads (including the calling thread).
+//
+// threads: total number of threads to use, at least 1
+//
+pool_t *pool_create(uint32_t threads) {
+    pool_t *pool = (pool_t *) calloc(1, sizeof(pool_t));
+    pool->threads = threads > 0 ? threads : 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->next, 0);
+
+    pool->workers = (worker_t *) calloc(pool->threads, sizeof(worker_t));
+    for (uint32_t t = 1; t < pool->threads; t++) {
+        pool->workers[t].pool = pool;
+        pool->workers[t].id = t;
+        pthread_create(&pool->workers[t].thread, NULL, worker, &pool->workers[t]);
+    }
+    return pool;
+}
+
+//
+// Frees the pool and joins all of its worker threads.
+//
+// pool: pointer to the pool, set to NULL afterwards
+//
+void pool_delete(pool_t **pool) {
+    if (*pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(*pool)->lock);
+    (*pool)->shutdown = true;
+    pthread_cond_broadcast(&(*pool)->work);
+    pthread_mutex_unlock(&(*pool)->lock);
+
+    for (uint32_t t = 1; t < (*pool)->threads; t++) {
+        pthread_join((*pool)->workers[t].thread, NULL);
+    }
+    pthread_mutex_destroy(&(*pool)->lock);
+    pthread_cond_destroy(&(*pool)->work);
+    pthread_cond_destroy(&(*pool)->done);
+    free((*pool)->workers);
+    free(*pool);
+    *pool = NULL;
+}
+
+//
+// Returns the total number of threads the pool runs jobs on.
+//
+uint32_t pool_threads(pool_t *pool) {
+    return pool->threads;
+}
+
+//
+// Runs fn(arg, i, thread) for every i in [0, count) across the pool and waits for all of them
+// to finish.
+// Indices are handed out in increasing order, but may complete in any order.
+//
+// pool: the pool to run on
+// fn: the function to run for each index
+// arg: passed through to fn
+// count: number of indices
+//
+void pool_run(pool_t *pool, pool_fn *fn, void *arg, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->count = count;
+    atomic_store(&pool->next, 0);
+    pool->active = pool->threads - 1;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    // the calling thread pitches in instead of idling
+    drain(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//
+// Parses a thread count given on the command line.
+//
+// Provides:
+//  threads: the number of threads
+//  returns false unless all of text is a decimal number from 1 to POOL_MAX_THREADS
+//
+// Requires:
+//  text: the thread count as text
+//
+bool pool_parse_threads(uint32_t *threads, const char *text) {
+    // strtoul() would skip spaces and accept a sign, turning -1 into a huge count
+    if (!isdigit((unsigned char) *text)) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (errno != 0 || *end != '\0' || value < 1 || value > POOL_MAX_THREADS) {
+        return false;
+    }
+    *threads = value;
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the most threads a command-line option may ask for
+#define POOL_MAX_THREADS 1024
+
+//
+// A fixed-size pool of worker threads for running independent jobs in parallel.
+// The calling thread also works on every job, so a pool of 1 thread spawns no workers.
+//
+typedef struct pool pool_t;
+
+//
+// A job run by the pool: called once for every index in [0, count).
+//
+// arg: the argument passed to pool_run()
+// index: which item of the job to process
+// thread: which pool thread is running it, in [0, pool_threads()), for per-thread scratch
+//
+typedef void pool_fn(void *arg, uint64_t index, uint32_t thread);
+
+//
+// Creates a pool of threads (including the calling thread).
+//
+// threads: total number of threads to use, at least 1
+//
+pool_t *pool_create(uint32_t threads);
+
+//
+// Frees the pool and joins all of its worker threads.
+//
+// pool: pointer to the pool, set to NULL afterwards
+//
+void pool_delete(pool_t **pool);
+
+//
+// Returns the total number of threads the pool runs jobs on.
+//
+uint32_t pool_threads(pool_t *pool);
+
+//
+// Runs fn(arg, i, thread) for every i in [0, count) across the pool and waits for all of them
+// to finish.
+// Indices are handed out in increasing order, but may complete in any order.
+//
+// pool: the pool to run on
+// fn: the function to run for each index
+// arg: passed through to fn
+// count: number of indices
+//
+void pool_run(pool_t *pool, pool_fn *fn, void *arg, uint64_t count);
+
+//
+// Parses a thread count given on the command line.
+//
+// Provides:
+//  threads: the number of threads
+//  returns false unless all of text is a decimal number from 1 to POOL_MAX_THREADS
+//
+// Requires:
+//  text: the thread count as text
+//
+bool pool_parse_threads(uint32_t *threads, const char *text);
@@ -1,6 +1,9 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <gmp.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/random.h>
 
 #include "randstate.h"
 
@@ -25,3 +28,56 @@ void randstate_init(uint64_t seed) {
 void randstate_clear(void) {
     gmp_randclear(state);
 }
+
+//
+// Initializes an independent random state for one stream derived from a seed.
+// The same seed and stream number always give the same sequence.
+// Must be freed with gmp_randclear().
+//
+// rng: the random state to initialize
+// seed: the seed shared by all streams
+// stream: which stream to derive
+//
+void randstate_derive(gmp_randstate_t rng, uint64_t seed, uint64_t stream) {
+    // splitmix64 of the seed offset by the stream number
+    uint64_t z = seed + (stream + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+
+    gmp_randinit_mt(rng);
+    gmp_randseed_ui(rng, z);
+}
+
+//
+// Initializes an independent random state seeded with 256 bits from the kernel's random source.
+// Must be freed with gmp_randclear(), even if seeding failed.
+//
+// Provides:
+//  returns false if the kernel's random source failed
+//
+// Requires:
+//  rng: the random state to initialize
+//
+bool randstate_entropy(gmp_randstate_t rng) {
+    uint8_t bytes[32];
+    size_t filled = 0;
+    while (filled < sizeof(bytes)) {
+        ssize_t got = getrandom(&bytes[filled], sizeof(bytes) - filled, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        filled += got;
+    }
+
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_import(seed, sizeof(bytes), 1, sizeof(uint8_t), 1, 0, bytes);
+    gmp_randinit_mt(rng);
+    gmp_randseed(rng, seed);
+    mpz_clear(seed);
+    return filled == sizeof(bytes);
+}
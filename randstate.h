@@ -1,8 +1,18 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <gmp.h>
 
+//
+// Random states for key generation.
+//
+// The global state, seeded by randstate_init(), is a compatibility shim for the programs: every
+// function without an _r suffix draws from it, as ss_make_pub() also does from random(), so
+// those functions must not run on more than one thread at a time. Library code that generates
+// keys on several threads gives each thread its own state, from randstate_entropy() or
+// randstate_derive(), and calls the _r functions with it instead.
+//
 extern gmp_randstate_t state;
 
 //
@@ -18,3 +28,26 @@ void randstate_init(uint64_t seed);
 // Must be called after all key generation or number theory operations are used.
 //
 void randstate_clear(void);
+
+//
+// Initializes an independent random state for one stream derived from a seed.
+// The same seed and stream number always give the same sequence.
+// Must be freed with gmp_randclear().
+//
+// rng: the random state to initialize
+// seed: the seed shared by all streams
+// stream: which stream to derive
+//
+void randstate_derive(gmp_randstate_t rng, uint64_t seed, uint64_t stream);
+
+//
+// Initializes an independent random state seeded with 256 bits from the kernel's random source.
+// Must be freed with gmp_randclear(), even if seeding failed.
+//
+// Provides:
+//  returns false if the kernel's random source failed
+//
+// Requires:
+//  rng: the random state to initialize
+//
+bool randstate_entropy(gmp_randstate_t rng);
@@ -3,10 +3,187 @@
 #include <stdio.h>
 #include <gmp.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 
 #include "ss.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "pool.h"
+#include "ssbin.h"
+#include "mont.h"
+#include "montvec.h"
+#include "mapfile.h"
+#include "pipeline.h"
+#include "aead.h"
+#include "stats.h"
+#include "hex.h"
+
+// blocks handed to each thread per batch in the parallel file functions
+#define BLOCKS_PER_THREAD 16
+
+// batches in flight in the pipelined file functions: one each being read, computed and written,
+// and one spare so the reader can run ahead
+#define PIPELINE_SLOTS 4
+
+//
+// Initializes all mpz_t members of a CRT key.
+//
+void ss_crt_init(ss_crt_t *crt) {
+    mpz_inits(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+}
+
+//
+// Frees all mpz_t members of a CRT key.
+//
+void ss_crt_clear(ss_crt_t *crt) {
+    mpz_clears(crt->p, crt->q, crt->dp, crt->dq, crt->qinv, NULL);
+}
+
+// temporaries and scratch sized to the key, once the Montgomery contexts and recodings are built
+static void ss_ctx_alloc(ss_ctx_t *ctx) {
+    // The Garner step multiplies a difference below max(p, q) by qinv < p.
+    mp_bitcnt_t bits = mpz_sizeinbase(ctx->modulus, 2);
+    if (ctx->crt && mpz_sizeinbase(ctx->q, 2) > bits) {
+        bits = mpz_sizeinbase(ctx->q, 2);
+    }
+    bits = ctx->crt ? 2 * bits : bits;
+    mpz_init2(ctx->h, bits + GMP_NUMB_BITS);
+    mpz_init2(ctx->mp, bits + GMP_NUMB_BITS);
+    mpz_init2(ctx->mq, bits + GMP_NUMB_BITS);
+
+    // one scratch buffer serves both halves
+    mp_size_t limbs = mont_scratch_limbs(&ctx->ctx, &ctx->exp);
+    if (ctx->crt && mont_scratch_limbs(&ctx->q_ctx, &ctx->q_exp) > limbs) {
+        limbs = mont_scratch_limbs(&ctx->q_ctx, &ctx->q_exp);
+    }
+    ctx->scratch = (mp_limb_t *) malloc(limbs * sizeof(mp_limb_t));
+}
+
+// shared setup for both kinds of context
+static void ss_ctx_init(ss_ctx_t *ctx, mpz_t modulus, mpz_t e) {
+    ctx->crt = false;
+    ctx->k = 0;
+    mont_init(&ctx->ctx, modulus);
+    mont_exp_init(&ctx->exp, e);
+    mpz_init_set(ctx->modulus, modulus);
+    mpz_inits(ctx->q, ctx->qinv, NULL);
+    memset(&ctx->vec, 0, sizeof(montvec_t));
+}
+
+// Calculates the block size k, in bytes with the 0xFF in front, from the square root of n.
+static uint64_t block_size(mpz_t n) {
+    mpz_t sqrt_n;
+    mpz_init(sqrt_n);
+    mpz_sqrt(sqrt_n, n);
+    uint64_t k = (mpz_sizeinbase(sqrt_n, 2) - 1) / 8;
+    mpz_clear(sqrt_n);
+    return k;
+}
+
+//
+// Prepares a context for encrypting with a public key.
+//
+// Requires:
+//  ctx: the context to initialize
+//  n: public exponent/modulus
+//
+void ss_ctx_init_encrypt(ss_ctx_t *ctx, mpz_t n) {
+    ss_ctx_init(ctx, n, n);
+    ss_ctx_alloc(ctx);
+    montvec_init(&ctx->vec, n, &ctx->exp);
+    ctx->k = block_size(n);
+}
+
+//
+// Prepares a context for decrypting with a private key.
+//
+// Requires:
+//  ctx: the context to initialize
+//  d: private exponent, unused if crt is given
+//  pq: private modulus, unused if crt is given
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//
+void ss_ctx_init_decrypt(ss_ctx_t *ctx, mpz_t d, mpz_t pq, ss_crt_t *crt) {
+    if (crt == NULL) {
+        ss_ctx_init(ctx, pq, d);
+        ss_ctx_alloc(ctx);
+        return;
+    }
+
+    ss_ctx_init(ctx, crt->p, crt->dp);
+    ctx->crt = true;
+    mont_init(&ctx->q_ctx, crt->q);
+    mont_exp_init(&ctx->q_exp, crt->dq);
+    mpz_set(ctx->q, crt->q);
+    mpz_set(ctx->qinv, crt->qinv);
+    ss_ctx_alloc(ctx);
+}
+
+//
+// Prepares a context for the same key as another by copying everything derived from the key,
+// instead of deriving it again.
+//
+// Requires:
+//  ctx: the context to initialize
+//  src: a prepared context, or a view of one with only crt, k, modulus, q, qinv, ctx, exp, q_ctx,
+//   q_exp and vec filled in, where q_ctx and q_exp are unused without crt
+//
+void ss_ctx_init_copy(ss_ctx_t *ctx, const ss_ctx_t *src) {
+    ctx->crt = src->crt;
+    ctx->k = src->k;
+    mont_init_copy(&ctx->ctx, &src->ctx);
+    mont_exp_init_copy(&ctx->exp, &src->exp);
+    if (ctx->crt) {
+        mont_init_copy(&ctx->q_ctx, &src->q_ctx);
+        mont_exp_init_copy(&ctx->q_exp, &src->q_exp);
+    }
+    mpz_init_set(ctx->modulus, src->modulus);
+    mpz_init_set(ctx->q, src->q);
+    mpz_init_set(ctx->qinv, src->qinv);
+    ss_ctx_alloc(ctx);
+    montvec_init_copy(&ctx->vec, &src->vec, ctx->modulus, &ctx->exp);
+}
+
+// Prepares ctx for encrypting with n, copying prepared instead when it holds the same key.
+static void init_encrypt(ss_ctx_t *ctx, mpz_t n, const ss_ctx_t *prepared) {
+    if (prepared != NULL && !prepared->crt && mpz_cmp(prepared->modulus, n) == 0) {
+        ss_ctx_init_copy(ctx, prepared);
+    } else {
+        ss_ctx_init_encrypt(ctx, n);
+    }
+}
+
+// Prepares ctx for decrypting, copying prepared instead when it holds the same key. Keys are
+// told apart by their moduli.
+static void init_decrypt(
+    ss_ctx_t *ctx, mpz_t d, mpz_t pq, ss_crt_t *crt, const ss_ctx_t *prepared) {
+    if (prepared != NULL && prepared->crt == (crt != NULL)
+        && mpz_cmp(prepared->modulus, crt != NULL ? crt->p : pq) == 0
+        && (crt == NULL || mpz_cmp(prepared->q, crt->q) == 0)) {
+        ss_ctx_init_copy(ctx, prepared);
+    } else {
+        ss_ctx_init_decrypt(ctx, d, pq, crt);
+    }
+}
+
+//
+// Frees everything owned by a context.
+//
+void ss_ctx_clear(ss_ctx_t *ctx) {
+    if (ctx->crt) {
+        mont_exp_clear(&ctx->q_exp);
+        mont_clear(&ctx->q_ctx);
+    }
+    montvec_clear(&ctx->vec);
+    mont_exp_clear(&ctx->exp);
+    mont_clear(&ctx->ctx);
+    mpz_clears(ctx->modulus, ctx->q, ctx->qinv, ctx->h, ctx->mp, ctx->mq, NULL);
+    free(ctx->scratch);
+    ctx->scratch = NULL;
+}
 
 //miles
 uint64_t random_number_btw(uint64_t lower, uint64_t upper) {
@@ -17,6 +194,7 @@ uint64_t random_number_btw(uint64_t lower, uint64_t upper) {
 
 //
 // Generates the components for a new SS key.
+// Draws from the global random state and random(), see randstate.h; ss_make_pub_r() does not.
 //
 // Provides:
 //  p:  first prime
@@ -29,30 +207,40 @@ uint64_t random_number_btw(uint64_t lower, uint64_t upper) {
 //  all mpz_t arguments to be initialized
 //
 void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
+    ss_make_pub_search(p, q, n, nbits, iters, 0);
+}
+
+// Finds p with p_bits + 1 bits and q for the rest of nbits, drawing from rng; shared by
+// ss_make_pub_search() with the global state and ss_make_pub_r() with the caller's.
+static void make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint64_t interval,
+    uint64_t p_bits, gmp_randstate_t rng) {
     mpz_t p_value, q_value, p_minus_1, q_minus_1;
     mpz_inits(p_value, q_value, p_minus_1, q_minus_1, NULL);
 
     bool p_flag = true;
     bool q_flag = true;
 
-    //generate a random number btw certain range for p
-    uint64_t p_bits = random_number_btw(nbits / 5, (2 * nbits) / 5);
     //the bits from p will be contributed to n twice, the remaining bits will go to q
     uint64_t q_bits = nbits - (p_bits * 2);
 
     //either p or q flag is true, keep looping
     while (p_flag == true || q_flag == true) {
-        make_prime(p_value, p_bits, iters);
-        make_prime(q_value, q_bits, iters);
+        if (interval > 0) {
+            make_prime_search_r(p_value, p_bits, iters, interval, rng);
+            make_prime_search_r(q_value, q_bits, iters, interval, rng);
+        } else {
+            make_prime_r(p_value, p_bits, iters, rng);
+            make_prime_r(q_value, q_bits, iters, rng);
+        }
 
-        //Check p doesn't divide q-1
-        mpz_sub_ui(p_minus_1, p_value, 1);
-        if (mpz_divisible_p(p_minus_1, q)) {
+        //Check p doesn't divide q-1, on the candidates rather than the still unset outputs
+        mpz_sub_ui(q_minus_1, q_value, 1);
+        if (mpz_divisible_p(q_minus_1, p_value)) {
             continue;
         }
         //Check q doesn't divide p-1
-        mpz_sub_ui(q_minus_1, q_value, 1);
-        if (mpz_divisible_p(q_minus_1, p)) {
+        mpz_sub_ui(p_minus_1, p_value, 1);
+        if (mpz_divisible_p(p_minus_1, q_value)) {
             continue;
         }
 
@@ -71,6 +259,220 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
     mpz_clears(p_value, q_value, p_minus_1, q_minus_1, NULL);
 }
 
+//
+// Generates the components for a new SS key, optionally with the incremental prime search.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  interval: width of each sieved interval for make_prime_search(), 0 for make_prime()
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_search(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint64_t interval) {
+    //generate a random number btw certain range for p
+    uint64_t p_bits = random_number_btw(nbits / 5, (2 * nbits) / 5);
+    make_pub(p, q, n, nbits, iters, interval, p_bits, state);
+}
+
+//
+// Generates the components for a new SS key, drawing only from the given random state.
+// Unlike ss_make_pub(), this is safe to call on several threads at once, each with its own rng.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  interval: width of each sieved interval for make_prime_search_r(), 0 for make_prime_r()
+//  rng: random state used by this thread only, see randstate.h
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_r(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint64_t interval,
+    gmp_randstate_t rng) {
+    //the same range for p's size as random_number_btw() gives ss_make_pub()
+    uint64_t lower = nbits / 5, range = (2 * nbits) / 5 - lower;
+    uint64_t p_bits = lower + (range > 0 ? gmp_urandomm_ui(rng, range) : 0);
+    make_pub(p, q, n, nbits, iters, interval, p_bits, rng);
+}
+
+//
+// One prime search shared by the lanes of ss_make_pub_mt().
+// Lane i tests candidates from its own random stream, one per round. The prime found in the
+// lowest (round, lane) wins, which is the same no matter how the threads are scheduled.
+//
+typedef struct {
+    uint64_t bits;
+    uint64_t iters;
+    uint32_t lanes;
+    gmp_randstate_t *rngs; // one stream per lane
+    numtheory_ctx_t *ctxs; // one scratch context per lane
+    pthread_mutex_t lock;
+    bool found;
+    uint64_t best_round;
+    uint32_t best_lane;
+    mpz_t prime;
+} prime_search_t;
+
+typedef struct {
+    prime_search_t *searches[2]; // p lanes first, then q lanes
+} keygen_job_t;
+
+// true if (round, lane) comes after the current winner, so the lane can stop
+static bool search_passed(prime_search_t *search, uint64_t round, uint32_t lane) {
+    pthread_mutex_lock(&search->lock);
+    bool passed = search->found
+                  && (round > search->best_round
+                      || (round == search->best_round && lane > search->best_lane));
+    pthread_mutex_unlock(&search->lock);
+    return passed;
+}
+
+static void search_lane(void *arg, uint64_t index, uint32_t thread) {
+    (void) thread;
+    keygen_job_t *job = (keygen_job_t *) arg;
+    prime_search_t *search = job->searches[0];
+    uint32_t lane = index;
+    if (lane >= search->lanes) {
+        lane -= search->lanes;
+        search = job->searches[1];
+    }
+
+    mpz_t candidate;
+    mpz_init(candidate);
+    STATS_START(start);
+    for (uint64_t round = 0; !search_passed(search, round, lane); round++) {
+        if (prime_candidate_r(
+                candidate, search->bits, search->iters, search->rngs[lane], &search->ctxs[lane])) {
+            // every lane that finds a prime counts, whether or not its prime wins
+            STATS_STOP(STATS_MAKE_PRIME, start);
+            pthread_mutex_lock(&search->lock);
+            if (!search->found || round < search->best_round
+                || (round == search->best_round && lane < search->best_lane)) {
+                search->found = true;
+                search->best_round = round;
+                search->best_lane = lane;
+                mpz_set(search->prime, candidate);
+            }
+            pthread_mutex_unlock(&search->lock);
+            break;
+        }
+    }
+    mpz_clear(candidate);
+}
+
+static void search_init(prime_search_t *search, uint64_t bits, uint64_t iters, uint32_t lanes,
+    uint64_t seed, uint64_t first_stream) {
+    search->bits = bits;
+    search->iters = iters;
+    search->lanes = lanes;
+    search->rngs = (gmp_randstate_t *) malloc(lanes * sizeof(gmp_randstate_t));
+    search->ctxs = (numtheory_ctx_t *) malloc(lanes * sizeof(numtheory_ctx_t));
+    for (uint32_t i = 0; i < lanes; i++) {
+        randstate_derive(search->rngs[i], seed, first_stream + i);
+        numtheory_ctx_init(&search->ctxs[i]);
+    }
+    pthread_mutex_init(&search->lock, NULL);
+    search->found = false;
+    mpz_init(search->prime);
+}
+
+// starts every lane on a fresh stream, since how far each one got in the last search depends
+// on the scheduling
+static void search_reseed(prime_search_t *search, uint64_t seed, uint64_t first_stream) {
+    for (uint32_t i = 0; i < search->lanes; i++) {
+        gmp_randclear(search->rngs[i]);
+        randstate_derive(search->rngs[i], seed, first_stream + i);
+    }
+    search->found = false;
+}
+
+static void search_clear(prime_search_t *search) {
+    for (uint32_t i = 0; i < search->lanes; i++) {
+        gmp_randclear(search->rngs[i]);
+        numtheory_ctx_clear(&search->ctxs[i]);
+    }
+    free(search->rngs);
+    free(search->ctxs);
+    pthread_mutex_destroy(&search->lock);
+    mpz_clear(search->prime);
+}
+
+//
+// Generates the components for a new SS key, searching for p and q at the same time.
+// Each thread draws from its own random stream derived from seed, and every retry from fresh
+// ones, so the same seed and thread count always give the same key.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  threads: number of threads, split between the p and q searches
+//  seed: seed the per-thread random streams are derived from
+//  randstate_init() to have been called, for the choice of p's size
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_mt(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint32_t threads, uint64_t seed) {
+    if (threads <= 1) {
+        ss_make_pub(p, q, n, nbits, iters);
+        return;
+    }
+
+    //same split of bits between p and q as ss_make_pub()
+    uint64_t p_bits = random_number_btw(nbits / 5, (2 * nbits) / 5);
+    uint64_t q_bits = nbits - (p_bits * 2);
+
+    uint32_t p_lanes = threads / 2;
+    uint32_t q_lanes = threads - p_lanes;
+    prime_search_t p_search, q_search;
+    search_init(&p_search, p_bits, iters, p_lanes, seed, 0);
+    search_init(&q_search, q_bits, iters, q_lanes, seed, p_lanes);
+    keygen_job_t job = { { &p_search, &q_search } };
+
+    mpz_t p_minus_1, q_minus_1;
+    mpz_inits(p_minus_1, q_minus_1, NULL);
+
+    pool_t *pool = pool_create(threads);
+    for (uint64_t attempt = 0;; attempt++) {
+        // Attempt a draws from streams a * threads onwards, the first one from the same
+        // streams as search_init() gave.
+        search_reseed(&p_search, seed, attempt * threads);
+        search_reseed(&q_search, seed, attempt * threads + p_lanes);
+        pool_run(pool, search_lane, &job, threads);
+
+        //p must not divide q - 1 and q must not divide p - 1; otherwise keep searching
+        mpz_sub_ui(q_minus_1, q_search.prime, 1);
+        mpz_sub_ui(p_minus_1, p_search.prime, 1);
+        if (!mpz_divisible_p(q_minus_1, p_search.prime)
+            && !mpz_divisible_p(p_minus_1, q_search.prime)) {
+            break;
+        }
+    }
+    pool_delete(&pool);
+
+    mpz_set(p, p_search.prime);
+    mpz_set(q, q_search.prime);
+    mpz_mul(n, p, p);
+    mpz_mul(n, n, q);
+
+    mpz_clears(p_minus_1, q_minus_1, NULL);
+    search_clear(&p_search);
+    search_clear(&q_search);
+}
+
 //
 // Generates components for a new SS private key.
 //
@@ -113,6 +515,37 @@ void ss_make_priv(mpz_t d, mpz_t pq, mpz_t p, mpz_t q) {
     mpz_clears(n, p_minus_1, q_minus_1, phi_pq, gcd_pq, lamda_n, NULL);
 }
 
+//
+// Generates the CRT components of an SS private key.
+//
+// Provides:
+//  crt: p, q, d mod (p - 1), d mod (q - 1) and q^-1 mod p
+//
+// Requires:
+//  d: private exponent
+//  p: first prime number
+//  q: second prime number
+//  crt: initialized with ss_crt_init()
+//
+void ss_make_crt(ss_crt_t *crt, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t p_minus_1, q_minus_1;
+    mpz_inits(p_minus_1, q_minus_1, NULL);
+
+    mpz_set(crt->p, p);
+    mpz_set(crt->q, q);
+
+    //dp = d mod (p - 1), dq = d mod (q - 1)
+    mpz_sub_ui(p_minus_1, p, 1);
+    mpz_sub_ui(q_minus_1, q, 1);
+    mpz_mod(crt->dp, d, p_minus_1);
+    mpz_mod(crt->dq, d, q_minus_1);
+
+    //qinv = q^-1 mod p, used to recombine the two halves
+    mod_inverse(crt->qinv, q, p);
+
+    mpz_clears(p_minus_1, q_minus_1, NULL);
+}
+
 //
 // Export SS public key to output stream
 //
@@ -140,6 +573,21 @@ void ss_write_priv(mpz_t pq, mpz_t d, FILE *pvfile) {
     gmp_fprintf(pvfile, "%ZX\n%ZX\n", pq, d);
 }
 
+//
+// Export extended SS private key to output stream.
+// The first two lines are identical to ss_write_priv(), so older readers still work.
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components from ss_make_crt()
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_crt(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile) {
+    ss_write_priv(pq, d, pvfile);
+    gmp_fprintf(pvfile, "%ZX\n%ZX\n%ZX\n%ZX\n%ZX\n", crt->p, crt->q, crt->dp, crt->dq, crt->qinv);
+}
+
 //
 // Import SS public key from input stream
 //
@@ -172,151 +620,1704 @@ void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile) {
 }
 
 //
-// Encrypt number m into number c
+// Import SS private key from input stream, including the CRT components if present
 //
 // Provides:
-//  c: encrypted integer
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components, only valid if true is returned
+//  returns true if the key is in the extended format, false for a plain two-line key
 //
 // Requires:
-//  m: original integer
-//  n: public exponent/modulus
+//  pvfile: open and readable file stream
+//  crt: initialized with ss_crt_init()
 //  all mpz_t arguments to be initialized
 //
-void ss_encrypt(mpz_t c, mpz_t m, mpz_t n) {
-    pow_mod(c, m, n, n);
+bool ss_read_priv_crt(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile) {
+    ss_read_priv(pq, d, pvfile);
+    // old two-line keys simply run out of input here
+    int count = gmp_fscanf(
+        pvfile, "%ZX\n%ZX\n%ZX\n%ZX\n%ZX\n", crt->p, crt->q, crt->dp, crt->dq, crt->qinv);
+    return count == 5;
 }
 
-//
-// Encrypt an arbitrary file
-//
-// Provides:
-//  fills outfile with the encrypted contents of infile
-//
-// Requires:
-//  infile: open and readable file stream
-//  outfile: open and writable file stream
-//  n: public exponent and modulus
-//
-void ss_encrypt_file(FILE *infile, FILE *outfile, mpz_t n) {
-
-    mpz_t sqrt_n;
-    mpz_init(sqrt_n);
+// bytes of header and checksum around the fields of a binary key
+#define KEY_HEADER_SIZE   8
+#define KEY_CHECKSUM_SIZE 8
 
-    uint64_t k;
+static void put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
 
-    // Calculate the block size k.
-    // find square root of n
-    // https://gmplib.org/manual/Integer-Roots
-    mpz_sqrt(sqrt_n, n);
-    k = (mpz_sizeinbase(sqrt_n, 2) - 1) / 8;
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
 
-    // Dynamically allocate an array that can hold k bytes.
-    // This array should be of type (uint8_t *) and
-    // will serve as the block.
-    uint8_t *block = (uint8_t *) malloc(k * sizeof(uint8_t));
+// 8-byte limbs of x in a binary key field
+static size_t key_limbs(mpz_t x) {
+    return mpz_sgn(x) == 0 ? 0 : (mpz_sizeinbase(x, 2) + 63) / 64;
+}
 
-    // Set the zeroth byte of the block to 0xFF.
-    // This effectively prepends the workaround byte that we need.
-    block[0] = 0xFF;
+// writes a binary key in one piece: header, numbers, then the username if there is one
+static void write_key_bin(
+    uint8_t kind, mpz_ptr numbers[], uint8_t count, const char *username, FILE *file) {
+    size_t size = KEY_HEADER_SIZE + KEY_CHECKSUM_SIZE;
+    for (uint8_t i = 0; i < count; i++) {
+        size += 4 + 8 * key_limbs(numbers[i]);
+    }
+    size += username != NULL ? 4 + strlen(username) : 0;
 
-    // While there are still unprocessed bytes in infile:
-    while (!feof(infile)) {
-        // Read at most k−1 bytes in from infile, and let j be the number of bytes actually read.
-        // Place the read bytes into the allocated block starting
-        // from index 1 so as to not overwrite the 0xFF.
-        // starting from block[1],
-        // fread(void *ptr, size_t size, size_t count, FILE *stream);
-        uint64_t j = fread(&block[1], sizeof(uint8_t), k - 1, infile);
+    uint8_t *key = (uint8_t *) malloc(size);
+    memcpy(key, SS_KEY_MAGIC, 4);
+    key[4] = SS_KEY_VERSION >> 8;
+    key[5] = SS_KEY_VERSION & 0xFF;
+    key[6] = kind;
+    key[7] = count + (username != NULL);
+    uint8_t *out = &key[KEY_HEADER_SIZE];
+    for (uint8_t i = 0; i < count; i++) {
+        put_u32(out, key_limbs(numbers[i]));
+        mpz_export(&out[4], NULL, 1, 8, 1, 0, numbers[i]);
+        out += 4 + 8 * key_limbs(numbers[i]);
+    }
+    if (username != NULL) {
+        put_u32(out, strlen(username));
+        memcpy(&out[4], username, strlen(username));
+        out += 4 + strlen(username);
+    }
+    uint64_t checksum = ssbin_hash(key, out - key);
+    for (int i = 7; i >= 0; i--) {
+        out[i] = checksum & 0xFF;
+        checksum >>= 8;
+    }
+    fwrite(key, sizeof(uint8_t), size, file);
+    free(key);
+}
 
-        // Using mpz_import(), convert the read bytes, including the prepended 0xFF into an mpz_t m.
-        // You will want to set the order parameter of mpz_import() to 1 for most significant word
-        // first, 1 for the endian parameter, and 0 for the nails parameter.
-        mpz_t m, c;
-        mpz_inits(m, c, NULL);
-        // mpz_import(rop, count, order, size, endian, nails, limbs);
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
+// checks the header and checksum of a binary key of length bytes; returns the number of bytes
+// of fields after the header in *size
+static bool check_key_bin(
+    const uint8_t *key, size_t length, uint8_t kind, uint8_t fields, size_t *size) {
+    if (length < KEY_HEADER_SIZE + KEY_CHECKSUM_SIZE || memcmp(key, SS_KEY_MAGIC, 4) != 0
+        || get_be(&key[4], 2) != SS_KEY_VERSION || key[6] != kind || key[7] != fields
+        || get_be(&key[length - KEY_CHECKSUM_SIZE], KEY_CHECKSUM_SIZE)
+               != ssbin_hash(key, length - KEY_CHECKSUM_SIZE)) {
+        return false;
+    }
+    *size = length - KEY_HEADER_SIZE - KEY_CHECKSUM_SIZE;
+    return true;
+}
 
-        // Encrypt m with ss_encrypt(), then write the encrypted number to outfile as a hexstring
-        // followed by a trailing newline.
-        ss_encrypt(c, m, n);
-        gmp_fprintf(outfile, "%ZX\n", c);
+// reads the rest of a file, ideally in a single read; returns the bytes and their number
+static uint8_t *read_key_bin(FILE *file, size_t *length) {
+    struct stat info;
+    size_t capacity = 4096;
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)
+        && (size_t) info.st_size >= capacity) {
+        capacity = info.st_size + 1;
+    }
+    uint8_t *key = (uint8_t *) malloc(capacity);
+    size_t j;
+    *length = 0;
+    while ((j = fread(&key[*length], sizeof(uint8_t), capacity - *length, file)) > 0) {
+        *length += j;
+        if (*length == capacity) {
+            capacity *= 2;
+            key = (uint8_t *) realloc(key, capacity);
+        }
+    }
+    return key;
+}
 
-        mpz_clears(m, c, NULL);
+// takes the next field of width-byte units off a binary key, or returns NULL if it is cut short
+static const uint8_t *key_field(const uint8_t **cursor, size_t *left, size_t width, size_t *count) {
+    if (*left < 4) {
+        return NULL;
     }
+    *count = get_be(*cursor, 4);
+    if (*count > (*left - 4) / width) {
+        return NULL;
+    }
+    const uint8_t *field = &(*cursor)[4];
+    *cursor += 4 + *count * width;
+    *left -= 4 + *count * width;
+    return field;
+}
 
-    // Clean up
-    mpz_clear(sqrt_n);
-    free(block);
+// imports the numbers of a binary key, returns false if a field is cut short
+static bool read_numbers(const uint8_t **cursor, size_t *left, mpz_ptr numbers[], int count) {
+    for (int i = 0; i < count; i++) {
+        size_t limbs;
+        const uint8_t *field = key_field(cursor, left, 8, &limbs);
+        if (field == NULL) {
+            return false;
+        }
+        mpz_import(numbers[i], limbs, 1, 8, 1, 0, field);
+    }
+    return true;
 }
 
 //
-// Decrypt number c into number m
-//
-// Provides:
-//  m: decrypted/original integer
+// Checks whether a key file is in the binary format, without consuming any of it.
 //
 // Requires:
-//  c: encrypted integer
-//  d: private exponent
-//  pq: private modulus
-//  all mpz_t arguments to be initialized
+//  keyfile: open and readable file stream
 //
-void ss_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t pq) {
-    pow_mod(m, c, d, pq);
+bool ss_key_is_bin(FILE *keyfile) {
+    int c = getc(keyfile);
+    if (c == EOF) {
+        return false;
+    }
+    ungetc(c, keyfile);
+    return c == SS_KEY_MAGIC[0];
 }
 
 //
-// Decrypt a file back into its original form.
-//
-// Provides:
-//  fills outfile with the unencrypted data from infile
+// Export SS public key to output stream in the binary format
 //
 // Requires:
-//  infile: open and readable file stream to encrypted data
-//  outfile: open and writable file stream
-//  d: private exponent
-//  pq: private modulus
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  pbfile: open and writable file stream
 //
-void ss_decrypt_file(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq) {
+void ss_write_pub_bin(mpz_t n, char username[], FILE *pbfile) {
+    // keygen passes $USER straight through, which may be unset
+    mpz_ptr numbers[] = { n };
+    write_key_bin(SS_KEY_PUBLIC, numbers, 1, username != NULL ? username : "", pbfile);
+}
+
+//
+// Export SS private key and its CRT components to output stream in the binary format
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components from ss_make_crt()
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile) {
+    mpz_ptr numbers[] = { pq, d, crt->p, crt->q, crt->dp, crt->dq, crt->qinv };
+    write_key_bin(SS_KEY_PRIVATE, numbers, 7, NULL, pvfile);
+}
+
+//
+// Import SS public key in the binary format from input stream
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  returns false if the file is truncated, damaged, not a public key, or the name does not fit
+//
+// Requires:
+//  username_size: bytes of room in username
+//  pbfile: open and readable file stream
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_pub_bin(mpz_t n, char username[], size_t username_size, FILE *pbfile) {
+    size_t length;
+    uint8_t *key = read_key_bin(pbfile, &length);
+    bool ok = ss_load_pub_bin(n, username, username_size, key, length);
+    free(key);
+    return ok;
+}
+
+//
+// Import SS public key in the binary format from memory, such as one entry of a keyring
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  returns false if the key is truncated, damaged, not a public key, or the name does not fit
+//
+// Requires:
+//  username_size: bytes of room in username
+//  key: the whole key as ss_write_pub_bin() wrote it
+//  length: bytes in key
+//  all mpz_t arguments to be initialized
+//
+bool ss_load_pub_bin(
+    mpz_t n, char username[], size_t username_size, const uint8_t *key, size_t length) {
+    size_t left;
+    if (!check_key_bin(key, length, SS_KEY_PUBLIC, 2, &left)) {
+        return false;
+    }
+    const uint8_t *cursor = &key[KEY_HEADER_SIZE];
+    mpz_ptr numbers[] = { n };
+    size_t name_length = 0;
+    const uint8_t *name = NULL;
+    bool ok = read_numbers(&cursor, &left, numbers, 1)
+        && (name = key_field(&cursor, &left, 1, &name_length)) != NULL && left == 0
+        && name_length < username_size;
+    if (ok) {
+        memcpy(username, name, name_length);
+        username[name_length] = '\0';
+    }
+    return ok;
+}
+
+//
+// Import SS private key and its CRT components in the binary format from input stream
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components
+//  returns false if the file is truncated, damaged or not a private key
+//
+// Requires:
+//  pvfile: open and readable file stream
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile) {
+    size_t length;
+    uint8_t *key = read_key_bin(pvfile, &length);
+    bool ok = ss_load_priv_bin(pq, d, crt, key, length);
+    free(key);
+    return ok;
+}
+
+//
+// Import SS private key and its CRT components in the binary format from memory
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components
+//  returns false if the key is truncated, damaged or not a private key
+//
+// Requires:
+//  key: the whole key as ss_write_priv_bin() wrote it
+//  length: bytes in key
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool ss_load_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, const uint8_t *key, size_t length) {
+    size_t left;
+    if (!check_key_bin(key, length, SS_KEY_PRIVATE, 7, &left)) {
+        return false;
+    }
+    const uint8_t *cursor = &key[KEY_HEADER_SIZE];
+    mpz_ptr numbers[] = { pq, d, crt->p, crt->q, crt->dp, crt->dq, crt->qinv };
+    return read_numbers(&cursor, &left, numbers, 7) && left == 0;
+}
+
+//
+// Encrypt number m into number c
+//
+// Provides:
+//  c: encrypted integer
+//
+// Requires:
+//  m: original integer
+//  n: public exponent/modulus
+//  all mpz_t arguments to be initialized
+//
+void ss_encrypt(mpz_t c, mpz_t m, mpz_t n) {
+    ss_ctx_t ctx;
+    ss_ctx_init_encrypt(&ctx, n);
+    ss_encrypt_ctx(&ctx, c, m);
+    ss_ctx_clear(&ctx);
+}
+
+//
+// Encrypt number m into number c with a prepared key
+//
+// Provides:
+//  c: encrypted integer
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_encrypt()
+//  m: original integer, below the square root of n like the blocks of ss_encrypt_file()
+//  all mpz_t arguments to be initialized, c with room for n to avoid allocating
+//
+void ss_encrypt_ctx(ss_ctx_t *ctx, mpz_t c, mpz_t m) {
+    mont_powm_scratch(c, m, &ctx->exp, &ctx->ctx, ctx->scratch);
+}
+
+//
+// Encrypt a batch of numbers, several at a time in SIMD lanes when the CPU supports it
+//
+// Provides:
+//  c: count encrypted integers
+//
+// Requires:
+//  m: count original integers
+//  count: number of integers
+//  n: public exponent/modulus
+//  all mpz_t arguments to be initialized
+//
+void ss_encrypt_batch(mpz_t c[], mpz_t m[], uint64_t count, mpz_t n) {
+    ss_ctx_t ctx;
+    ss_ctx_init_encrypt(&ctx, n);
+    ss_encrypt_batch_ctx(&ctx, c, m, count);
+    ss_ctx_clear(&ctx);
+}
+
+//
+// Encrypt a batch of numbers with a prepared key
+//
+// Provides:
+//  c: count encrypted integers
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_encrypt()
+//  m: count original integers
+//  count: number of integers, ideally a multiple of ctx->vec.lanes
+//  all mpz_t arguments to be initialized, c with room for n to avoid allocating
+//
+void ss_encrypt_batch_ctx(ss_ctx_t *ctx, mpz_t c[], mpz_t m[], uint64_t count) {
+    // The scalar fallback is the single-block path, one number at a time. A lone number, like
+    // the last block of a short message, is also quicker on its own than in a mostly empty group.
+    if (ctx->vec.kernel->mul == NULL || count == 1) {
+        for (uint64_t i = 0; i < count; i++) {
+            ss_encrypt_ctx(ctx, c[i], m[i]);
+        }
+        return;
+    }
+    montvec_powm(c, m, count, &ctx->exp, &ctx->vec);
+}
+
+// m = j bytes of a block with the 0xFF workaround byte in front, read in place from bytes
+static void import_block(mpz_t m, const uint8_t *bytes, uint64_t j) {
+    mpz_import(m, j, 1, sizeof(uint8_t), 1, 0, bytes);
+    for (uint64_t b = 0; b < 8; b++) {
+        mpz_setbit(m, 8 * j + b);
+    }
+}
+
+// Writes c as an uppercase hexstring line, the same text as gmp_fprintf() with "%ZX\n", and
+// returns its length. text needs room for the hex digits of the modulus plus one.
+static uint64_t format_hex(char *text, mpz_t c) {
+    uint64_t length = hex_encode(text, c);
+    text[length] = '\n';
+    return length + 1;
+}
+
+// encrypts m and writes it to outfile as a hexstring line, timing each stage
+static void encrypt_line(ss_ctx_t *ctx, mpz_t c, mpz_t m, char *text, FILE *outfile) {
+    STATS_START(powm);
+    ss_encrypt_ctx(ctx, c, m);
+    STATS_STOP(STATS_POWM, powm);
+    STATS_ADD(STATS_BLOCKS, 1);
+    STATS_START(format);
+    uint64_t length = format_hex(text, c);
+    STATS_STOP(STATS_FORMAT, format);
+    STATS_START(write);
+    fwrite(text, sizeof(char), length, outfile);
+    STATS_STOP(STATS_WRITE, write);
+    STATS_ADD(STATS_BYTES_OUT, length);
+}
+
+// bytes in the block starting at offset of a mapped input, split into k - 1 byte blocks
+// exactly like the fread() loops: a short or empty final block always follows the full ones
+static uint64_t mapped_block(mapfile_t *map, uint64_t offset, uint64_t k) {
+    return map->size - offset < k - 1 ? map->size - offset : k - 1;
+}
+
+//
+// Single-threaded encryption loop for ss_encrypt_file() and ss_encrypt_file_mt(), copying the
+// key from prepared when it is given.
+//
+static void encrypt_file(FILE *infile, FILE *outfile, mpz_t n, const ss_ctx_t *prepared) {
+
+    // Every block uses the same key, so prepare it only once.
+    // Preparing it also works out the block size k from the square root of n.
+    ss_ctx_t ctx;
+    init_encrypt(&ctx, n, prepared);
+    uint64_t k = ctx.k;
+
+    // Dynamically allocate an array that can hold k bytes.
+    // This array should be of type (uint8_t *) and
+    // will serve as the block.
+    uint8_t *block = (uint8_t *) malloc(k * sizeof(uint8_t));
+
+    // Set the zeroth byte of the block to 0xFF.
+    // This effectively prepends the workaround byte that we need.
+    block[0] = 0xFF;
 
+    // The block numbers are also prepared only once.
+    mpz_t m, c;
+    mpz_init2(m, 8 * k);
+    mpz_init2(c, mpz_sizeinbase(n, 2));
+    char *text = (char *) malloc(mpz_sizeinbase(n, 16) + 1);
+
+    // Regular files are encrypted straight out of a memory mapping, without fread() copies.
+    mapfile_t map;
+    bool mapped = mapfile_open(&map, infile);
+    for (uint64_t offset = 0; mapped && offset <= map.size; offset += k - 1) {
+        uint64_t j = mapped_block(&map, offset, k);
+        STATS_START(import);
+        import_block(m, &map.data[offset], j);
+        STATS_STOP(STATS_IMPORT, import);
+        STATS_ADD(STATS_BYTES_IN, j);
+        encrypt_line(&ctx, c, m, text, outfile);
+    }
+    mapfile_close(&map, infile);
+
+    // While there are still unprocessed bytes in infile:
+    while (!mapped && !feof(infile)) {
+        // Read at most k−1 bytes in from infile, and let j be the number of bytes actually read.
+        // Place the read bytes into the allocated block starting
+        // from index 1 so as to not overwrite the 0xFF.
+        // starting from block[1],
+        // fread(void *ptr, size_t size, size_t count, FILE *stream);
+        STATS_START(read);
+        uint64_t j = fread(&block[1], sizeof(uint8_t), k - 1, infile);
+        STATS_STOP(STATS_READ, read);
+
+        // Using mpz_import(), convert the read bytes, including the prepended 0xFF into an mpz_t m.
+        // You will want to set the order parameter of mpz_import() to 1 for most significant word
+        // first, 1 for the endian parameter, and 0 for the nails parameter.
+        // mpz_import(rop, count, order, size, endian, nails, limbs);
+        STATS_START(import);
+        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
+        STATS_STOP(STATS_IMPORT, import);
+        STATS_ADD(STATS_BYTES_IN, j);
+
+        // Encrypt m like ss_encrypt(), then write the encrypted number to outfile as a hexstring
+        // followed by a trailing newline.
+        encrypt_line(&ctx, c, m, text, outfile);
+    }
+
+    // Clean up
+    ss_ctx_clear(&ctx);
+    mpz_clears(m, c, NULL);
+    free(block);
+    free(text);
+}
+
+//
+// Encrypt an arbitrary file
+//
+// Provides:
+//  fills outfile with the encrypted contents of infile
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//
+void ss_encrypt_file(FILE *infile, FILE *outfile, mpz_t n) {
+    encrypt_file(infile, outfile, n, NULL);
+}
+
+//
+// One batch of blocks shared between the threads of ss_encrypt_file_mt().
+//
+typedef struct {
+    uint64_t k; // block size
+    uint8_t *blocks; // capacity * k bytes for reading unmapped input, block i starts at i * k
+    const uint8_t **sources; // where the bytes of each block start, in blocks or the mapping
+    uint64_t *lengths; // bytes in each block, not counting the 0xFF
+    uint64_t count; // blocks in the batch
+    mpz_t *m, *c; // plaintext and ciphertext of each block
+    ss_ctx_t *ctxs; // one prepared key per pool thread
+} encrypt_batch_t;
+
+// encrypts one group of blocks, as many as the thread's context has SIMD lanes
+static void encrypt_group(void *arg, uint64_t index, uint32_t thread) {
+    encrypt_batch_t *batch = (encrypt_batch_t *) arg;
+    ss_ctx_t *ctx = &batch->ctxs[thread];
+    uint64_t first = index * ctx->vec.lanes;
+    uint64_t count = batch->count - first < ctx->vec.lanes ? batch->count - first : ctx->vec.lanes;
+    STATS_START(import);
+    for (uint64_t i = first; i < first + count; i++) {
+        import_block(batch->m[i], batch->sources[i], batch->lengths[i]);
+        STATS_ADD(STATS_BYTES_IN, batch->lengths[i]);
+    }
+    STATS_STOP(STATS_IMPORT, import);
+    STATS_START(powm);
+    ss_encrypt_batch_ctx(ctx, &batch->c[first], &batch->m[first], count);
+    STATS_STOP(STATS_POWM, powm);
+    STATS_ADD(STATS_BLOCKS, count);
+}
+
+//
+// Everything one batched encryption needs, from reading through writing.
+// The plain loop uses a single batch; the pipeline keeps PIPELINE_SLOTS of them in flight.
+//
+typedef struct {
+    FILE *infile, *outfile;
+    uint64_t k; // block size
+    uint64_t capacity; // blocks per batch
+    mapfile_t map; // the input, when it is a regular file
+    bool mapped;
+    uint64_t offset; // where the next block starts in the mapping
+    bool binary;
+    ssbin_header_t header;
+    uint8_t *records; // packed output records, or the hexstring lines of a batch
+    uint64_t total; // blocks written
+    pool_t *pool;
+    encrypt_batch_t *batches;
+} encrypt_run_t;
+
+// reads the next batch of blocks, returns true once the input is used up
+static bool encrypt_read(void *arg, uint32_t slot) {
+    STATS_START(read);
+    encrypt_run_t *run = (encrypt_run_t *) arg;
+    encrypt_batch_t *batch = &run->batches[slot];
+    uint64_t k = run->k;
+
+    // Split blocks exactly like the serial loop so the output is byte-identical.
+    uint64_t count = 0;
+    if (run->mapped) {
+        for (; count < run->capacity && run->offset <= run->map.size;
+             count++, run->offset += k - 1) {
+            batch->sources[count] = &run->map.data[run->offset];
+            batch->lengths[count] = mapped_block(&run->map, run->offset, k);
+        }
+        batch->count = count;
+        STATS_STOP(STATS_READ, read);
+        return run->offset > run->map.size;
+    }
+    while (count < run->capacity && !feof(run->infile)) {
+        uint64_t j = fread(&batch->blocks[count * k + 1], sizeof(uint8_t), k - 1, run->infile);
+        batch->sources[count] = &batch->blocks[count * k + 1];
+        batch->lengths[count] = j;
+        count += 1;
+    }
+    batch->count = count;
+    STATS_STOP(STATS_READ, read);
+    return feof(run->infile);
+}
+
+static void encrypt_compute(void *arg, uint32_t slot) {
+    encrypt_run_t *run = (encrypt_run_t *) arg;
+    encrypt_batch_t *batch = &run->batches[slot];
+    uint64_t lanes = batch->ctxs[0].vec.lanes;
+    pool_run(run->pool, encrypt_group, batch, (batch->count + lanes - 1) / lanes);
+}
+
+// writes the ciphertexts of a batch back in their original block order
+static void encrypt_write(void *arg, uint32_t slot) {
+    encrypt_run_t *run = (encrypt_run_t *) arg;
+    encrypt_batch_t *batch = &run->batches[slot];
+    STATS_START(format);
+    uint64_t size = 0;
+    if (run->binary) {
+        uint32_t width = run->header.width;
+        for (uint64_t i = 0; i < batch->count; i++) {
+            ssbin_pack(&run->records[i * width], width, batch->c[i]);
+        }
+        size = batch->count * width;
+    } else {
+        for (uint64_t i = 0; i < batch->count; i++) {
+            size += format_hex((char *) &run->records[size], batch->c[i]);
+        }
+    }
+    STATS_STOP(STATS_FORMAT, format);
+    STATS_START(write);
+    fwrite(run->records, sizeof(uint8_t), size, run->outfile);
+    STATS_STOP(STATS_WRITE, write);
+    STATS_ADD(STATS_BYTES_OUT, size);
+    run->total += batch->count;
+}
+
+//
+// Shared batch loop for ss_encrypt_file_mt(), ss_encrypt_file_bin() and ss_encrypt_file_pipe().
+// Writes hexstring lines, or a binary container if binary is set. With pipelined set, reading
+// and writing run on their own threads, overlapping with the exponentiations.
+//
+static void encrypt_file_batched(FILE *infile, FILE *outfile, mpz_t n, uint32_t threads,
+    bool binary, bool pipelined, const ss_ctx_t *prepared) {
+    encrypt_run_t run;
+    run.infile = infile;
+    run.outfile = outfile;
+    run.capacity = (uint64_t) (threads > 0 ? threads : 1) * BLOCKS_PER_THREAD;
+    run.binary = binary;
+    run.total = 0;
+    run.pool = pool_create(threads);
+
+    // one prepared key per pool thread, shared by every batch; the rest copy the first
+    ss_ctx_t *ctxs = (ss_ctx_t *) malloc(pool_threads(run.pool) * sizeof(ss_ctx_t));
+    init_encrypt(&ctxs[0], n, prepared);
+    for (uint32_t t = 1; t < pool_threads(run.pool); t++) {
+        ss_ctx_init_copy(&ctxs[t], &ctxs[0]);
+    }
+
+    // Same block size as ss_encrypt_file().
+    uint64_t k = ctxs[0].k;
+    run.k = k;
+
+    uint32_t slots = pipelined ? PIPELINE_SLOTS : 1;
+    run.batches = (encrypt_batch_t *) malloc(slots * sizeof(encrypt_batch_t));
+    for (uint32_t s = 0; s < slots; s++) {
+        encrypt_batch_t *batch = &run.batches[s];
+        batch->k = k;
+        batch->blocks = (uint8_t *) malloc(run.capacity * k * sizeof(uint8_t));
+        batch->sources = (const uint8_t **) malloc(run.capacity * sizeof(uint8_t *));
+        batch->lengths = (uint64_t *) malloc(run.capacity * sizeof(uint64_t));
+        batch->m = (mpz_t *) malloc(run.capacity * sizeof(mpz_t));
+        batch->c = (mpz_t *) malloc(run.capacity * sizeof(mpz_t));
+        for (uint64_t i = 0; i < run.capacity; i++) {
+            mpz_init2(batch->m[i], 8 * k);
+            mpz_init2(batch->c[i], mpz_sizeinbase(n, 2));
+        }
+        batch->ctxs = ctxs;
+    }
+
+    // The block count is patched into the header at the end if the output can seek back.
+    run.header = (ssbin_header_t) { SSBIN_VERSION, ssbin_fingerprint(n), k, ssbin_width(n),
+        SSBIN_COUNT_UNKNOWN };
+    // Hexstring lines are formatted into the same buffer and written with one fwrite() too.
+    uint64_t record = binary ? run.header.width : mpz_sizeinbase(n, 16) + 1;
+    run.records = (uint8_t *) malloc(run.capacity * record * sizeof(uint8_t));
+    long header_pos = -1;
+    if (binary) {
+        header_pos = ftell(outfile);
+        ssbin_write_header(&run.header, outfile);
+    }
+
+    // Regular files are read straight out of a memory mapping, without fread() copies.
+    run.mapped = mapfile_open(&run.map, infile);
+    run.offset = 0;
+
+    if (pipelined) {
+        pipeline_t pipeline
+            = { PIPELINE_SLOTS, &run, encrypt_read, encrypt_compute, encrypt_write };
+        pipeline_run(&pipeline);
+    } else {
+        bool last = false;
+        while (!last) {
+            last = encrypt_read(&run, 0);
+            encrypt_compute(&run, 0);
+            encrypt_write(&run, 0);
+        }
+    }
+    mapfile_close(&run.map, infile);
+
+    if (binary && header_pos >= 0 && fseek(outfile, header_pos, SEEK_SET) == 0) {
+        run.header.count = run.total;
+        ssbin_write_header(&run.header, outfile);
+        fseek(outfile, 0, SEEK_END);
+    }
+
+    for (uint32_t t = 0; t < pool_threads(run.pool); t++) {
+        ss_ctx_clear(&ctxs[t]);
+    }
+    pool_delete(&run.pool);
+    for (uint32_t s = 0; s < slots; s++) {
+        encrypt_batch_t *batch = &run.batches[s];
+        for (uint64_t i = 0; i < run.capacity; i++) {
+            mpz_clears(batch->m[i], batch->c[i], NULL);
+        }
+        free(batch->m);
+        free(batch->c);
+        free(batch->sources);
+        free(batch->lengths);
+        free(batch->blocks);
+    }
+    free(run.records);
+    free(run.batches);
+    free(ctxs);
+}
+
+//
+// Encrypt an arbitrary file on multiple threads
+//
+// Provides:
+//  fills outfile with the encrypted contents of infile, identical to ss_encrypt_file()
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_mt(
+    FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, const ss_ctx_t *prepared) {
+    // A single thread still gains from batching when blocks can share SIMD lanes.
+    if (threads <= 1 && montvec_kernel()->mul == NULL) {
+        encrypt_file(infile, outfile, n, prepared);
+        return;
+    }
+    encrypt_file_batched(infile, outfile, n, threads, false, false, prepared);
+}
+
+//
+// Encrypt an arbitrary file into a binary ciphertext container (see ssbin.h)
+//
+// Provides:
+//  fills outfile with a container header and one fixed-width record per block
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream, seekable if the block count should be recorded
+//  n: public exponent and modulus
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_bin(
+    FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, const ss_ctx_t *prepared) {
+    encrypt_file_batched(infile, outfile, n, threads, true, false, prepared);
+}
+
+//
+// Encrypt an arbitrary file through a reader/compute/writer pipeline (see pipeline.h).
+// A reader thread reads blocks and a writer thread writes ciphertexts while the pool computes,
+// with a fixed number of batches in flight. Works on pipes as well as regular files.
+//
+// Provides:
+//  fills outfile with the same output as ss_encrypt_file_mt() or ss_encrypt_file_bin()
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  threads: number of compute threads to use, at least 1
+//  binary: write a binary ciphertext container instead of hexstrings
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_pipe(FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, bool binary,
+    const ss_ctx_t *prepared) {
+    encrypt_file_batched(infile, outfile, n, threads, binary, true, prepared);
+}
+
+//
+// Decrypt number c into number m
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  d: private exponent
+//  pq: private modulus
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t pq) {
+    ss_ctx_t ctx;
+    ss_ctx_init_decrypt(&ctx, d, pq, NULL);
+    ss_decrypt_ctx(&ctx, m, c);
+    ss_ctx_clear(&ctx);
+}
+
+//
+// Decrypt number c into number m using the Chinese Remainder Theorem.
+// Does two half-size exponentiations mod p and mod q instead of one mod pq.
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  crt: CRT components of the private key
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(mpz_t m, mpz_t c, ss_crt_t *crt) {
+    ss_ctx_t ctx;
+    ss_ctx_init_decrypt(&ctx, NULL, NULL, crt);
+    ss_decrypt_ctx(&ctx, m, c);
+    ss_ctx_clear(&ctx);
+}
+
+//
+// Decrypt number c into number m with a prepared key
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_decrypt()
+//  c: encrypted integer
+//  all mpz_t arguments to be initialized, m with room for pq to avoid allocating
+//
+void ss_decrypt_ctx(ss_ctx_t *ctx, mpz_t m, mpz_t c) {
+    // c is reduced up front, so the exponentiations never need to allocate for it
+    mpz_mod(ctx->h, c, ctx->modulus);
+    if (!ctx->crt) {
+        mont_powm_scratch(m, ctx->h, &ctx->exp, &ctx->ctx, ctx->scratch);
+        return;
+    }
+
+    //mp = c^dp mod p
+    mont_powm_scratch(ctx->mp, ctx->h, &ctx->exp, &ctx->ctx, ctx->scratch);
+    //mq = c^dq mod q
+    mpz_mod(ctx->h, c, ctx->q);
+    mont_powm_scratch(ctx->mq, ctx->h, &ctx->q_exp, &ctx->q_ctx, ctx->scratch);
+
+    //Garner's recombination: m = mq + q * (qinv * (mp - mq) mod p)
+    mpz_sub(ctx->h, ctx->mp, ctx->mq);
+    mpz_mul(ctx->h, ctx->h, ctx->qinv);
+    mpz_mod(ctx->h, ctx->h, ctx->modulus);
+    mpz_mul(m, ctx->h, ctx->q);
+    mpz_add(m, m, ctx->mq);
+}
+
+// Decrypts c into m and writes m's bytes after the 0xFF to outfile, timing each stage.
+static void decrypt_line(ss_ctx_t *ctx, mpz_t m, mpz_t c, uint8_t *block, FILE *outfile) {
+    // First decrypt c back into its original value m.
+    STATS_START(powm);
+    ss_decrypt_ctx(ctx, m, c);
+    STATS_STOP(STATS_POWM, powm);
+    STATS_ADD(STATS_BLOCKS, 1);
+
+    // Then using mpz_export(), convert m back into bytes, storing them in the allocated block.
+    // Let j be the number of bytes actually converted.
+    // You will want to set the order parameter of mpz_export() to 1 for most significant word first,
+    // 1 for the endian parameter, and 0 for the nails parameter.
+    // mpz_export (*rop, *countp, order, size, endian, nails, const mpz_t op)
+    STATS_START(format);
+    uint64_t j;
+    mpz_export(&block[0], &j, 1, sizeof(uint8_t), 1, 0, m);
+    STATS_STOP(STATS_FORMAT, format);
+
+    // Write out j − 1 bytes starting from index 1 of the block to outfile.
+    // This is because index 0 must be prepended 0xFF. Do not output the 0xFF.
+    // A block of 0 or 1 bytes holds no data; only a wrong key or a damaged file gives one.
+    // size_t fwrite(const void *ptr, size_t size, size_t count, FILE *stream);
+    if (j <= 1) {
+        return;
+    }
+    STATS_START(write);
+    fwrite(&block[1], sizeof(uint8_t), j - 1, outfile);
+    STATS_STOP(STATS_WRITE, write);
+    STATS_ADD(STATS_BYTES_OUT, j - 1);
+}
+
+//
+// Shared decryption loop for ss_decrypt_file(), ss_decrypt_file_crt() and ss_decrypt_file_mt().
+// Uses the CRT path when crt is not NULL, and copies the key from prepared when it is given.
+//
+static void decrypt_file(
+    FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt, const ss_ctx_t *prepared) {
+
+    // Ciphertexts are below n = p * pq, which has at most half again as many bits as pq.
     mpz_t c, m;
-    mpz_inits(c, m, NULL);
+    mpz_init2(c, 2 * mpz_sizeinbase(pq, 2));
+    mpz_init2(m, mpz_sizeinbase(pq, 2));
 
     uint64_t k;
 
-    // Calculate the block size k.
-    k = (mpz_sizeinbase(pq, 2) - 1) / 8;
+    // Calculate the block size k: enough bytes for any m below pq, which a wrong key or a
+    // damaged file can give as well as the k - 1 data bytes after the 0xFF.
+    k = (mpz_sizeinbase(pq, 2) + 7) / 8;
 
     // Dynamically allocate an array that can hold k bytes.
     // This array should be of type (uint8_t *) and
     // will serve as the block.
     uint8_t *block = (uint8_t *) malloc(k * sizeof(uint8_t));
 
+    ss_ctx_t ctx;
+    init_decrypt(&ctx, d, pq, crt, prepared);
+
+    // Regular files are parsed straight out of a memory mapping, one line at a time.
+    mapfile_t map;
+    bool mapped = mapfile_open(&map, infile);
+    const char *text = (const char *) map.data;
+    for (uint64_t start = 0; mapped && start < map.size;) {
+        STATS_START(read);
+        const char *newline = (const char *) memchr(&text[start], '\n', map.size - start);
+        uint64_t end = newline != NULL ? (uint64_t) (newline - text) : map.size;
+        STATS_STOP(STATS_READ, read);
+        STATS_START(import);
+        bool parsed = hex_decode(c, &text[start], end - start);
+        STATS_STOP(STATS_IMPORT, import);
+        STATS_ADD(STATS_BYTES_IN, end - start + 1);
+        if (parsed) {
+            decrypt_line(&ctx, m, c, block, outfile);
+        }
+        start = end + 1;
+    }
+    mapfile_close(&map, infile);
+
     // Iterating over the lines in infile:
-    // && gmp_fscanf(infile, "%ZX\n", c)
-    while (!feof(infile)) {
-        // Scan in a hexstring, saving the hexstring as a mpz_t c.
+    char *line = NULL;
+    size_t capacity = 0;
+    while (!mapped) {
+        // Read in a hexstring line and parse it into c like the mapped loop does.
         // Remember, each block is written as a hexstring with a trailing newline when encrypting a file.
-        gmp_fscanf(infile, "%ZX\n", c);
-
-        // First decrypt c back into its original value m.
-        ss_decrypt(m, c, d, pq);
-        // Then using mpz_export(), convert m back into bytes, storing them in the allocated block.
-        // Let j be the number of bytes actually converted.
-        // You will want to set the order parameter of mpz_export() to 1 for most significant word first,
-        // 1 for the endian parameter, and 0 for the nails parameter.
-        // mpz_export (*rop, *countp, order, size, endian, nails, const mpz_t op)
+        STATS_START(read);
+        ssize_t length = getline(&line, &capacity, infile);
+        STATS_STOP(STATS_READ, read);
+        if (length <= 0) {
+            break;
+        }
+        STATS_START(import);
+        bool parsed = hex_decode(c, line, length - (line[length - 1] == '\n'));
+        STATS_STOP(STATS_IMPORT, import);
+        STATS_ADD(STATS_BYTES_IN, length);
+
+        // Decrypt c back into its original value m and write out its bytes after the 0xFF.
+        if (parsed) {
+            decrypt_line(&ctx, m, c, block, outfile);
+        }
+    }
+
+    ss_ctx_clear(&ctx);
+    mpz_clears(c, m, NULL);
+    free(block);
+    free(line);
+}
+
+//
+// Decrypt a file back into its original form.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent
+//  pq: private modulus
+//
+void ss_decrypt_file(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq) {
+    decrypt_file(infile, outfile, d, pq, NULL, NULL);
+}
+
+//
+// Decrypt a file back into its original form using the Chinese Remainder Theorem.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  pq: private modulus
+//  crt: CRT components of the private key
+//
+void ss_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t pq, ss_crt_t *crt) {
+    decrypt_file(infile, outfile, NULL, pq, crt, NULL);
+}
+
+//
+// One batch of ciphertexts shared between the threads of ss_decrypt_file_mt().
+//
+typedef struct {
+    const char **lines; // hexstrings in the read buffer or mapping, or NULL for records
+    uint64_t *line_lengths; // characters in each line, not counting the newline
+    const uint8_t *records; // fixed-width binary ciphertexts, used when lines is NULL
+    uint32_t width; // bytes per record
+    uint64_t count; // ciphertexts in the batch
+    char *text; // read buffer for hexstrings from an unmapped stream
+    uint64_t text_size;
+    uint8_t *buffer; // read buffer for records from an unmapped stream
+    uint64_t k; // bytes needed to hold any plaintext block
+    uint8_t *blocks; // capacity * k bytes, block i starts at i * k
+    uint64_t *lengths; // bytes exported into each block, 0 if the line was not a number
+    mpz_t *c, *m; // ciphertext and plaintext of each block
+    ss_ctx_t *ctxs; // one prepared key per pool thread
+} decrypt_batch_t;
+
+static void decrypt_block(void *arg, uint64_t index, uint32_t thread) {
+    decrypt_batch_t *batch = (decrypt_batch_t *) arg;
+    mpz_ptr c = batch->c[index], m = batch->m[index];
+
+    batch->lengths[index] = 0;
+    bool parsed = true;
+    STATS_START(import);
+    if (batch->lines != NULL) {
+        parsed = hex_decode(c, batch->lines[index], batch->line_lengths[index]);
+        STATS_ADD(STATS_BYTES_IN, batch->line_lengths[index] + 1);
+    } else {
+        ssbin_unpack(c, &batch->records[index * batch->width], batch->width);
+        STATS_ADD(STATS_BYTES_IN, batch->width);
+    }
+    STATS_STOP(STATS_IMPORT, import);
+    if (parsed) {
+        STATS_START(powm);
+        ss_decrypt_ctx(&batch->ctxs[thread], m, c);
+        STATS_STOP(STATS_POWM, powm);
+        STATS_ADD(STATS_BLOCKS, 1);
+        STATS_START(format);
         uint64_t j;
-        mpz_export(&block[0], &j, 1, sizeof(uint8_t), 1, 0, m);
+        mpz_export(&batch->blocks[index * batch->k], &j, 1, sizeof(uint8_t), 1, 0, m);
+        STATS_STOP(STATS_FORMAT, format);
+        batch->lengths[index] = j;
+    }
+}
+
+//
+// Everything one batched decryption needs, from reading through writing.
+// The plain loop uses a single batch; the pipeline keeps PIPELINE_SLOTS of them in flight.
+//
+typedef struct {
+    FILE *infile, *outfile;
+    uint64_t capacity; // ciphertexts per batch
+    mapfile_t map; // the input, when it is a regular file
+    bool mapped;
+    uint64_t offset; // where the next ciphertext starts in the mapping
+    bool binary;
+    uint32_t width; // bytes per record, binary only
+    uint64_t remaining; // records still to read, binary only
+    char *carry; // partial line left over from the last read of an unmapped stream
+    uint64_t carry_used, carry_size;
+    bool eof;
+    pool_t *pool;
+    decrypt_batch_t *batches;
+} decrypt_run_t;
+
+// grows a buffer to hold at least size bytes, doubling so repeated growth stays cheap
+static void *grow(void *buffer, uint64_t *capacity, uint64_t size) {
+    if (size <= *capacity) {
+        return buffer;
+    }
+    while (*capacity < size) {
+        *capacity = *capacity > 0 ? 2 * *capacity : size;
+    }
+    return realloc(buffer, *capacity);
+}
+
+// reads the next batch of ciphertext lines, returns true once the input is used up
+static bool decrypt_read_lines(decrypt_run_t *run, decrypt_batch_t *batch) {
+    uint64_t count = 0;
+
+    // A mapped file is split in place, one line per ciphertext.
+    if (run->mapped) {
+        const char *text = (const char *) run->map.data;
+        uint64_t size = run->map.size;
+        while (count < run->capacity && run->offset < size) {
+            const char *newline
+                = (const char *) memchr(&text[run->offset], '\n', size - run->offset);
+            // the last line may have no trailing newline
+            uint64_t end = newline != NULL ? (uint64_t) (newline - text) : size;
+            batch->lines[count] = &text[run->offset];
+            batch->line_lengths[count++] = end - run->offset;
+            run->offset = end + 1;
+        }
+        batch->count = count;
+        return run->offset >= size;
+    }
+
+    // Otherwise start from the partial line the last read left over and top up from the stream.
+    batch->text = (char *) grow(batch->text, &batch->text_size, run->carry_used + 1);
+    memcpy(batch->text, run->carry, run->carry_used);
+    uint64_t used = run->carry_used, start = 0;
+    while (true) {
+        // fread() only comes up short at end of file or on error.
+        if (!run->eof && used < batch->text_size) {
+            uint64_t want = batch->text_size - used;
+            uint64_t r = fread(&batch->text[used], sizeof(char), want, run->infile);
+            run->eof = r < want;
+            used += r;
+        }
+
+        // Split off as many complete lines as fit in one batch.
+        while (count < run->capacity && start < used) {
+            const char *newline = (const char *) memchr(&batch->text[start], '\n', used - start);
+            if (newline == NULL) {
+                break;
+            }
+            batch->lines[count] = &batch->text[start];
+            batch->line_lengths[count++] = newline - &batch->text[start];
+            start = newline - batch->text + 1;
+        }
+
+        if (count > 0) {
+            break;
+        }
+        if (!run->eof) {
+            // A single line longer than the buffer: make room and keep reading.
+            batch->text = (char *) grow(batch->text, &batch->text_size, 2 * batch->text_size);
+            continue;
+        }
+        if (start < used) {
+            // The last line had no trailing newline.
+            batch->lines[count] = &batch->text[start];
+            batch->line_lengths[count++] = used - start;
+            start = used;
+        }
+        break;
+    }
+
+    // Whatever was not split off waits for the next batch.
+    run->carry = (char *) grow(run->carry, &run->carry_size, used - start);
+    memcpy(run->carry, &batch->text[start], used - start);
+    run->carry_used = used - start;
+    batch->count = count;
+    return run->eof && run->carry_used == 0;
+}
 
-        // Write out j − 1 bytes starting from index 1 of the block to outfile.
-        // This is because index 0 must be prepended 0xFF. Do not output the 0xFF.
-        // size_t fwrite(const void *ptr, size_t size, size_t count, FILE *stream);
-        fwrite(&block[1], sizeof(uint8_t), j - 1, outfile);
+// reads the next batch of container records, returns true once the input is used up
+static bool decrypt_read_records(decrypt_run_t *run, decrypt_batch_t *batch) {
+    // With an unknown count, records simply run until the end of the file.
+    uint64_t want = run->remaining < run->capacity ? run->remaining : run->capacity;
+    uint64_t count;
+    if (run->mapped) {
+        uint64_t available = (run->map.size - run->offset) / run->width;
+        count = want < available ? want : available;
+        batch->records = &run->map.data[run->offset];
+        run->offset += count * run->width;
+    } else {
+        count = fread(batch->buffer, run->width, want, run->infile);
+        batch->records = batch->buffer;
     }
+    run->remaining -= count;
+    batch->count = count;
+    return count < want || run->remaining == 0;
+}
+
+static bool decrypt_read(void *arg, uint32_t slot) {
+    decrypt_run_t *run = (decrypt_run_t *) arg;
+    STATS_START(read);
+    bool last = run->binary ? decrypt_read_records(run, &run->batches[slot])
+                            : decrypt_read_lines(run, &run->batches[slot]);
+    STATS_STOP(STATS_READ, read);
+    return last;
+}
 
+static void decrypt_compute(void *arg, uint32_t slot) {
+    decrypt_run_t *run = (decrypt_run_t *) arg;
+    pool_run(run->pool, decrypt_block, &run->batches[slot], run->batches[slot].count);
+}
+
+// writes the plaintexts of a batch back in their original order, dropping the leading 0xFF
+static void decrypt_write(void *arg, uint32_t slot) {
+    decrypt_run_t *run = (decrypt_run_t *) arg;
+    decrypt_batch_t *batch = &run->batches[slot];
+    STATS_START(write);
+    for (uint64_t i = 0; i < batch->count; i++) {
+        if (batch->lengths[i] > 1) {
+            fwrite(&batch->blocks[i * batch->k + 1], sizeof(uint8_t), batch->lengths[i] - 1,
+                run->outfile);
+            STATS_ADD(STATS_BYTES_OUT, batch->lengths[i] - 1);
+        }
+    }
+    STATS_STOP(STATS_WRITE, write);
+}
+
+//
+// Shared batch loop for ss_decrypt_file_mt(), ss_decrypt_file_bin() and ss_decrypt_file_pipe().
+// Reads hexstring lines, or the records of a binary container whose header has already been read
+// if header is given. With pipelined set, reading and writing run on their own threads,
+// overlapping with the exponentiations. Returns false, having written nothing, if the buffers
+// for a batch cannot be allocated.
+//
+static bool decrypt_file_batched(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, ssbin_header_t *header, bool pipelined, const ss_ctx_t *prepared) {
+    decrypt_run_t run;
+    run.infile = infile;
+    run.outfile = outfile;
+    run.capacity = (uint64_t) (threads > 0 ? threads : 1) * BLOCKS_PER_THREAD;
+    run.binary = header != NULL;
+    run.width = header != NULL ? header->width : 0;
+    run.remaining = header != NULL ? header->count : 0;
+    run.eof = false;
+    run.pool = pool_create(threads);
+
+    // one prepared key per pool thread, shared by every batch; the rest copy the first
+    ss_ctx_t *ctxs = (ss_ctx_t *) malloc(pool_threads(run.pool) * sizeof(ss_ctx_t));
+    init_decrypt(&ctxs[0], d, pq, crt, prepared);
+    for (uint32_t t = 1; t < pool_threads(run.pool); t++) {
+        ss_ctx_init_copy(&ctxs[t], &ctxs[0]);
+    }
+
+    // Ciphertexts are below n = p * pq, so a line has at most about twice as many hex digits
+    // as pq has bytes; size the read buffers for a batch of lines.
+    uint64_t line = (2 * mpz_sizeinbase(pq, 2) + 3) / 4 + 1;
+    run.carry_size = line;
+    run.carry_used = 0;
+    run.carry = (char *) malloc(run.carry_size);
+
+    uint32_t slots = pipelined ? PIPELINE_SLOTS : 1;
+    run.batches = (decrypt_batch_t *) calloc(slots, sizeof(decrypt_batch_t));
+    bool allocated = run.carry != NULL && run.batches != NULL;
+    for (uint32_t s = 0; allocated && s < slots; s++) {
+        decrypt_batch_t *batch = &run.batches[s];
+        batch->lines = run.binary ? NULL : (const char **) malloc(run.capacity * sizeof(char *));
+        batch->line_lengths = (uint64_t *) malloc(run.capacity * sizeof(uint64_t));
+        batch->records = NULL;
+        batch->width = run.width;
+        batch->text_size = run.binary ? 0 : run.capacity * line;
+        batch->text = (char *) malloc(batch->text_size);
+        batch->buffer = (uint8_t *) malloc(run.capacity * run.width * sizeof(uint8_t));
+        batch->k = (mpz_sizeinbase(pq, 2) + 7) / 8;
+        batch->blocks = (uint8_t *) malloc(run.capacity * batch->k * sizeof(uint8_t));
+        batch->lengths = (uint64_t *) malloc(run.capacity * sizeof(uint64_t));
+        batch->c = (mpz_t *) malloc(run.capacity * sizeof(mpz_t));
+        batch->m = (mpz_t *) malloc(run.capacity * sizeof(mpz_t));
+        batch->ctxs = ctxs;
+        allocated = (run.binary ? batch->buffer != NULL : batch->lines && batch->text)
+            && batch->line_lengths && batch->blocks && batch->lengths && batch->c && batch->m;
+        if (!allocated) {
+            // only the numbers of fully allocated batches are initialized
+            free(batch->c);
+            free(batch->m);
+            batch->c = batch->m = NULL;
+            break;
+        }
+        for (uint64_t i = 0; i < run.capacity; i++) {
+            mpz_init2(batch->c[i], 2 * mpz_sizeinbase(pq, 2));
+            mpz_init2(batch->m[i], mpz_sizeinbase(pq, 2));
+        }
+    }
+
+    if (allocated) {
+        // Regular files are parsed straight out of a memory mapping.
+        run.mapped = mapfile_open(&run.map, infile);
+        run.offset = 0;
+
+        if (pipelined) {
+            pipeline_t pipeline
+                = { PIPELINE_SLOTS, &run, decrypt_read, decrypt_compute, decrypt_write };
+            pipeline_run(&pipeline);
+        } else {
+            bool last = false;
+            while (!last) {
+                last = decrypt_read(&run, 0);
+                decrypt_compute(&run, 0);
+                decrypt_write(&run, 0);
+            }
+        }
+        mapfile_close(&run.map, infile);
+    }
+
+    for (uint32_t t = 0; t < pool_threads(run.pool); t++) {
+        ss_ctx_clear(&ctxs[t]);
+    }
+    pool_delete(&run.pool);
+    for (uint32_t s = 0; run.batches != NULL && s < slots; s++) {
+        decrypt_batch_t *batch = &run.batches[s];
+        for (uint64_t i = 0; batch->c != NULL && i < run.capacity; i++) {
+            mpz_clears(batch->c[i], batch->m[i], NULL);
+        }
+        free(batch->c);
+        free(batch->m);
+        free(batch->lengths);
+        free(batch->blocks);
+        free(batch->buffer);
+        free(batch->text);
+        free(batch->line_lengths);
+        free(batch->lines);
+    }
+    free(run.batches);
+    free(run.carry);
+    free(ctxs);
+    return allocated;
+}
+
+//
+// Decrypt a file back into its original form on multiple threads.
+// The input is split into chunks at newline boundaries and the lines are decrypted in parallel.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+void ss_decrypt_file_mt(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, const ss_ctx_t *prepared) {
+    if (threads <= 1) {
+        decrypt_file(infile, outfile, d, pq, crt, prepared);
+        return;
+    }
+    decrypt_file_batched(infile, outfile, d, pq, crt, threads, NULL, false, prepared);
+}
+
+// reads a container header, returns false if it is invalid or was written for a different key:
+// the record width and block size must be the ones the key gives
+static bool read_container(ssbin_header_t *header, FILE *infile, mpz_t pq, ss_crt_t *crt) {
+    if (!ssbin_read_header(header, infile)) {
+        return false;
+    }
+    if (crt == NULL) {
+        // Without p, n = p * pq is unknown, but pq < n < pq^2 bounds the record width, and
+        // blocks are below sqrt(n) < pq.
+        uint64_t bits = mpz_sizeinbase(pq, 2);
+        return header->width >= (bits + 7) / 8 && header->width <= 2 * ((bits + 7) / 8)
+            && header->k >= 2 && header->k <= (bits - 1) / 8;
+    }
+    mpz_t n;
+    mpz_init(n);
+    mpz_mul(n, crt->p, pq);
+    bool match = ssbin_fingerprint(n) == header->fingerprint && header->width == ssbin_width(n)
+        && header->k == block_size(n);
+    mpz_clear(n);
+    return match;
+}
+
+//
+// Decrypt a binary ciphertext container (see ssbin.h) back into its original form.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if the header is invalid or was written for a different key, or there is not
+//  enough memory for the record buffers
+//
+// Requires:
+//  infile: open and readable file stream to a binary container
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d.
+//       The key fingerprint can only be checked when crt is given, since n = p * pq.
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_bin(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, const ss_ctx_t *prepared) {
+    ssbin_header_t header;
+    if (!read_container(&header, infile, pq, crt)) {
+        return false;
+    }
+    return decrypt_file_batched(infile, outfile, d, pq, crt, threads, &header, false, prepared);
+}
+
+//
+// Decrypt a file through a reader/compute/writer pipeline (see pipeline.h).
+// A reader thread parses ciphertexts and a writer thread writes plaintexts while the pool
+// computes, with a fixed number of batches in flight. Works on pipes as well as regular files.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if binary is set and the container header is invalid or for a different key
+//  or if there is not enough memory for the batch buffers
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  threads: number of compute threads to use, at least 1
+//  binary: infile is a binary ciphertext container instead of hexstrings
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_pipe(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, bool binary, const ss_ctx_t *prepared) {
+    ssbin_header_t header;
+    if (binary && !read_container(&header, infile, pq, crt)) {
+        return false;
+    }
+    return decrypt_file_batched(
+        infile, outfile, d, pq, crt, threads, binary ? &header : NULL, true, prepared);
+}
+
+//
+// A ciphertext file mapped for decrypting single blocks out of order, by ss_decrypt_range().
+//
+typedef struct {
+    mapfile_t map;
+    ssindex_t *index; // line offsets of a hexstring file, or NULL for container records
+    uint32_t width; // bytes per record, records only
+    ss_ctx_t ctx;
+    mpz_t c, m;
+    uint8_t *block; // the last block decrypted
+    uint64_t decrypted; // which block that is, UINT64_MAX before the first one
+    uint64_t length; // its plaintext bytes after the 0xFF
+    bool parsed; // whether that block was a number
+} range_t;
+
+// Decrypts block i into r->block and sets length to its plaintext bytes after the 0xFF.
+// Returns false if the block is not a number, which would shift every byte after it.
+static bool range_block(range_t *r, uint64_t i, uint64_t *length) {
+    if (r->decrypted == i) {
+        *length = r->length;
+        return r->parsed;
+    }
+    bool parsed = true;
+    STATS_START(import);
+    if (r->index != NULL) {
+        // The span up to the next indexed line also holds any blank lines after this one, so
+        // the line ends at its own newline.
+        uint64_t start = r->index->offsets[i], end = r->index->offsets[i + 1];
+        const char *text = (const char *) &r->map.data[start];
+        const char *newline = (const char *) memchr(text, '\n', end - start);
+        uint64_t line = newline != NULL ? (uint64_t) (newline - text) : end - start;
+        parsed = hex_decode(r->c, text, line);
+        STATS_ADD(STATS_BYTES_IN, end - start);
+    } else {
+        ssbin_unpack(r->c, &r->map.data[i * r->width], r->width);
+        STATS_ADD(STATS_BYTES_IN, r->width);
+    }
+    STATS_STOP(STATS_IMPORT, import);
+
+    uint64_t j = 0;
+    if (parsed) {
+        STATS_START(powm);
+        ss_decrypt_ctx(&r->ctx, r->m, r->c);
+        STATS_STOP(STATS_POWM, powm);
+        STATS_ADD(STATS_BLOCKS, 1);
+        STATS_START(format);
+        mpz_export(r->block, &j, 1, sizeof(uint8_t), 1, 0, r->m);
+        STATS_STOP(STATS_FORMAT, format);
+    }
+    r->decrypted = i;
+    r->length = j > 0 ? j - 1 : 0;
+    r->parsed = parsed;
+    *length = r->length;
+    return parsed;
+}
+
+//
+// Decrypt only the plaintext bytes [start, start + length) of a hexstring file or a binary
+// container, reading and decrypting just the blocks that cover them. Every block but the last
+// holds the same number of plaintext bytes, so block i covers bytes from i times that size on.
+// The range is clipped at the end of the plaintext.
+//
+// Provides:
+//  fills outfile with the requested plaintext bytes
+//  returns false if the container header is invalid or for a different key, if the file
+//  changed since index was built, or if a block that is needed is not a number
+//
+// Requires:
+//  infile: open and readable regular file, at the start of its hexstrings or container header
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  index: line offsets of infile from ssindex_open(), or NULL if infile is a binary container
+//  start: first plaintext byte to decrypt
+//  length: number of plaintext bytes to decrypt
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_range(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    ssindex_t *index, uint64_t start, uint64_t length, const ss_ctx_t *prepared) {
+    range_t r;
+    r.index = index;
+    r.width = 0;
+    ssbin_header_t header;
+    if (index == NULL && (!read_container(&header, infile, pq, crt) || header.k < 2)) {
+        return false;
+    }
+    // An empty file or container does not map, and has no blocks.
+    mapfile_open(&r.map, infile);
+    uint64_t count;
+    if (index != NULL) {
+        if (r.map.size != index->size) {
+            mapfile_close(&r.map, infile);
+            return false;
+        }
+        count = index->count;
+    } else {
+        r.width = header.width;
+        count = r.map.size / r.width;
+        count = header.count < count ? header.count : count;
+    }
+
+    // Plaintexts are below pq, and ciphertexts below n = p * pq.
+    mpz_init2(r.c, 2 * mpz_sizeinbase(pq, 2));
+    mpz_init2(r.m, mpz_sizeinbase(pq, 2));
+    r.block = (uint8_t *) malloc((mpz_sizeinbase(pq, 2) + 7) / 8);
+    r.decrypted = UINT64_MAX;
+    r.length = 0;
+    r.parsed = false;
+    init_decrypt(&r.ctx, d, pq, crt, prepared);
+
+    // The bytes in a full block come from the container header, from n with the CRT components,
+    // or failing both from the first block, which is full whenever another block follows it.
+    uint64_t full = 0;
+    bool ok = true;
+    if (index == NULL) {
+        full = header.k - 1;
+    } else if (crt != NULL) {
+        mpz_t n;
+        mpz_init(n);
+        mpz_mul(n, crt->p, pq);
+        full = block_size(n) - 1;
+        mpz_clear(n);
+    } else if (count > 0) {
+        ok = range_block(&r, 0, &full);
+    }
+    // Without a block size, no block after the first can be found.
+    ok = ok && (full > 0 || count <= 1);
+
+    uint64_t end = length < UINT64_MAX - start ? start + length : UINT64_MAX;
+    for (uint64_t i = full > 0 ? start / full : count; ok && i < count && i * full < end; i++) {
+        uint64_t j;
+        ok = range_block(&r, i, &j);
+        // the part of [start, end) inside this block's bytes [i * full, i * full + j)
+        uint64_t first = start > i * full ? start - i * full : 0;
+        uint64_t last = end - i * full < j ? end - i * full : j;
+        if (ok && first < last) {
+            STATS_START(write);
+            fwrite(&r.block[1 + first], sizeof(uint8_t), last - first, outfile);
+            STATS_STOP(STATS_WRITE, write);
+            STATS_ADD(STATS_BYTES_OUT, last - first);
+        }
+    }
+
+    mapfile_close(&r.map, infile);
+    ss_ctx_clear(&r.ctx);
+    mpz_clears(r.c, r.m, NULL);
+    free(r.block);
+    return ok;
+}
+
+// fills out with length bytes from the kernel's random source, returns false if it failed
+static bool random_bytes(uint8_t *out, size_t length) {
+    while (length > 0) {
+        ssize_t got = getrandom(out, length, 0);
+        if (got < 0) {
+            return false;
+        }
+        out += got;
+        length -= got;
+    }
+    return true;
+}
+
+// nonce of chunk index of the hybrid payload, flagged when it is the last one so that
+// truncation at a chunk boundary is caught
+static void hybrid_nonce(uint8_t nonce[AEAD_NONCE_BYTES], uint64_t index, bool last) {
+    memset(nonce, 0, AEAD_NONCE_BYTES);
+    for (int i = 0; i < 8; i++) {
+        nonce[i] = index >> (8 * i);
+    }
+    nonce[AEAD_NONCE_BYTES - 1] = last;
+}
+
+//
+// Encrypt an arbitrary file in hybrid mode: a fresh session key is SS-encrypted and the data
+// itself is streamed through ChaCha20-Poly1305 (see aead.h) under that key.
+//
+// Provides:
+//  fills outfile with the hybrid header, the wrapped session key and the sealed chunks
+//  returns false if no random session key could be drawn
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+bool ss_encrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t n, const ss_ctx_t *prepared) {
+    uint8_t key[AEAD_KEY_BYTES];
+    if (!random_bytes(key, sizeof(key))) {
+        return false;
+    }
+
+    // The session key is split into blocks exactly as ss_encrypt_file() would split it.
+    ss_ctx_t ctx;
+    init_encrypt(&ctx, n, prepared);
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    uint64_t k = ctx.k;
+    uint64_t blocks = sizeof(key) / (k - 1) + 1;
+    char *text = (char *) malloc(mpz_sizeinbase(n, 16) + 1);
+    fprintf(outfile, "%s %d %lu\n", SS_HYBRID_MAGIC, SS_HYBRID_VERSION, (unsigned long) blocks);
+    for (uint64_t offset = 0; offset <= sizeof(key); offset += k - 1) {
+        uint64_t j = sizeof(key) - offset < k - 1 ? sizeof(key) - offset : k - 1;
+        import_block(m, &key[offset], j);
+        ss_encrypt_ctx(&ctx, c, m);
+        fwrite(text, sizeof(char), format_hex(text, c), outfile);
+    }
+    ss_ctx_clear(&ctx);
+    mpz_clears(m, c, NULL);
+    free(text);
+
+    // Every chunk but the last is full, so a short chunk marks the end.
+    uint8_t *chunk = (uint8_t *) malloc(SS_HYBRID_CHUNK + AEAD_TAG_BYTES);
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    bool last = false;
+    for (uint64_t index = 0; !last; index++) {
+        uint64_t j = fread(chunk, sizeof(uint8_t), SS_HYBRID_CHUNK, infile);
+        last = j < SS_HYBRID_CHUNK;
+        hybrid_nonce(nonce, index, last);
+        aead_seal(chunk, &chunk[j], chunk, j, NULL, 0, key, nonce);
+        fwrite(chunk, sizeof(uint8_t), j + AEAD_TAG_BYTES, outfile);
+    }
+    free(chunk);
+    return true;
+}
+
+//
+// Decrypt a file written by ss_encrypt_file_hybrid().
+// Each chunk is checked before it is written, so output stops at the first chunk that fails.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if the header is invalid, the session key does not decrypt with this key,
+//  or a chunk fails authentication
+//
+// Requires:
+//  infile: open and readable file stream to hybrid ciphertext
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    const ss_ctx_t *prepared) {
+    // The header and the wrapped key are text lines; the binary payload follows directly.
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, infile);
+    char magic[16];
+    int version;
+    unsigned long blocks;
+    bool ok = length > 0 && sscanf(line, "%15s %d %lu", magic, &version, &blocks) == 3
+        && strcmp(magic, SS_HYBRID_MAGIC) == 0 && version == SS_HYBRID_VERSION
+        && blocks >= 1 && blocks <= AEAD_KEY_BYTES + 1;
+
+    // Unwrap the session key, dropping the 0xFF in front of every block.
+    uint8_t key[AEAD_KEY_BYTES];
+    uint64_t used = 0;
+    mpz_t c, m;
+    mpz_init2(c, 2 * mpz_sizeinbase(pq, 2));
+    mpz_init2(m, mpz_sizeinbase(pq, 2));
+    uint8_t *block = (uint8_t *) malloc((mpz_sizeinbase(pq, 2) + 7) / 8);
+    ss_ctx_t ctx;
+    init_decrypt(&ctx, d, pq, crt, prepared);
+    for (unsigned long b = 0; ok && b < blocks; b++) {
+        length = getline(&line, &capacity, infile);
+        ok = length > 0 && hex_decode(c, line, length - (line[length - 1] == '\n'));
+        if (ok) {
+            ss_decrypt_ctx(&ctx, m, c);
+            uint64_t j = (mpz_sizeinbase(m, 2) + 7) / 8;
+            ok = j >= 1 && j - 1 <= sizeof(key) - used;
+        }
+        if (ok) {
+            uint64_t j;
+            mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, m);
+            ok = block[0] == 0xFF;
+            memcpy(&key[used], &block[1], j - 1);
+            used += j - 1;
+        }
+    }
+    ok = ok && used == sizeof(key);
+    ss_ctx_clear(&ctx);
     mpz_clears(c, m, NULL);
     free(block);
+    free(line);
+
+    // A read shorter than a full chunk and its tag is the last chunk.
+    uint8_t *chunk = (uint8_t *) malloc(SS_HYBRID_CHUNK + AEAD_TAG_BYTES);
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    bool last = false;
+    for (uint64_t index = 0; ok && !last; index++) {
+        uint64_t j = fread(chunk, sizeof(uint8_t), SS_HYBRID_CHUNK + AEAD_TAG_BYTES, infile);
+        if (j < AEAD_TAG_BYTES) {
+            ok = false;
+            break;
+        }
+        last = j < SS_HYBRID_CHUNK + AEAD_TAG_BYTES;
+        j -= AEAD_TAG_BYTES;
+        hybrid_nonce(nonce, index, last);
+        ok = aead_open(chunk, chunk, j, &chunk[j], NULL, 0, key, nonce);
+        if (ok) {
+            fwrite(chunk, sizeof(uint8_t), j, outfile);
+        }
+    }
+    free(chunk);
+    return ok;
 }
 
 // int main(void) {
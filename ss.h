@@ -5,8 +5,90 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#include "mont.h"
+#include "montvec.h"
+#include "ssindex.h"
+
+//
+// Values needed for Chinese Remainder Theorem decryption with an SS private key.
+//
+typedef struct {
+    mpz_t p; // first prime
+    mpz_t q; // second prime
+    mpz_t dp; // d mod (p - 1)
+    mpz_t dq; // d mod (q - 1)
+    mpz_t qinv; // q^-1 mod p
+} ss_crt_t;
+
+//
+// Initializes all mpz_t members of a CRT key.
+//
+void ss_crt_init(ss_crt_t *crt);
+
+//
+// Frees all mpz_t members of a CRT key.
+//
+void ss_crt_clear(ss_crt_t *crt);
+
+//
+// A key prepared for encrypting or decrypting many blocks.
+// Owns the Montgomery contexts and exponent recodings for the key, plus scratch sized to it,
+// so ss_encrypt_ctx() and ss_decrypt_ctx() make no heap allocations once it is set up.
+// Not safe to share between threads; give each thread its own.
+//
+typedef struct {
+    bool crt; // decrypting with the CRT components
+    uint64_t k; // bytes per plaintext block, encrypting only
+    mont_t ctx; // n when encrypting, pq or p when decrypting
+    mont_exp_t exp; // n, d or dp
+    mont_t q_ctx; // q, with crt only
+    mont_exp_t q_exp; // dq, with crt only
+    mpz_t modulus; // the modulus of ctx
+    mpz_t q, qinv; // CRT components, with crt only
+    mpz_t h, mp, mq; // temporaries
+    mp_limb_t *scratch; // limbs for mont_powm_scratch()
+    montvec_t vec; // multi-buffer exponentiation by n, encrypting only
+} ss_ctx_t;
+
+//
+// Prepares a context for encrypting with a public key.
+//
+// Requires:
+//  ctx: the context to initialize
+//  n: public exponent/modulus
+//
+void ss_ctx_init_encrypt(ss_ctx_t *ctx, mpz_t n);
+
+//
+// Prepares a context for decrypting with a private key.
+//
+// Requires:
+//  ctx: the context to initialize
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//
+void ss_ctx_init_decrypt(ss_ctx_t *ctx, mpz_t d, mpz_t pq, ss_crt_t *crt);
+
+//
+// Prepares a context for the same key as another by copying everything derived from the key,
+// instead of deriving it again.
+//
+// Requires:
+//  ctx: the context to initialize
+//  src: a prepared context, or a view of one with only crt, k, modulus, q, qinv, ctx, exp, q_ctx,
+//   q_exp and vec filled in, where q_ctx and q_exp are unused without crt
+//
+void ss_ctx_init_copy(ss_ctx_t *ctx, const ss_ctx_t *src);
+
+//
+// Frees everything owned by a context.
+//
+void ss_ctx_clear(ss_ctx_t *ctx);
+
 //
 // Generates the components for a new SS key.
+// Draws from the global random state and random(), see randstate.h; ss_make_pub_r() does not.
 //
 // Provides:
 //  p:  first prime
@@ -20,6 +102,63 @@
 //
 void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 
+//
+// Generates the components for a new SS key, optionally with the incremental prime search.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  interval: width of each sieved interval for make_prime_search(), 0 for make_prime()
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_search(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint64_t interval);
+
+//
+// Generates the components for a new SS key, drawing only from the given random state.
+// Unlike ss_make_pub(), this is safe to call on several threads at once, each with its own rng.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  interval: width of each sieved interval for make_prime_search_r(), 0 for make_prime_r()
+//  rng: random state used by this thread only, see randstate.h
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_r(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint64_t interval,
+    gmp_randstate_t rng);
+
+//
+// Generates the components for a new SS key, searching for p and q at the same time.
+// Each thread draws from its own random stream derived from seed, and every retry from fresh
+// ones, so the same seed and thread count always give the same key.
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check
+//  threads: number of threads, split between the p and q searches
+//  seed: seed the per-thread random streams are derived from
+//  randstate_init() to have been called, for the choice of p's size
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_mt(
+    mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters, uint32_t threads, uint64_t seed);
+
 //
 // Generates components for a new SS private key.
 //
@@ -34,6 +173,20 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 //
 void ss_make_priv(mpz_t d, mpz_t pq, mpz_t p, mpz_t q);
 
+//
+// Generates the CRT components of an SS private key.
+//
+// Provides:
+//  crt: p, q, d mod (p - 1), d mod (q - 1) and q^-1 mod p
+//
+// Requires:
+//  d: private exponent
+//  p: first prime number
+//  q: second prime number
+//  crt: initialized with ss_crt_init()
+//
+void ss_make_crt(ss_crt_t *crt, mpz_t d, mpz_t p, mpz_t q);
+
 //
 // Export SS public key to output stream
 //
@@ -54,6 +207,18 @@ void ss_write_pub(mpz_t n, char username[], FILE *pbfile);
 //
 void ss_write_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 
+//
+// Export extended SS private key to output stream.
+// The first two lines are identical to ss_write_priv(), so older readers still work.
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components from ss_make_crt()
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_crt(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile);
+
 //
 // Import SS public key from input stream
 //
@@ -81,6 +246,138 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile);
 //
 void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 
+//
+// Import SS private key from input stream, including the CRT components if present
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components, only valid if true is returned
+//  returns true if the key is in the extended format, false for a plain two-line key
+//
+// Requires:
+//  pvfile: open and readable file stream
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_priv_crt(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile);
+
+//
+// Binary key files, an alternative to the hexstring ones that loads with one read and no parsing.
+//
+// An 8-byte header, the key's fields, then the 64-bit FNV-1a of everything before it.
+// All integers are big-endian.
+//
+//  offset  size  field
+//       0     4  magic "SSKB"
+//       4     2  version
+//       6     1  kind, SS_KEY_PUBLIC or SS_KEY_PRIVATE
+//       7     1  number of fields
+//
+// Each field is a 4-byte count followed by that many 8-byte limbs of a number, most significant
+// first, or by that many bytes of the username. A public key holds n and the username; a
+// private key holds pq, d, p, q, d mod (p - 1), d mod (q - 1) and q^-1 mod p.
+// Hexstring keys start with a hex digit, so one byte tells the two formats apart.
+//
+#define SS_KEY_MAGIC   "SSKB"
+#define SS_KEY_VERSION 1
+#define SS_KEY_PUBLIC  0
+#define SS_KEY_PRIVATE 1
+
+//
+// Checks whether a key file is in the binary format, without consuming any of it.
+//
+// Requires:
+//  keyfile: open and readable file stream
+//
+bool ss_key_is_bin(FILE *keyfile);
+
+//
+// Export SS public key to output stream in the binary format
+//
+// Requires:
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  pbfile: open and writable file stream
+//
+void ss_write_pub_bin(mpz_t n, char username[], FILE *pbfile);
+
+//
+// Export SS private key and its CRT components to output stream in the binary format
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components from ss_make_crt()
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile);
+
+//
+// Import SS public key in the binary format from input stream
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  returns false if the file is truncated, damaged, not a public key, or the name does not fit
+//
+// Requires:
+//  username_size: bytes of room in username
+//  pbfile: open and readable file stream
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_pub_bin(mpz_t n, char username[], size_t username_size, FILE *pbfile);
+
+//
+// Import SS public key in the binary format from memory, such as one entry of a keyring
+//
+// Provides:
+//  n: public modulus
+//  username: $USER of the pubkey creator
+//  returns false if the key is truncated, damaged, not a public key, or the name does not fit
+//
+// Requires:
+//  username_size: bytes of room in username
+//  key: the whole key as ss_write_pub_bin() wrote it
+//  length: bytes in key
+//  all mpz_t arguments to be initialized
+//
+bool ss_load_pub_bin(
+    mpz_t n, char username[], size_t username_size, const uint8_t *key, size_t length);
+
+//
+// Import SS private key and its CRT components in the binary format from input stream
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components
+//  returns false if the file is truncated, damaged or not a private key
+//
+// Requires:
+//  pvfile: open and readable file stream
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool ss_read_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, FILE *pvfile);
+
+//
+// Import SS private key and its CRT components in the binary format from memory
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  crt: CRT components
+//  returns false if the key is truncated, damaged or not a private key
+//
+// Requires:
+//  key: the whole key as ss_write_priv_bin() wrote it
+//  length: bytes in key
+//  crt: initialized with ss_crt_init()
+//  all mpz_t arguments to be initialized
+//
+bool ss_load_priv_bin(mpz_t pq, mpz_t d, ss_crt_t *crt, const uint8_t *key, size_t length);
+
 //
 // Encrypt number m into number c
 //
@@ -94,6 +391,48 @@ void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 //
 void ss_encrypt(mpz_t c, mpz_t m, mpz_t n);
 
+//
+// Encrypt number m into number c with a prepared key
+//
+// Provides:
+//  c: encrypted integer
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_encrypt()
+//  m: original integer, below the square root of n like the blocks of ss_encrypt_file()
+//  all mpz_t arguments to be initialized, c with room for n to avoid allocating
+//
+void ss_encrypt_ctx(ss_ctx_t *ctx, mpz_t c, mpz_t m);
+
+//
+// Encrypt a batch of numbers, several at a time in SIMD lanes when the CPU supports it
+// (see montvec.h). The results are identical to calling ss_encrypt() on each one.
+//
+// Provides:
+//  c: count encrypted integers
+//
+// Requires:
+//  m: count original integers
+//  count: number of integers
+//  n: public exponent/modulus
+//  all mpz_t arguments to be initialized
+//
+void ss_encrypt_batch(mpz_t c[], mpz_t m[], uint64_t count, mpz_t n);
+
+//
+// Encrypt a batch of numbers with a prepared key
+//
+// Provides:
+//  c: count encrypted integers
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_encrypt()
+//  m: count original integers
+//  count: number of integers, ideally a multiple of ctx->vec.lanes
+//  all mpz_t arguments to be initialized, c with room for n to avoid allocating
+//
+void ss_encrypt_batch_ctx(ss_ctx_t *ctx, mpz_t c[], mpz_t m[], uint64_t count);
+
 //
 // Encrypt an arbitrary file
 //
@@ -107,6 +446,59 @@ void ss_encrypt(mpz_t c, mpz_t m, mpz_t n);
 //
 void ss_encrypt_file(FILE *infile, FILE *outfile, mpz_t n);
 
+//
+// Encrypt an arbitrary file on multiple threads
+//
+// Provides:
+//  fills outfile with the encrypted contents of infile, identical to ss_encrypt_file()
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_mt(
+    FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, const ss_ctx_t *prepared);
+
+//
+// Encrypt an arbitrary file into a binary ciphertext container (see ssbin.h)
+//
+// Provides:
+//  fills outfile with a container header and one fixed-width record per block
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream, seekable if the block count should be recorded
+//  n: public exponent and modulus
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_bin(
+    FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, const ss_ctx_t *prepared);
+
+//
+// Encrypt an arbitrary file through a reader/compute/writer pipeline (see pipeline.h).
+// Reading and writing overlap with the exponentiations; works on pipes as well as regular files.
+//
+// Provides:
+//  fills outfile with the same output as ss_encrypt_file_mt() or ss_encrypt_file_bin()
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  threads: number of compute threads to use, at least 1
+//  binary: write a binary ciphertext container instead of hexstrings
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+void ss_encrypt_file_pipe(FILE *infile, FILE *outfile, mpz_t n, uint32_t threads, bool binary,
+    const ss_ctx_t *prepared);
+
 //
 // Decrypt number c into number m
 //
@@ -121,6 +513,33 @@ void ss_encrypt_file(FILE *infile, FILE *outfile, mpz_t n);
 //
 void ss_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t pq);
 
+//
+// Decrypt number c into number m using the Chinese Remainder Theorem.
+// Does two half-size exponentiations mod p and mod q instead of one mod pq.
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  crt: CRT components of the private key
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(mpz_t m, mpz_t c, ss_crt_t *crt);
+
+//
+// Decrypt number c into number m with a prepared key
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  ctx: prepared with ss_ctx_init_decrypt()
+//  c: encrypted integer
+//  all mpz_t arguments to be initialized, m with room for pq to avoid allocating
+//
+void ss_decrypt_ctx(ss_ctx_t *ctx, mpz_t m, mpz_t c);
+
 //
 // Decrypt a file back into its original form.
 //
@@ -134,3 +553,160 @@ void ss_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t pq);
 //  pq: private modulus
 //
 void ss_decrypt_file(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq);
+
+//
+// Decrypt a file back into its original form using the Chinese Remainder Theorem.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  pq: private modulus
+//  crt: CRT components of the private key
+//
+void ss_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t pq, ss_crt_t *crt);
+
+//
+// Decrypt a file back into its original form on multiple threads.
+// The input is split into chunks at newline boundaries and the lines are decrypted in parallel.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+void ss_decrypt_file_mt(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, const ss_ctx_t *prepared);
+
+//
+// Decrypt a binary ciphertext container (see ssbin.h) back into its original form.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if the header is invalid or was written for a different key, or there is not
+//  enough memory for the record buffers
+//
+// Requires:
+//  infile: open and readable file stream to a binary container
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d.
+//       The key fingerprint can only be checked when crt is given, since n = p * pq.
+//  threads: number of threads to use, at least 1
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_bin(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, const ss_ctx_t *prepared);
+
+//
+// Decrypt a file through a reader/compute/writer pipeline (see pipeline.h).
+// Reading and writing overlap with the exponentiations; works on pipes as well as regular files.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if binary is set and the container header is invalid or for a different key
+//  or if there is not enough memory for the batch buffers
+//
+// Requires:
+//  infile: open and readable file stream to encrypted data
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  threads: number of compute threads to use, at least 1
+//  binary: infile is a binary ciphertext container instead of hexstrings
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_pipe(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    uint32_t threads, bool binary, const ss_ctx_t *prepared);
+
+//
+// Decrypt only the plaintext bytes [start, start + length) of a hexstring file or a binary
+// container, reading and decrypting just the blocks that cover them. The range is clipped at
+// the end of the plaintext.
+//
+// Provides:
+//  fills outfile with the requested plaintext bytes
+//  returns false if the container header is invalid or for a different key, if the file
+//  changed since index was built, or if a block that is needed is not a number
+//
+// Requires:
+//  infile: open and readable regular file, at the start of its hexstrings or container header
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  index: line offsets of infile from ssindex_open(), or NULL if infile is a binary container
+//  start: first plaintext byte to decrypt
+//  length: number of plaintext bytes to decrypt
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_range(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    ssindex_t *index, uint64_t start, uint64_t length, const ss_ctx_t *prepared);
+
+//
+// Hybrid file format, for data too large to encrypt block by block with SS.
+// A random ChaCha20-Poly1305 session key (see aead.h) is SS-encrypted, and the data is sealed
+// under it in chunks:
+//
+//  "SSHYBRID <version> <blocks>\n"
+//  <blocks> lines: the session key in the hexstring block format of ss_encrypt_file()
+//  chunks: up to SS_HYBRID_CHUNK bytes of ciphertext, then a 16-byte tag. Every chunk but the
+//          last is full; chunk i uses nonce i (little-endian, 8 bytes) with the last byte set
+//          to 1 on the final chunk, so truncation and reordering are detected.
+//
+#define SS_HYBRID_MAGIC   "SSHYBRID"
+#define SS_HYBRID_VERSION 1
+#define SS_HYBRID_CHUNK   (1 << 16)
+
+//
+// Encrypt an arbitrary file in hybrid mode: a fresh session key is SS-encrypted and the data
+// itself is streamed through ChaCha20-Poly1305 under that key.
+//
+// Provides:
+//  fills outfile with the hybrid header, the wrapped session key and the sealed chunks
+//  returns false if no random session key could be drawn
+//
+// Requires:
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  n: public exponent and modulus
+//  prepared: the key prepared with ss_ctx_init_encrypt(), copied instead of preparing n again,
+//   or NULL
+//
+bool ss_encrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t n, const ss_ctx_t *prepared);
+
+//
+// Decrypt a file written by ss_encrypt_file_hybrid().
+// Each chunk is checked before it is written, so output stops at the first chunk that fails.
+//
+// Provides:
+//  fills outfile with the unencrypted data from infile
+//  returns false if the header is invalid, the session key does not decrypt with this key,
+//  or a chunk fails authentication
+//
+// Requires:
+//  infile: open and readable file stream to hybrid ciphertext
+//  outfile: open and writable file stream
+//  d: private exponent, unused if crt is given
+//  pq: private modulus
+//  crt: CRT components of the private key, or NULL to decrypt with d
+//  prepared: the key prepared with ss_ctx_init_decrypt(), copied instead of preparing it again,
+//   or NULL
+//
+bool ss_decrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t d, mpz_t pq, ss_crt_t *crt,
+    const ss_ctx_t *prepared);
@@ -0,0 +1,133 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "ssbin.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x00000100000001b3ULL
+
+static void put_be(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+//
+// Computes the 64-bit FNV-1a hash of a byte string.
+//
+// bytes: the bytes to hash
+// size: number of bytes
+//
+uint64_t ssbin_hash(const uint8_t *bytes, size_t size) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+//
+// Computes the fingerprint of a public key: 64-bit FNV-1a over the big-endian bytes of n.
+//
+// n: public modulus
+//
+uint64_t ssbin_fingerprint(mpz_t n) {
+    size_t count;
+    uint8_t *bytes = (uint8_t *) mpz_export(NULL, &count, 1, sizeof(uint8_t), 1, 0, n);
+    uint64_t hash = ssbin_hash(bytes, count);
+    // the buffer came from GMP's allocator, which need not be malloc()
+    void (*gmp_free)(void *, size_t);
+    mp_get_memory_functions(NULL, NULL, &gmp_free);
+    gmp_free(bytes, count);
+    return hash;
+}
+
+//
+// Returns the record width needed for ciphertexts under the public key n.
+//
+// n: public modulus
+//
+uint32_t ssbin_width(mpz_t n) {
+    return (mpz_sizeinbase(n, 2) + 7) / 8;
+}
+
+//
+// Writes a container header.
+//
+// header: the header to write
+// outfile: open and writable file stream
+//
+void ssbin_write_header(ssbin_header_t *header, FILE *outfile) {
+    uint8_t bytes[SSBIN_HEADER_SIZE] = { 0 };
+    memcpy(bytes, SSBIN_MAGIC, 4);
+    put_be(&bytes[4], header->version, 2);
+    put_be(&bytes[8], header->fingerprint, 8);
+    put_be(&bytes[16], header->k, 4);
+    put_be(&bytes[20], header->width, 4);
+    put_be(&bytes[24], header->count, 8);
+    fwrite(bytes, sizeof(uint8_t), SSBIN_HEADER_SIZE, outfile);
+}
+
+//
+// Reads and validates a container header.
+// Returns false if the magic or version is wrong or the header is truncated.
+//
+// header: filled with the header read
+// infile: open and readable file stream
+//
+bool ssbin_read_header(ssbin_header_t *header, FILE *infile) {
+    uint8_t bytes[SSBIN_HEADER_SIZE];
+    if (fread(bytes, sizeof(uint8_t), SSBIN_HEADER_SIZE, infile) != SSBIN_HEADER_SIZE) {
+        return false;
+    }
+    if (memcmp(bytes, SSBIN_MAGIC, 4) != 0) {
+        return false;
+    }
+    header->version = get_be(&bytes[4], 2);
+    header->fingerprint = get_be(&bytes[8], 8);
+    header->k = get_be(&bytes[16], 4);
+    header->width = get_be(&bytes[20], 4);
+    header->count = get_be(&bytes[24], 8);
+    return header->version == SSBIN_VERSION && header->width > 0;
+}
+
+//
+// Stores c as a big-endian, zero-padded record of exactly width bytes.
+//
+// record: width bytes of space
+// width: record width from the header
+// c: ciphertext, must fit in width bytes
+//
+void ssbin_pack(uint8_t *record, uint32_t width, mpz_t c) {
+    size_t used = (mpz_sizeinbase(c, 2) + 7) / 8;
+    if (mpz_sgn(c) == 0) {
+        used = 0;
+    }
+    memset(record, 0, width - used);
+    mpz_export(&record[width - used], NULL, 1, sizeof(uint8_t), 1, 0, c);
+}
+
+//
+// Loads a ciphertext from a record written by ssbin_pack().
+//
+// c: set to the ciphertext
+// record: width bytes
+// width: record width from the header
+//
+void ssbin_unpack(mpz_t c, const uint8_t *record, uint32_t width) {
+    mpz_import(c, width, 1, sizeof(uint8_t), 1, 0, record);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+//
+// Binary ciphertext container.
+//
+// A 32-byte header followed by fixed-width ciphertext records. All integers are big-endian.
+//
+//  offset  size  field
+//       0     4  magic "SSBC"
+//       4     2  version
+//       6     2  reserved, 0
+//       8     8  fingerprint of the public key n
+//      16     4  plaintext block size k
+//      20     4  record width: bytes per ciphertext block
+//      24     8  number of blocks, SSBIN_COUNT_UNKNOWN if the writer could not seek back
+//
+#define SSBIN_MAGIC         "SSBC"
+#define SSBIN_VERSION       1
+#define SSBIN_HEADER_SIZE   32
+#define SSBIN_COUNT_UNKNOWN UINT64_MAX
+
+typedef struct {
+    uint16_t version;
+    uint64_t fingerprint;
+    uint32_t k;
+    uint32_t width;
+    uint64_t count;
+} ssbin_header_t;
+
+//
+// Computes the 64-bit FNV-1a hash of a byte string.
+//
+// bytes: the bytes to hash
+// size: number of bytes
+//
+uint64_t ssbin_hash(const uint8_t *bytes, size_t size);
+
+//
+// Computes the fingerprint of a public key: 64-bit FNV-1a over the big-endian bytes of n.
+//
+// n: public modulus
+//
+uint64_t ssbin_fingerprint(mpz_t n);
+
+//
+// Returns the record width needed for ciphertexts under the public key n.
+//
+// n: public modulus
+//
+uint32_t ssbin_width(mpz_t n);
+
+//
+// Writes a container header.
+//
+// header: the header to write
+// outfile: open and writable file stream
+//
+void ssbin_write_header(ssbin_header_t *header, FILE *outfile);
+
+//
+// Reads and validates a container header.
+// Returns false if the magic or version is wrong or the header is truncated.
+//
+// header: filled with the header read
+// infile: open and readable file stream
+//
+bool ssbin_read_header(ssbin_header_t *header, FILE *infile);
+
+//
+// Stores c as a big-endian, zero-padded record of exactly width bytes.
+//
+// record: width bytes of space
+// width: record width from the header
+// c: ciphertext, must fit in width bytes
+//
+void ssbin_pack(uint8_t *record, uint32_t width, mpz_t c);
+
+//
+// Loads a ciphertext from a record written by ssbin_pack().
+//
+// c: set to the ciphertext
+// record: width bytes
+// width: record width from the header
+//
+void ssbin_unpack(mpz_t c, const uint8_t *record, uint32_t width);
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> //getopt().
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <gmp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ss.h"
+#include "arena.h"
+#include "hex.h"
+#include "pool.h"
+#include "ssproto.h"
+
+#define OPTIONS "n:d:s:t:vh"
+
+// a batch holds this many SIMD groups per pool thread
+#define GROUPS_PER_THREAD 4
+
+//
+// The blocks of one request, queued for the batcher until all of them are computed.
+//
+typedef struct job {
+    uint8_t op; // SSPROTO_ENCRYPT or SSPROTO_DECRYPT
+    uint64_t count; // blocks
+    mpz_t *in, *out; // each block before and after its exponentiation
+    uint64_t taken; // blocks already moved into a batch
+    uint64_t remaining; // blocks not computed yet
+    pthread_cond_t done; // signalled when remaining reaches 0
+    struct job *next; // the job queued after this one
+} job_t;
+
+//
+// The loaded keys, the queue of jobs, and the batch the pool is working on.
+//
+typedef struct {
+    bool has_pub, has_priv;
+    uint64_t k; // bytes per plaintext block, with the 0xFF in front
+    uint64_t digits; // hex digits of n, the longest ciphertext line without its newline
+    uint64_t plain_bytes; // room for an exported plaintext block
+    pool_t *pool;
+    ss_ctx_t *enc, *dec; // one prepared key per pool thread, for the keys that are loaded
+    uint32_t lanes; // SIMD lanes of an encryption group
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a job is queued
+    job_t *head, *tail;
+
+    // Only the batcher thread and the pool touch the batch.
+    uint8_t op;
+    uint64_t capacity; // blocks per batch
+    uint64_t count; // blocks in the batch
+    mpz_t *in, *out;
+    job_t **jobs; // the job each block came from
+    uint64_t *slots; // and its index in that job
+} server_t;
+
+typedef struct {
+    server_t *server;
+    int fd;
+} connection_t;
+
+// removed again when the daemon is stopped
+static const char *socket_name = "ssd.sock";
+
+// SIGINT and SIGTERM: take the socket down with the daemon
+static void stop(int number) {
+    (void) number;
+    unlink(socket_name);
+    _exit(0);
+}
+
+// encrypts one group of blocks, as many as the thread's context has SIMD lanes
+static void encrypt_group(void *arg, uint64_t index, uint32_t thread) {
+    server_t *server = (server_t *) arg;
+    uint64_t first = index * server->lanes;
+    uint64_t count = server->count - first < server->lanes ? server->count - first : server->lanes;
+    ss_encrypt_batch_ctx(&server->enc[thread], &server->out[first], &server->in[first], count);
+}
+
+static void decrypt_one(void *arg, uint64_t index, uint32_t thread) {
+    server_t *server = (server_t *) arg;
+    ss_decrypt_ctx(&server->dec[thread], server->out[index], server->in[index]);
+}
+
+//
+// Fills batches from the queue and runs them on the pool, forever.
+// Blocks of every waiting job of the same operation share a batch, so many small concurrent
+// requests fill the SIMD lanes and threads together. Nothing waits for a batch to fill: one is
+// started as soon as the previous one is done, with whatever has queued up meanwhile.
+//
+static void *batcher(void *arg) {
+    server_t *server = (server_t *) arg;
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->head == NULL) {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+        // Take blocks in queue order from the jobs of the oldest job's kind. The numbers are
+        // swapped in and out, so they move between a job and the batch without being copied.
+        server->op = server->head->op;
+        server->count = 0;
+        job_t *previous = NULL;
+        for (job_t *job = server->head; job != NULL && server->count < server->capacity;) {
+            job_t *next = job->next;
+            while (job->op == server->op && job->taken < job->count
+                && server->count < server->capacity) {
+                mpz_swap(server->in[server->count], job->in[job->taken]);
+                server->jobs[server->count] = job;
+                server->slots[server->count] = job->taken;
+                job->taken++;
+                server->count++;
+            }
+            if (job->op == server->op && job->taken == job->count) {
+                // every block is in a batch now, so the job leaves the queue
+                if (previous == NULL) {
+                    server->head = next;
+                } else {
+                    previous->next = next;
+                }
+                if (server->tail == job) {
+                    server->tail = previous;
+                }
+            } else {
+                previous = job;
+            }
+            job = next;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (server->op == SSPROTO_ENCRYPT) {
+            uint64_t groups = (server->count + server->lanes - 1) / server->lanes;
+            pool_run(server->pool, encrypt_group, server, groups);
+        } else {
+            pool_run(server->pool, decrypt_one, server, server->count);
+        }
+
+        pthread_mutex_lock(&server->lock);
+        for (uint64_t i = 0; i < server->count; i++) {
+            job_t *job = server->jobs[i];
+            mpz_swap(job->out[server->slots[i]], server->out[i]);
+            if (--job->remaining == 0) {
+                pthread_cond_signal(&job->done);
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+    return NULL;
+}
+
+static void job_init(job_t *job, uint8_t op, uint64_t count) {
+    job->op = op;
+    job->count = 0;
+    job->in = (mpz_t *) malloc(count * sizeof(mpz_t));
+    job->out = (mpz_t *) malloc(count * sizeof(mpz_t));
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_inits(job->in[i], job->out[i], NULL);
+    }
+}
+
+// count is the number of blocks job_init() was given
+static void job_clear(job_t *job, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_clears(job->in[i], job->out[i], NULL);
+    }
+    free(job->in);
+    free(job->out);
+}
+
+// splits plaintext into blocks exactly like ss_encrypt_file(): a short or empty block always
+// follows the full ones
+static uint64_t import_plaintext(server_t *server, job_t *job, const uint8_t *text, uint64_t size) {
+    uint64_t full = server->k - 1;
+    uint64_t count = size / full + 1;
+    job_init(job, SSPROTO_ENCRYPT, count);
+    uint8_t *block = (uint8_t *) malloc(server->k);
+    block[0] = 0xFF;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t j = size - i * full < full ? size - i * full : full;
+        memcpy(&block[1], &text[i * full], j);
+        mpz_import(job->in[i], j + 1, 1, sizeof(uint8_t), 1, 0, block);
+    }
+    job->count = count;
+    free(block);
+    return count;
+}
+
+// parses hexstring lines like ss_decrypt_file(), skipping any that are not numbers
+static uint64_t import_ciphertext(job_t *job, const char *text, uint64_t size) {
+    uint64_t count = 0;
+    for (const char *line = text; line < text + size; count++) {
+        const char *newline = (const char *) memchr(line, '\n', text + size - line);
+        line = newline != NULL ? newline + 1 : text + size;
+    }
+    job_init(job, SSPROTO_DECRYPT, count);
+    for (uint64_t start = 0; start < size;) {
+        const char *newline = (const char *) memchr(&text[start], '\n', size - start);
+        uint64_t end = newline != NULL ? (uint64_t) (newline - text) : size;
+        if (hex_decode(job->in[job->count], &text[start], end - start)) {
+            job->count++;
+        }
+        start = end + 1;
+    }
+    return count;
+}
+
+// queues a job and waits for the batcher to compute all of its blocks
+static void run_job(server_t *server, job_t *job) {
+    if (job->count == 0) {
+        return;
+    }
+    job->taken = 0;
+    job->remaining = job->count;
+    job->next = NULL;
+    pthread_cond_init(&job->done, NULL);
+    pthread_mutex_lock(&server->lock);
+    if (server->tail == NULL) {
+        server->head = job;
+    } else {
+        server->tail->next = job;
+    }
+    server->tail = job;
+    pthread_cond_signal(&server->work);
+    while (job->remaining > 0) {
+        pthread_cond_wait(&job->done, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    pthread_cond_destroy(&job->done);
+}
+
+// writes the ciphertexts as hexstring lines, the same text as ss_encrypt_file()
+static uint64_t format_ciphertext(server_t *server, job_t *job, uint8_t **reply) {
+    char *text = (char *) malloc(job->count * (server->digits + 1) + 1);
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < job->count; i++) {
+        size += hex_encode(&text[size], job->out[i]);
+        text[size++] = '\n';
+    }
+    *reply = (uint8_t *) text;
+    return size;
+}
+
+// writes the bytes of each plaintext after its 0xFF, the same bytes as ss_decrypt_file()
+static uint64_t format_plaintext(server_t *server, job_t *job, uint8_t **reply) {
+    uint8_t *bytes = (uint8_t *) malloc(job->count * server->plain_bytes + 1);
+    uint8_t *block = (uint8_t *) malloc(server->plain_bytes);
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < job->count; i++) {
+        size_t j = 0;
+        mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, job->out[i]);
+        if (j > 1) {
+            memcpy(&bytes[size], &block[1], j - 1);
+            size += j - 1;
+        }
+    }
+    free(block);
+    *reply = bytes;
+    return size;
+}
+
+// answers one request, returns false if the reply could not be sent
+static bool answer(server_t *server, int fd, ssproto_header_t *request, uint8_t *payload) {
+    const char *error = NULL;
+    if (request->op != SSPROTO_ENCRYPT && request->op != SSPROTO_DECRYPT) {
+        error = "unknown operation";
+    } else if (request->op == SSPROTO_ENCRYPT && !server->has_pub) {
+        error = "no public key loaded";
+    } else if (request->op == SSPROTO_DECRYPT && !server->has_priv) {
+        error = "no private key loaded";
+    }
+    if (error != NULL) {
+        return ssproto_send(fd, request->op, SSPROTO_ERROR, error, strlen(error));
+    }
+
+    job_t job;
+    uint64_t allocated = request->op == SSPROTO_ENCRYPT
+        ? import_plaintext(server, &job, payload, request->length)
+        : import_ciphertext(&job, (const char *) payload, request->length);
+    run_job(server, &job);
+    uint8_t *reply;
+    uint64_t size = request->op == SSPROTO_ENCRYPT ? format_ciphertext(server, &job, &reply)
+                                                   : format_plaintext(server, &job, &reply);
+    job_clear(&job, allocated);
+
+    bool sent;
+    if (size > UINT32_MAX) {
+        error = "reply too large, send less at a time";
+        sent = ssproto_send(fd, request->op, SSPROTO_ERROR, error, strlen(error));
+    } else {
+        sent = ssproto_send(fd, request->op, SSPROTO_OK, reply, size);
+    }
+    free(reply);
+    return sent;
+}
+
+// serves the requests of one client until it disconnects
+static void *serve(void *arg) {
+    connection_t *connection = (connection_t *) arg;
+    ssproto_header_t request;
+    uint8_t *payload;
+    while ((payload = ssproto_recv(connection->fd, &request, SSPROTO_MAX_PAYLOAD)) != NULL) {
+        bool sent = answer(connection->server, connection->fd, &request, payload);
+        free(payload);
+        if (!sent) {
+            break;
+        }
+    }
+    close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+// opens a key file, returns NULL if it is missing and was not asked for by name
+static FILE *open_key(const char *name, bool given, const char *kind) {
+    FILE *file = fopen(name, "r");
+    if (file == NULL && given) {
+        fprintf(stderr, "Error: unable to open %s key file -- '%s'\n", kind, name);
+        exit(1);
+    }
+    return file;
+}
+
+int main(int argc, char **argv) {
+    // GMP allocates from per-thread free lists; must come before any mpz_t is initialized.
+    arena_enable();
+
+    int opt = 0;
+
+    // disable verbose by default
+    int verbose = 0;
+
+    // single-threaded by default
+    uint32_t threads = 1;
+
+    // default names for files; keys named with -n or -d must exist, the defaults may not
+    char *pub_key_name = "ss.pub";
+    char *priv_key_name = "ss.priv";
+    bool pub_given = false, priv_given = false;
+
+    // help_message
+    const char *help_message
+        = "SYNOPSIS\n"
+          "   Serves SS encryption and decryption over a Unix domain socket.\n"
+          "   Keys are loaded and prepared once, and the blocks of concurrent requests\n"
+          "   are batched together.\n"
+          "\n"
+          "USAGE\n"
+          "   ./ssd [OPTIONS]\n"
+          "\n"
+          "OPTIONS\n"
+          "   -h              Display program help and usage.\n"
+          "   -v              Display verbose program output.\n"
+          "   -n pbfile       Public key file, for encryption (default: ss.pub if it exists).\n"
+          "   -d pvfile       Private key file, for decryption (default: ss.priv if it exists).\n"
+          "   -s socket       Socket to listen on (default: ssd.sock).\n"
+          "   -t threads      Number of threads to compute with (default: 1).\n";
+
+    // 1. Parse command-line options using getopt() and handle them accordingly.
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'n':
+            pub_key_name = optarg;
+            pub_given = true;
+            break;
+        case 'd':
+            priv_key_name = optarg;
+            priv_given = true;
+            break;
+        case 's': socket_name = optarg; break;
+        case 't':
+            if (!pool_parse_threads(&threads, optarg)) {
+                fprintf(stderr, "Error: invalid number of threads -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v': verbose = 1; break;
+        case 'h': printf("%s", help_message); return 1;
+        default:
+            fprintf(stderr,
+                "Usage: %s [-n pbfile] [-d pvfile] [-s socket] [-t threads] [-v] [-h]\n", argv[0]);
+            exit(1);
+        }
+    }
+    // 2. Load whichever keys there are, the same way encrypt and decrypt do.
+    server_t server = { 0 };
+    FILE *pub_key_file = open_key(pub_key_name, pub_given, "public");
+    FILE *priv_key_file = open_key(priv_key_name, priv_given, "private");
+    if (pub_key_file == NULL && priv_key_file == NULL) {
+        fprintf(stderr, "Error: no key files -- '%s', '%s'\n", pub_key_name, priv_key_name);
+        exit(1);
+    }
+    mpz_t n, pq, d;
+    mpz_inits(n, pq, d, NULL);
+    char username[250];
+    ss_crt_t crt;
+    ss_crt_init(&crt);
+    bool has_crt = false;
+    server.has_pub = pub_key_file != NULL;
+    server.has_priv = priv_key_file != NULL;
+    if (server.has_pub) {
+        if (!ss_key_is_bin(pub_key_file)) {
+            ss_read_pub(n, username, pub_key_file);
+        } else if (!ss_read_pub_bin(n, username, sizeof(username), pub_key_file)) {
+            fprintf(stderr, "Error: invalid public key file -- '%s'\n", pub_key_name);
+            exit(1);
+        }
+        fclose(pub_key_file);
+    }
+    if (server.has_priv) {
+        if (!ss_key_is_bin(priv_key_file)) {
+            has_crt = ss_read_priv_crt(pq, d, &crt, priv_key_file);
+        } else if (!(has_crt = ss_read_priv_bin(pq, d, &crt, priv_key_file))) {
+            fprintf(stderr, "Error: invalid private key file -- '%s'\n", priv_key_name);
+            exit(1);
+        }
+        fclose(priv_key_file);
+    }
+    arena_fit(server.has_pub ? mpz_sizeinbase(n, 2) : 2 * mpz_sizeinbase(pq, 2));
+
+    if (verbose) {
+        if (server.has_pub) {
+            gmp_printf("user = %s\n", username);
+            gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
+        }
+        if (server.has_priv) {
+            gmp_printf("pq (%d bits) = %Zd\n", mpz_sizeinbase(pq, 2), pq);
+            gmp_printf("d  (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        }
+    }
+
+    // 3. Prepare the keys once per pool thread, and a batch of numbers to go with them.
+    server.pool = pool_create(threads);
+    server.lanes = 1;
+    if (server.has_pub) {
+        server.enc = (ss_ctx_t *) malloc(threads * sizeof(ss_ctx_t));
+        ss_ctx_init_encrypt(&server.enc[0], n);
+        for (uint32_t t = 1; t < threads; t++) {
+            ss_ctx_init_copy(&server.enc[t], &server.enc[0]);
+        }
+        server.k = server.enc[0].k;
+        server.digits = mpz_sizeinbase(n, 16);
+        server.lanes = server.enc[0].vec.lanes;
+    }
+    if (server.has_priv) {
+        server.dec = (ss_ctx_t *) malloc(threads * sizeof(ss_ctx_t));
+        ss_ctx_init_decrypt(&server.dec[0], d, pq, has_crt ? &crt : NULL);
+        for (uint32_t t = 1; t < threads; t++) {
+            ss_ctx_init_copy(&server.dec[t], &server.dec[0]);
+        }
+        server.plain_bytes = (mpz_sizeinbase(pq, 2) + 7) / 8;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+    server.capacity = (uint64_t) GROUPS_PER_THREAD * server.lanes * threads;
+    server.in = (mpz_t *) malloc(server.capacity * sizeof(mpz_t));
+    server.out = (mpz_t *) malloc(server.capacity * sizeof(mpz_t));
+    for (uint64_t i = 0; i < server.capacity; i++) {
+        mpz_inits(server.in[i], server.out[i], NULL);
+    }
+    server.jobs = (job_t **) malloc(server.capacity * sizeof(job_t *));
+    server.slots = (uint64_t *) malloc(server.capacity * sizeof(uint64_t));
+
+    // 4. Listen on the socket, readable and writable by this user only, since it serves the
+    // private key. A socket left behind by a daemon that died is replaced, a live one is not.
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_name) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path too long -- '%s'\n", socket_name);
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_name);
+    int probe = ssproto_connect(socket_name);
+    if (probe >= 0) {
+        fprintf(stderr, "Error: a daemon is already listening on socket -- '%s'\n", socket_name);
+        exit(1);
+    }
+    unlink(socket_name);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    bool bound
+        = listener >= 0 && bind(listener, (struct sockaddr *) &address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: unable to listen on socket -- '%s'\n", socket_name);
+        exit(1);
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t batch_thread;
+    pthread_create(&batch_thread, NULL, batcher, &server);
+    if (verbose) {
+        fprintf(stderr, "listening on %s with %u threads, %u lanes\n", socket_name, threads,
+            server.lanes);
+    }
+
+    // 5. One thread per client parses its requests and formats its replies; the batcher and
+    // the pool do the exponentiations for all of them.
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        connection_t *connection = (connection_t *) malloc(sizeof(connection_t));
+        connection->server = &server;
+        connection->fd = fd;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, serve, connection) != 0) {
+            close(fd);
+            free(connection);
+        }
+        pthread_attr_destroy(&attributes);
+    }
+}
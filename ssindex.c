@@ -0,0 +1,168 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapfile.h"
+#include "ssindex.h"
+
+static void put_be(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// appends an offset, growing the array as needed
+static void add_offset(ssindex_t *index, uint64_t *capacity, uint64_t offset) {
+    if (index->count == *capacity) {
+        *capacity = *capacity > 0 ? 2 * *capacity : 1024;
+        index->offsets = (uint64_t *) realloc(index->offsets, (*capacity + 1) * sizeof(uint64_t));
+    }
+    index->offsets[index->count++] = offset;
+}
+
+// scans infile for the start of every non-empty line, the same lines ss_decrypt_file() reads
+static void build_index(ssindex_t *index, FILE *infile) {
+    uint64_t capacity = 0;
+    index->count = 0;
+    index->offsets = (uint64_t *) malloc(sizeof(uint64_t));
+
+    mapfile_t map;
+    mapfile_open(&map, infile);
+    const char *text = (const char *) map.data;
+    for (uint64_t start = 0; start < map.size;) {
+        const char *newline = (const char *) memchr(&text[start], '\n', map.size - start);
+        uint64_t end = newline != NULL ? (uint64_t) (newline - text) : map.size;
+        if (end > start) {
+            add_offset(index, &capacity, start);
+        }
+        start = end + 1;
+    }
+    mapfile_close(&map, infile);
+}
+
+// reads a sidecar, returns false if it is missing, damaged or stale
+static bool read_index(ssindex_t *index, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t header[SSINDEX_HEADER_SIZE];
+    bool ok = fread(header, sizeof(header), 1, file) == 1 && memcmp(header, SSINDEX_MAGIC, 4) == 0
+        && get_be(&header[4], 2) == SSINDEX_VERSION && get_be(&header[8], 8) == index->size
+        && get_be(&header[16], 8) == index->mtime;
+    // a line takes at least two bytes with its newline, which bounds a damaged count
+    uint64_t count = get_be(&header[24], 8);
+    ok = ok && count <= index->size / 2 + 1;
+
+    uint8_t *bytes = ok ? (uint8_t *) malloc(count * 8 + 1) : NULL;
+    ok = ok && fread(bytes, 8, count, file) == count && fgetc(file) == EOF;
+    fclose(file);
+
+    if (ok) {
+        index->count = count;
+        index->offsets = (uint64_t *) malloc((count + 1) * sizeof(uint64_t));
+        for (uint64_t i = 0; i < count; i++) {
+            index->offsets[i] = get_be(&bytes[8 * i], 8);
+            // lines are non-empty, so offsets strictly increase and stay inside the file
+            ok = ok && index->offsets[i] < index->size
+                && (i == 0 || index->offsets[i] > index->offsets[i - 1]);
+        }
+        if (!ok) {
+            free(index->offsets);
+        }
+    }
+    free(bytes);
+    return ok;
+}
+
+// writes a sidecar through a temporary file, so readers never see half of one
+static void write_index(ssindex_t *index, const char *path) {
+    uint8_t header[SSINDEX_HEADER_SIZE] = { 0 };
+    memcpy(header, SSINDEX_MAGIC, 4);
+    put_be(&header[4], SSINDEX_VERSION, 2);
+    put_be(&header[8], index->size, 8);
+    put_be(&header[16], index->mtime, 8);
+    put_be(&header[24], index->count, 8);
+
+    uint8_t *bytes = (uint8_t *) malloc(index->count * 8 + 1);
+    for (uint64_t i = 0; i < index->count; i++) {
+        put_be(&bytes[8 * i], index->offsets[i], 8);
+    }
+
+    // The process id keeps concurrent runs from writing into each other's temporary file.
+    char *temp = (char *) malloc(strlen(path) + 32);
+    sprintf(temp, "%s.%ld", path, (long) getpid());
+    FILE *file = fopen(temp, "w");
+    bool written = file != NULL && fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(bytes, 8, index->count, file) == index->count;
+    written = file != NULL && fclose(file) == 0 && written;
+    written = written && rename(temp, path) == 0;
+    if (!written) {
+        remove(temp);
+    }
+    free(temp);
+    free(bytes);
+}
+
+//
+// Loads the index of a ciphertext file from its sidecar, or builds it by scanning the lines and
+// saves it for later runs if the sidecar is missing, stale or damaged. A sidecar that cannot be
+// written is not an error. Leaves infile at its start.
+//
+// Provides:
+//  index: the line offsets of infile
+//  returns false if infile is not a regular file
+//
+// Requires:
+//  index: the index to fill in, cleared with ssindex_clear() once this returns true
+//  path: name of the ciphertext file; the sidecar is path with SSINDEX_SUFFIX appended
+//  infile: the open ciphertext file, at its start
+//
+bool ssindex_open(ssindex_t *index, const char *path, FILE *infile) {
+    struct stat info;
+    if (fstat(fileno(infile), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    index->size = info.st_size;
+    index->mtime = (uint64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+
+    char *sidecar = (char *) malloc(strlen(path) + sizeof(SSINDEX_SUFFIX));
+    sprintf(sidecar, "%s%s", path, SSINDEX_SUFFIX);
+    if (!read_index(index, sidecar)) {
+        build_index(index, infile);
+        write_index(index, sidecar);
+        rewind(infile);
+    }
+    free(sidecar);
+
+    // the end of the file closes the last line
+    index->offsets[index->count] = index->size;
+    return true;
+}
+
+//
+// Frees the line offsets.
+//
+// Requires:
+//  index: filled in by ssindex_open()
+//
+void ssindex_clear(ssindex_t *index) {
+    free(index->offsets);
+    index->offsets = NULL;
+    index->count = 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Block index of a hexstring ciphertext file.
+//
+// Hexstring lines vary in length, so finding block i means knowing where line i starts. The
+// index records every line offset in a sidecar file next to the ciphertext, built on first use
+// and rebuilt whenever the ciphertext's size or modification time changes. Binary containers
+// (ssbin.h) need no index, since their records have a fixed width.
+//
+// A 32-byte header followed by one 8-byte line offset per block. All integers are big-endian.
+//
+//  offset  size  field
+//       0     4  magic "SSIX"
+//       4     2  version
+//       6     2  reserved, 0
+//       8     8  bytes in the ciphertext file
+//      16     8  modification time of the ciphertext file, in nanoseconds
+//      24     8  number of lines
+//
+#define SSINDEX_MAGIC       "SSIX"
+#define SSINDEX_VERSION     1
+#define SSINDEX_HEADER_SIZE 32
+#define SSINDEX_SUFFIX      ".idx"
+
+typedef struct {
+    uint64_t size; // bytes in the ciphertext file
+    uint64_t mtime; // modification time of the ciphertext file, in nanoseconds
+    uint64_t count; // lines, one per block
+    uint64_t *offsets; // where each line starts, plus the file size as a last entry
+} ssindex_t;
+
+//
+// Loads the index of a ciphertext file from its sidecar, or builds it by scanning the lines and
+// saves it for later runs if the sidecar is missing, stale or damaged. A sidecar that cannot be
+// written is not an error. Leaves infile at its start.
+//
+// Provides:
+//  index: the line offsets of infile
+//  returns false if infile is not a regular file
+//
+// Requires:
+//  index: the index to fill in, cleared with ssindex_clear() once this returns true
+//  path: name of the ciphertext file; the sidecar is path with SSINDEX_SUFFIX appended
+//  infile: the open ciphertext file, at its start
+//
+bool ssindex_open(ssindex_t *index, const char *path, FILE *infile);
+
+//
+// Frees the line offsets.
+//
+// Requires:
+//  index: filled in by ssindex_open()
+//
+void ssindex_clear(ssindex_t *index);
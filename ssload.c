@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> //getopt().
+#include <pthread.h>
+
+#include "pool.h"
+#include "ssproto.h"
+#include "stats.h"
+
+#define OPTIONS "s:c:r:l:dh"
+
+//
+// One simulated client: a connection of its own, sending requests back to back.
+//
+typedef struct {
+    const char *socket_name;
+    uint8_t op; // SSPROTO_ENCRYPT, or SSPROTO_DECRYPT to send back what encrypting returned
+    uint32_t id;
+    uint64_t requests;
+    uint64_t length; // plaintext bytes per message
+    uint64_t *latencies; // ns per request sent
+    uint64_t sent; // requests sent, the ones with a latency; none if connecting failed
+    uint64_t errors; // requests that failed or came back wrong
+} client_t;
+
+static void *run_client(void *arg) {
+    client_t *client = (client_t *) arg;
+    int fd = ssproto_connect(client->socket_name);
+    if (fd < 0) {
+        client->errors = client->requests;
+        return NULL;
+    }
+
+    // each client sends its own message, different from the others'
+    uint8_t *message = (uint8_t *) malloc(client->length + 1);
+    unsigned int seed = client->id;
+    for (uint64_t i = 0; i < client->length; i++) {
+        message[i] = rand_r(&seed);
+    }
+    uint8_t *payload = message;
+    uint64_t size = client->length;
+    ssproto_header_t reply;
+    if (client->op == SSPROTO_DECRYPT) {
+        payload = ssproto_call(fd, SSPROTO_ENCRYPT, message, client->length, &reply);
+        if (payload == NULL || reply.status != SSPROTO_OK) {
+            client->errors = client->requests;
+            free(payload);
+            free(message);
+            close(fd);
+            return NULL;
+        }
+        size = reply.length;
+    }
+
+    for (uint64_t r = 0; r < client->requests; r++) {
+        uint64_t start = stats_clock();
+        uint8_t *answer = ssproto_call(fd, client->op, payload, size, &reply);
+        client->latencies[r] = stats_clock() - start;
+        client->sent++;
+        bool ok = answer != NULL && reply.status == SSPROTO_OK;
+        if (ok && client->op == SSPROTO_DECRYPT) {
+            ok = reply.length == client->length && memcmp(answer, message, client->length) == 0;
+        }
+        client->errors += !ok;
+        free(answer);
+    }
+
+    if (payload != message) {
+        free(payload);
+    }
+    free(message);
+    close(fd);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// the nearest-rank percentile of sorted latencies, in microseconds
+static double percentile(const uint64_t *sorted, uint64_t count, double p) {
+    uint64_t rank = (uint64_t) (p / 100 * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0] / 1e3;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+
+    // default load: 8 clients sending 1000 messages of 64 bytes each
+    uint32_t clients = 8;
+    uint64_t requests = 1000;
+    uint64_t length = 64;
+
+    // encryption requests by default
+    uint8_t op = SSPROTO_ENCRYPT;
+
+    const char *socket_name = "ssd.sock";
+
+    // help_message
+    const char *help_message
+        = "SYNOPSIS\n"
+          "   Measures the latency of a running ssd under concurrent load.\n"
+          "\n"
+          "USAGE\n"
+          "   ./ssload [OPTIONS]\n"
+          "\n"
+          "OPTIONS\n"
+          "   -h              Display program help and usage.\n"
+          "   -s socket       Socket the daemon listens on (default: ssd.sock).\n"
+          "   -c clients      Number of concurrent clients (default: 8).\n"
+          "   -r requests     Requests sent by each client, one after another (default: 1000).\n"
+          "   -l length       Plaintext bytes per message (default: 64).\n"
+          "   -d              Send decryption requests, and check the plaintext that comes back.\n";
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's': socket_name = optarg; break;
+        case 'c':
+            if (!pool_parse_threads(&clients, optarg)) {
+                fprintf(stderr, "Error: invalid number of clients -- '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r': requests = strtoull(optarg, NULL, 10); break;
+        case 'l': length = strtoull(optarg, NULL, 10); break;
+        case 'd': op = SSPROTO_DECRYPT; break;
+        case 'h': printf("%s", help_message); return 1;
+        default:
+            fprintf(stderr,
+                "Usage: %s [-s socket] [-c clients] [-r requests] [-l length] [-d] [-h]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (requests < 1 || length > SSPROTO_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: need at least 1 request, and at most %u bytes\n",
+            SSPROTO_MAX_PAYLOAD);
+        exit(1);
+    }
+
+    client_t *runs = (client_t *) calloc(clients, sizeof(client_t));
+    pthread_t *threads = (pthread_t *) malloc(clients * sizeof(pthread_t));
+    uint64_t *latencies = (uint64_t *) malloc(clients * requests * sizeof(uint64_t));
+    uint64_t start = stats_clock();
+    for (uint32_t c = 0; c < clients; c++) {
+        runs[c] = (client_t) { socket_name, op, c + 1, requests, length, &latencies[c * requests],
+            0, 0 };
+        pthread_create(&threads[c], NULL, run_client, &runs[c]);
+    }
+    // Only the latencies of requests that were sent count, packed together for sorting: a client
+    // that could not connect or encrypt its message leaves its slots unwritten.
+    uint64_t errors = 0, sent = 0;
+    for (uint32_t c = 0; c < clients; c++) {
+        pthread_join(threads[c], NULL);
+        errors += runs[c].errors;
+        memmove(&latencies[sent], runs[c].latencies, runs[c].sent * sizeof(uint64_t));
+        sent += runs[c].sent;
+    }
+    double seconds = (stats_clock() - start) / 1e9;
+
+    uint64_t total = clients * requests;
+    if (errors == total || sent == 0) {
+        fprintf(stderr, "Error: every request failed, is ssd listening on socket -- '%s'\n",
+            socket_name);
+        exit(1);
+    }
+    qsort(latencies, sent, sizeof(uint64_t), compare);
+    printf("ssload: %u clients x %lu %s requests of %lu bytes in %.3f s: %.0f requests/s, "
+           "%lu errors\n",
+        clients, (unsigned long) requests, op == SSPROTO_ENCRYPT ? "encrypt" : "decrypt",
+        (unsigned long) length, seconds, sent / seconds, (unsigned long) errors);
+    printf("latency: p50 = %.1f us, p90 = %.1f us, p99 = %.1f us, max = %.1f us\n",
+        percentile(latencies, sent, 50), percentile(latencies, sent, 90),
+        percentile(latencies, sent, 99), latencies[sent - 1] / 1e3);
+
+    free(runs);
+    free(threads);
+    free(latencies);
+    return errors > 0;
+}
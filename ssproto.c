@@ -0,0 +1,217 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ssproto.h"
+
+static void put_be(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// writes all of bytes; MSG_NOSIGNAL turns a peer that went away into an error, not SIGPIPE
+static bool send_all(int fd, const uint8_t *bytes, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// reads exactly size bytes, returns false on a short read
+static bool recv_all(int fd, uint8_t *bytes, size_t size) {
+    while (size > 0) {
+        ssize_t got = recv(fd, bytes, size, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+//
+// Connects to a daemon.
+//
+// Provides:
+//  returns the connected socket, or -1 on failure
+//
+// Requires:
+//  path: path of the daemon's socket
+//
+int ssproto_connect(const char *path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+//
+// Sends one message.
+//
+// Provides:
+//  returns false if the connection failed
+//
+// Requires:
+//  fd: connected socket
+//  op: operation
+//  status: SSPROTO_OK or SSPROTO_ERROR
+//  payload: length bytes
+//  length: payload bytes
+//
+bool ssproto_send(int fd, uint8_t op, uint8_t status, const void *payload, uint32_t length) {
+    uint8_t header[SSPROTO_HEADER_SIZE] = { op, status, 0, 0 };
+    put_be(&header[4], length, 4);
+    return send_all(fd, header, sizeof(header)) && send_all(fd, (const uint8_t *) payload, length);
+}
+
+//
+// Receives one message.
+//
+// Provides:
+//  header: the message header
+//  returns the payload, to be freed with free(), or NULL if the connection closed or failed or
+//  the payload is longer than limit
+//
+// Requires:
+//  fd: connected socket
+//  limit: longest payload to accept, SSPROTO_MAX_PAYLOAD for requests
+//
+uint8_t *ssproto_recv(int fd, ssproto_header_t *header, uint32_t limit) {
+    uint8_t bytes[SSPROTO_HEADER_SIZE];
+    if (!recv_all(fd, bytes, sizeof(bytes))) {
+        return NULL;
+    }
+    header->op = bytes[0];
+    header->status = bytes[1];
+    header->length = get_be(&bytes[4], 4);
+    if (header->length > limit) {
+        return NULL;
+    }
+    // one spare byte, so an error message can be terminated in place
+    uint8_t *payload = (uint8_t *) malloc((size_t) header->length + 1);
+    if (!recv_all(fd, payload, header->length)) {
+        free(payload);
+        return NULL;
+    }
+    payload[header->length] = '\0';
+    return payload;
+}
+
+//
+// Sends a request and waits for its reply.
+//
+// Provides:
+//  reply: the reply header
+//  returns the reply payload, to be freed with free(), or NULL if the connection failed
+//
+// Requires:
+//  fd: connected socket
+//  op: SSPROTO_ENCRYPT or SSPROTO_DECRYPT
+//  payload: length bytes
+//  length: at most SSPROTO_MAX_PAYLOAD
+//
+uint8_t *ssproto_call(
+    int fd, uint8_t op, const void *payload, uint32_t length, ssproto_header_t *reply) {
+    if (!ssproto_send(fd, op, SSPROTO_OK, payload, length)) {
+        return NULL;
+    }
+    // replies are not limited like requests, since ciphertext is larger than its plaintext
+    return ssproto_recv(fd, reply, UINT32_MAX);
+}
+
+//
+// Sends all of infile to a daemon as one request and writes the reply to outfile.
+// This is the client mode of the encrypt and decrypt programs.
+//
+// Provides:
+//  fills outfile with the reply payload
+//  error: what failed, when this returns false
+//  returns false if the daemon could not be reached, the input was too large, or the daemon
+//  replied with an error
+//
+// Requires:
+//  path: path of the daemon's socket
+//  op: SSPROTO_ENCRYPT or SSPROTO_DECRYPT
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  error: error_size bytes of room
+//
+bool ssproto_request_file(const char *path, uint8_t op, FILE *infile, FILE *outfile, char *error,
+    size_t error_size) {
+    // Read one byte past the limit, to tell an input that fits exactly from one that does not.
+    size_t capacity = 1 << 16, size = 0;
+    uint8_t *input = (uint8_t *) malloc(capacity);
+    while (size <= SSPROTO_MAX_PAYLOAD) {
+        if (size == capacity) {
+            capacity *= 2;
+            input = (uint8_t *) realloc(input, capacity);
+        }
+        size_t got = fread(&input[size], sizeof(uint8_t), capacity - size, infile);
+        if (got == 0) {
+            break;
+        }
+        size += got;
+    }
+    if (size > SSPROTO_MAX_PAYLOAD) {
+        snprintf(error, error_size, "input is larger than the daemon accepts");
+        free(input);
+        return false;
+    }
+
+    int fd = ssproto_connect(path);
+    if (fd < 0) {
+        snprintf(error, error_size, "unable to connect to daemon");
+        free(input);
+        return false;
+    }
+    ssproto_header_t reply;
+    uint8_t *output = ssproto_call(fd, op, input, size, &reply);
+    close(fd);
+    free(input);
+
+    bool ok = output != NULL && reply.status == SSPROTO_OK;
+    if (output == NULL) {
+        snprintf(error, error_size, "lost connection to daemon");
+    } else if (!ok) {
+        snprintf(error, error_size, "daemon: %s", (const char *) output);
+    } else {
+        fwrite(output, sizeof(uint8_t), reply.length, outfile);
+    }
+    free(output);
+    return ok;
+}
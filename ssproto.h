@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Wire protocol of the ssd key daemon, spoken over a Unix domain stream socket.
+//
+// Every message is an 8-byte header followed by length bytes of payload. All integers are
+// big-endian. A client sends requests and reads one reply per request, in order, on the same
+// connection; it may keep the connection open for as many requests as it likes.
+//
+//  offset  size  field
+//       0     1  operation
+//       1     1  status, SSPROTO_OK in requests
+//       2     2  reserved, 0
+//       4     4  payload length, at most SSPROTO_MAX_PAYLOAD in requests
+//
+// SSPROTO_ENCRYPT takes plaintext and replies with its hexstring ciphertext lines, and
+// SSPROTO_DECRYPT takes hexstring lines and replies with the plaintext: the same bytes as the
+// encrypt and decrypt programs with the daemon's keys. A reply with SSPROTO_ERROR status carries
+// a message instead.
+//
+#define SSPROTO_HEADER_SIZE 8
+#define SSPROTO_MAX_PAYLOAD (64u << 20)
+
+#define SSPROTO_ENCRYPT 1
+#define SSPROTO_DECRYPT 2
+
+#define SSPROTO_OK    0
+#define SSPROTO_ERROR 1
+
+typedef struct {
+    uint8_t op;
+    uint8_t status;
+    uint32_t length;
+} ssproto_header_t;
+
+//
+// Connects to a daemon.
+//
+// Provides:
+//  returns the connected socket, or -1 on failure
+//
+// Requires:
+//  path: path of the daemon's socket
+//
+int ssproto_connect(const char *path);
+
+//
+// Sends one message.
+//
+// Provides:
+//  returns false if the connection failed
+//
+// Requires:
+//  fd: connected socket
+//  op: operation
+//  status: SSPROTO_OK or SSPROTO_ERROR
+//  payload: length bytes
+//  length: payload bytes
+//
+bool ssproto_send(int fd, uint8_t op, uint8_t status, const void *payload, uint32_t length);
+
+//
+// Receives one message.
+//
+// Provides:
+//  header: the message header
+//  returns the payload, to be freed with free(), or NULL if the connection closed or failed or
+//  the payload is longer than limit
+//
+// Requires:
+//  fd: connected socket
+//  limit: longest payload to accept, SSPROTO_MAX_PAYLOAD for requests
+//
+uint8_t *ssproto_recv(int fd, ssproto_header_t *header, uint32_t limit);
+
+//
+// Sends a request and waits for its reply.
+//
+// Provides:
+//  reply: the reply header
+//  returns the reply payload, to be freed with free(), or NULL if the connection failed
+//
+// Requires:
+//  fd: connected socket
+//  op: SSPROTO_ENCRYPT or SSPROTO_DECRYPT
+//  payload: length bytes
+//  length: at most SSPROTO_MAX_PAYLOAD
+//
+uint8_t *ssproto_call(
+    int fd, uint8_t op, const void *payload, uint32_t length, ssproto_header_t *reply);
+
+//
+// Sends all of infile to a daemon as one request and writes the reply to outfile.
+// This is the client mode of the encrypt and decrypt programs.
+//
+// Provides:
+//  fills outfile with the reply payload
+//  error: what failed, when this returns false
+//  returns false if the daemon could not be reached, the input was too large, or the daemon
+//  replied with an error
+//
+// Requires:
+//  path: path of the daemon's socket
+//  op: SSPROTO_ENCRYPT or SSPROTO_DECRYPT
+//  infile: open and readable file stream
+//  outfile: open and writable file stream
+//  error: error_size bytes of room
+//
+bool ssproto_request_file(const char *path, uint8_t op, FILE *infile, FILE *outfile, char *error,
+    size_t error_size);
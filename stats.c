@@ -0,0 +1,237 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+typedef struct {
+    stats_t stats;
+    bool registered; // true once the exit destructor is set up for this thread
+} own_t;
+
+static const char *stage_names[STATS_STAGES]
+    = { "read", "import", "powm", "format", "write", "make_prime", "is_prime" };
+
+static const char *counter_names[STATS_COUNTERS]
+    = { "blocks", "bytes_in", "bytes_out", "candidates", "rounds" };
+
+bool stats_enabled = false;
+
+static _Thread_local own_t own;
+
+// when stats_enable() was called
+static uint64_t started;
+
+// totals from threads that have exited
+static stats_t retired;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static void add_stats(stats_t *total, stats_t *stats) {
+    for (int s = 0; s < STATS_STAGES; s++) {
+        total->calls[s] += stats->calls[s];
+        total->ns[s] += stats->ns[s];
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            total->histogram[s][b] += stats->histogram[s][b];
+        }
+    }
+    for (int c = 0; c < STATS_COUNTERS; c++) {
+        total->counters[c] += stats->counters[c];
+    }
+}
+
+// runs when a thread that collected statistics exits: keep its totals
+static void thread_exit(void *arg) {
+    own_t *mine = (own_t *) arg;
+    pthread_mutex_lock(&retired_lock);
+    add_stats(&retired, &mine->stats);
+    pthread_mutex_unlock(&retired_lock);
+    memset(&mine->stats, 0, sizeof(mine->stats));
+    mine->registered = false;
+}
+
+static void exit_key_init(void) {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+static stats_t *own_stats(void) {
+    if (!own.registered) {
+        pthread_once(&exit_once, exit_key_init);
+        pthread_setspecific(exit_key, &own);
+        own.registered = true;
+    }
+    return &own.stats;
+}
+
+//
+// Starts collecting statistics and the clock for throughput.
+// Call before starting any threads.
+//
+// Provides:
+//  returns false if the program was built without SS_STATS
+//
+bool stats_enable(void) {
+#ifdef SS_STATS
+    stats_enabled = true;
+    started = stats_clock();
+    return true;
+#else
+    return false;
+#endif
+}
+
+//
+// Adds one call of a stage that started at start to the calling thread's totals.
+//
+// stage: the stage that ran
+// start: stats_clock() when it started
+//
+void stats_time(stats_stage_t stage, uint64_t start) {
+    stats_t *stats = own_stats();
+    uint64_t ns = stats_clock() - start;
+    // the bucket is the position of the highest set bit
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    stats->calls[stage] += 1;
+    stats->ns[stage] += ns;
+    stats->histogram[stage][bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1] += 1;
+}
+
+//
+// Adds amount to one of the calling thread's counters.
+//
+// counter: the counter to add to
+// amount: how much to add
+//
+void stats_add(stats_counter_t counter, uint64_t amount) {
+    own_stats()->counters[counter] += amount;
+}
+
+//
+// Adds up the statistics of the calling thread and every thread that has exited.
+//
+// stats: filled with the totals
+//
+void stats_collect(stats_t *stats) {
+    pthread_mutex_lock(&retired_lock);
+    *stats = retired;
+    pthread_mutex_unlock(&retired_lock);
+    add_stats(stats, &own.stats);
+}
+
+// prints a duration in the largest unit that keeps it at least 1, to three significant digits
+static void print_duration(FILE *file, uint64_t ns) {
+    if (ns >= 1000000000) {
+        fprintf(file, "%.3gs", ns / 1e9);
+    } else if (ns >= 1000000) {
+        fprintf(file, "%.3gms", ns / 1e6);
+    } else if (ns >= 1000) {
+        fprintf(file, "%.3gus", ns / 1e3);
+    } else {
+        fprintf(file, "%luns", (unsigned long) ns);
+    }
+}
+
+static void report_text(FILE *file, stats_t *stats, uint64_t elapsed) {
+    double seconds = elapsed / 1e9;
+    uint64_t *counters = stats->counters;
+    fprintf(file,
+        "stats: elapsed = %.6f s, blocks = %lu (%.0f/s), in = %lu bytes (%.2f MB/s), "
+        "out = %lu bytes\n",
+        seconds, (unsigned long) counters[STATS_BLOCKS],
+        seconds > 0 ? counters[STATS_BLOCKS] / seconds : 0.0,
+        (unsigned long) counters[STATS_BYTES_IN],
+        seconds > 0 ? counters[STATS_BYTES_IN] / seconds / 1e6 : 0.0,
+        (unsigned long) counters[STATS_BYTES_OUT]);
+    if (counters[STATS_CANDIDATES] > 0 || counters[STATS_ROUNDS] > 0) {
+        fprintf(file, "stats: candidates = %lu, Miller-Rabin rounds = %lu\n",
+            (unsigned long) counters[STATS_CANDIDATES], (unsigned long) counters[STATS_ROUNDS]);
+    }
+
+    fprintf(file, "%-12s %12s %14s %12s\n", "stage", "calls", "total ms", "mean us");
+    for (int s = 0; s < STATS_STAGES; s++) {
+        if (stats->calls[s] == 0) {
+            continue;
+        }
+        fprintf(file, "%-12s %12lu %14.3f %12.3f\n", stage_names[s],
+            (unsigned long) stats->calls[s], stats->ns[s] / 1e6,
+            stats->ns[s] / 1e3 / stats->calls[s]);
+    }
+
+    // one line per stage, listing only the buckets that were hit
+    for (int s = 0; s < STATS_STAGES; s++) {
+        if (stats->calls[s] == 0) {
+            continue;
+        }
+        fprintf(file, "%s latency:", stage_names[s]);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (stats->histogram[s][b] == 0) {
+                continue;
+            }
+            fprintf(file, " [");
+            print_duration(file, (uint64_t) 1 << b);
+            fprintf(file, ", ");
+            if (b < STATS_BUCKETS - 1) {
+                print_duration(file, (uint64_t) 1 << (b + 1));
+            } else {
+                fprintf(file, "inf");
+            }
+            fprintf(file, ") %lu", (unsigned long) stats->histogram[s][b]);
+        }
+        fprintf(file, "\n");
+    }
+}
+
+static void report_json(FILE *file, stats_t *stats, uint64_t elapsed) {
+    double seconds = elapsed / 1e9;
+    uint64_t *counters = stats->counters;
+    fprintf(file, "{\"elapsed_ns\": %lu", (unsigned long) elapsed);
+    for (int c = 0; c < STATS_COUNTERS; c++) {
+        fprintf(file, ", \"%s\": %lu", counter_names[c], (unsigned long) counters[c]);
+    }
+    fprintf(file, ", \"blocks_per_s\": %.1f, \"mb_per_s\": %.3f, \"stages\": {",
+        seconds > 0 ? counters[STATS_BLOCKS] / seconds : 0.0,
+        seconds > 0 ? counters[STATS_BYTES_IN] / seconds / 1e6 : 0.0);
+    bool first = true;
+    for (int s = 0; s < STATS_STAGES; s++) {
+        if (stats->calls[s] == 0) {
+            continue;
+        }
+        fprintf(file, "%s\"%s\": {\"calls\": %lu, \"ns\": %lu, \"histogram\": [", first ? "" : ", ",
+            stage_names[s], (unsigned long) stats->calls[s], (unsigned long) stats->ns[s]);
+        first = false;
+        // each entry is {"min_ns": 2^b, "calls": count} for the buckets that were hit
+        bool first_bucket = true;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (stats->histogram[s][b] == 0) {
+                continue;
+            }
+            fprintf(file, "%s{\"min_ns\": %lu, \"calls\": %lu}", first_bucket ? "" : ", ",
+                (unsigned long) 1 << b, (unsigned long) stats->histogram[s][b]);
+            first_bucket = false;
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "}}\n");
+}
+
+//
+// Prints stats_collect() with the time since stats_enable() and the throughput: a table of
+// stages and counters as text, or a single JSON object.
+//
+// file: open and writable file stream
+// json: print JSON instead of text
+//
+void stats_report(FILE *file, bool json) {
+    stats_t stats;
+    stats_collect(&stats);
+    uint64_t elapsed = stats_clock() - started;
+    if (json) {
+        report_json(file, &stats, elapsed);
+    } else {
+        report_text(file, &stats, elapsed);
+    }
+}
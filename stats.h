@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+//
+// Hot-path instrumentation for --stats.
+//
+// Every instrumented stage is timed with the monotonic clock into per-thread totals and a
+// histogram of call latencies, and a few counters track the work done. Threads fold their totals
+// into a shared copy when they exit, like the arena statistics, so nothing is shared while the
+// stages run.
+//
+// The macros only do anything when the program is compiled with -DSS_STATS (the Makefile's
+// default, turned off with make STATS=0). Without it they compile to nothing and stats_enable()
+// returns false. With it, a stage costs one load and branch until stats_enable() is called.
+//
+#define STATS_BUCKETS 32 // bucket b counts calls taking [2^b, 2^(b+1)) ns, the last one the rest
+
+typedef enum {
+    STATS_READ, // fread() of input, or splitting a mapped input into lines or records
+    STATS_IMPORT, // bytes or ciphertext text into numbers
+    STATS_POWM, // one block, or one SIMD group of blocks
+    STATS_FORMAT, // numbers into ciphertext text, records or plaintext bytes
+    STATS_WRITE, // fwrite() of output
+    STATS_MAKE_PRIME, // one prime found by keygen
+    STATS_IS_PRIME, // one Miller-Rabin test
+    STATS_STAGES
+} stats_stage_t;
+
+typedef enum {
+    STATS_BLOCKS, // blocks encrypted or decrypted
+    STATS_BYTES_IN, // bytes of input imported
+    STATS_BYTES_OUT, // bytes of output written
+    STATS_CANDIDATES, // prime candidates of the right size drawn
+    STATS_ROUNDS, // Miller-Rabin rounds executed, native and mont backends only
+    STATS_COUNTERS
+} stats_counter_t;
+
+typedef struct {
+    uint64_t calls[STATS_STAGES];
+    uint64_t ns[STATS_STAGES];
+    uint64_t histogram[STATS_STAGES][STATS_BUCKETS];
+    uint64_t counters[STATS_COUNTERS];
+} stats_t;
+
+// set by stats_enable(), read by the macros
+extern bool stats_enabled;
+
+// nanoseconds on the monotonic clock
+static inline uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifdef SS_STATS
+#define STATS_START(start)  uint64_t start = stats_enabled ? stats_clock() : 0
+#define STATS_STOP(stage, start)                                                                   \
+    do {                                                                                           \
+        if (stats_enabled) {                                                                       \
+            stats_time(stage, start);                                                              \
+        }                                                                                          \
+    } while (0)
+#define STATS_ADD(counter, amount)                                                                 \
+    do {                                                                                           \
+        if (stats_enabled) {                                                                       \
+            stats_add(counter, amount);                                                            \
+        }                                                                                          \
+    } while (0)
+#else
+#define STATS_START(start)
+#define STATS_STOP(stage, start)   ((void) 0)
+#define STATS_ADD(counter, amount) ((void) 0)
+#endif
+
+//
+// Starts collecting statistics and the clock for throughput.
+// Call before starting any threads.
+//
+// Provides:
+//  returns false if the program was built without SS_STATS
+//
+bool stats_enable(void);
+
+//
+// Adds one call of a stage that started at start to the calling thread's totals.
+//
+// stage: the stage that ran
+// start: stats_clock() when it started
+//
+void stats_time(stats_stage_t stage, uint64_t start);
+
+//
+// Adds amount to one of the calling thread's counters.
+//
+// counter: the counter to add to
+// amount: how much to add
+//
+void stats_add(stats_counter_t counter, uint64_t amount);
+
+//
+// Adds up the statistics of the calling thread and every thread that has exited.
+//
+// stats: filled with the totals
+//
+void stats_collect(stats_t *stats);
+
+//
+// Prints stats_collect() with the time since stats_enable() and the throughput: a table of
+// stages and counters as text, or a single JSON object.
+//
+// file: open and writable file stream
+// json: print JSON instead of text
+//
+void stats_report(FILE *file, bool json);